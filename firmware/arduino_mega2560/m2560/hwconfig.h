@@ -61,6 +61,24 @@ static void inline led_timer_init(void)
 #define PANEL_TASK
 #endif
 
+#if (USE_MOUSE != 0)
+
+// the spinner/trackball inputs (see MOUSE_xxx_INDEX in pinmap.h) are decoded
+// in the pin change interrupts 0 (port B) and 1 (port J)
+
+#define MOUSE_PCINT_vect      PCINT0_vect
+#define MOUSE_PCINT_ALT_vect  PCINT1_vect
+
+static void inline mouse_pcint_init(void)
+{
+	PCMSK0 |= (1 << PCINT5) | (1 << PCINT6) | (1 << PCINT7); // B5, B6, B7
+	PCMSK1 |= (1 << PCINT10); // J1
+	PCIFR = (1 << PCIF0) | (1 << PCIF1);
+	PCICR |= (1 << PCIE0) | (1 << PCIE1);
+}
+
+#endif
+
 
 /****************************************
  ADC config
@@ -29,6 +29,7 @@
 #define USE_MOUSE 1
 #define USE_CONSUMER 0
 #define USE_KEYBOARD 1
+#define USE_KEYBOARD_NKRO 0
 
 
 #endif
@@ -58,6 +58,22 @@ static void inline led_timer_init(void)
 #define PANEL_TASK
 #endif
 
+#if (USE_MOUSE != 0)
+
+// the spinner/trackball inputs (see MOUSE_xxx_INDEX in pinmap.h) are all on port B,
+// so they are decoded in the pin change interrupt 0
+
+#define MOUSE_PCINT_vect PCINT0_vect
+
+static void inline mouse_pcint_init(void)
+{
+	PCMSK0 |= (1 << PCINT5) | (1 << PCINT6) | (1 << PCINT3) | (1 << PCINT1); // B5, B6, B3, B1
+	PCIFR = (1 << PCIF0);
+	PCICR |= (1 << PCIE0);
+}
+
+#endif
+
 
 /****************************************
  ADC config
@@ -29,6 +29,7 @@
 #define USE_MOUSE 0
 #define USE_CONSUMER 1
 #define USE_KEYBOARD 1
+#define USE_KEYBOARD_NKRO 0
 
 
 
@@ -145,7 +145,29 @@ enum HID_ConsumerCodes
 
 const USB_Descriptor_HIDReport_Datatype_t PROGMEM PanelReport[] =
 {
-	#if (USE_KEYBOARD != 0)
+	#if (USE_KEYBOARD != 0) && (USE_KEYBOARD_NKRO != 0)
+	0x05, 0x01,             // USAGE_PAGE (Generic Desktop)
+	0x09, 0x06,             // USAGE (Keyboard)
+	0xa1, 0x01,             // COLLECTION (Application)
+	0x85, ID_KeyboardNKRO,  //   REPORT_ID (ID_KeyboardNKRO)
+	0x05, 0x07,             //   USAGE_PAGE (Keyboard)
+	0x19, KEY_LeftControl,  //   USAGE_MINIMUM (Keyboard LeftControl)
+	0x29, KEY_RightGUI,     //   USAGE_MAXIMUM (Keyboard RightGUI)
+	0x15, 0x00,             //   LOGICAL_MINIMUM (0)
+	0x25, 0x01,             //   LOGICAL_MAXIMUM (1)
+	0x75, 0x01,             //   REPORT_SIZE (1)
+	0x95, 0x08,             //   REPORT_COUNT (8)
+	0x81, 0x02,             //   INPUT (Data,Var,Abs)
+	0x19, NKRO_FIRST_KEY,   //   USAGE_MINIMUM (NKRO_FIRST_KEY)
+	0x29, NKRO_LAST_KEY,    //   USAGE_MAXIMUM (NKRO_LAST_KEY)
+	0x95, NKRO_NUM_KEYS,    //   REPORT_COUNT (NKRO_NUM_KEYS)
+	0x81, 0x02,             //   INPUT (Data,Var,Abs)
+	#if ((NKRO_BITMAP_SIZE * 8) > NKRO_NUM_KEYS)
+	0x95, (NKRO_BITMAP_SIZE * 8) - NKRO_NUM_KEYS, //   REPORT_COUNT (padding)
+	0x81, 0x03,             //   INPUT (Cnst,Var,Abs)
+	#endif
+	0xc0,                   // END_COLLECTION
+	#elif (USE_KEYBOARD != 0)
 	0x05, 0x01,             // USAGE_PAGE (Generic Desktop)
 	0x09, 0x06,             // USAGE (Keyboard)
 	0xa1, 0x01,             // COLLECTION (Application)
@@ -342,9 +364,9 @@ const USB_Descriptor_HIDReport_Datatype_t PROGMEM PanelReport[] =
 	0x05, 0x01,             //     USAGE_PAGE (Generic Desktop)
 	0x09, 0x30,             //     USAGE (X)
 	0x09, 0x31,             //     USAGE (Y)
-	0x15, 0x81,             //     LOGICAL_MINIMUM (-127)
-	0x25, 0x7f,             //     LOGICAL_MAXIMUM (127)
-	0x75, 0x08,             //     REPORT_SIZE (8)
+	HID_RI_LOGICAL_MINIMUM(16, -32767),
+	HID_RI_LOGICAL_MAXIMUM(16, 32767),
+	0x75, 0x10,             //     REPORT_SIZE (16)
 	0x95, 0x02,             //     REPORT_COUNT (2)
 	0x81, 0x06,             //     INPUT (Data,Var,Rel)
 	0xc0,                   //   END_COLLECTION
@@ -50,6 +50,7 @@
 #include <avr/pgmspace.h>
 #include <LUFA/Drivers/USB/USB.h>
 #include <hwconfig.h>
+#include "panel.h"
 
 #define XYZ_TO_BCD(a,b,c) \
 	((uint16_t)(((a)/10) % 10) << 12) | \
@@ -105,7 +106,11 @@ typedef struct
 
 /** Size in bytes of the Panel HID reporting IN endpoint. */
 #define MISC_EPSIZE            64
+#if (USE_KEYBOARD != 0) && (USE_KEYBOARD_NKRO != 0) && (NKRO_REPORT_SIZE > 8)
+#define PANEL_EPSIZE           16
+#else
 #define PANEL_EPSIZE            8
+#endif
 #define LED_EPSIZE             64
 
 #define MISC_INTERVAL_MS   10
@@ -76,23 +76,18 @@ int main(void)
 
 		#if defined(PANEL_TASK)
 
+		// only take a report if there is room in the tx buffer, the pending
+		// reports stay queued in the panel and are sent by priority
+
+		msg_t * const ptxmsg = msg_prepare();
 		uint8_t * pdata = NULL;
-		uint8_t const ndata = panel_get_report(&pdata);
+		uint8_t const ndata = panel_get_report((ptxmsg != NULL) ? &pdata : NULL);
 
 		if (ndata > 0)
 		{
-			msg_t * const ptxmsg = msg_prepare();
-
-			if (ptxmsg != NULL)
-			{
-				memcpy(&ptxmsg->data[0], pdata, ndata);
-				ptxmsg->nlen = ndata;
-				msg_send();
-			}
-			else
-			{
-				DbgOut(DBGERROR, "main_led, tx buffer overflow");
-			}
+			memcpy(&ptxmsg->data[0], pdata, ndata);
+			ptxmsg->nlen = ndata;
+			msg_send();
 
 			continue;
 		}
@@ -153,12 +153,12 @@ static void main_task(void)
 	/* Select the Joystick Report Endpoint */
 	Endpoint_SelectEndpoint(PANEL_EPADDR);
 
+	#if defined(DATA_RX_UART_vect)
+
 	/* Check to see if the host is ready for another packet */
 	if (!Endpoint_IsINReady())
 		return;
 
-	#if defined(DATA_RX_UART_vect)
-
 	msg_t * const pmsg = msg_recv();
 
 	if (pmsg != NULL)
@@ -185,8 +185,9 @@ static void main_task(void)
 
 	#elif defined(PANEL_TASK)
 
+	/* Keep scanning the inputs while the host is not ready for another packet */
 	uint8_t * pdata;
-	uint8_t const ndata = panel_get_report(&pdata);
+	uint8_t const ndata = panel_get_report(Endpoint_IsINReady() ? &pdata : NULL);
 
 	if (ndata > 0)
 	{
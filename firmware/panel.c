@@ -71,29 +71,113 @@ enum {
 };
 #endif
 
+#if (USE_KEYBOARD != 0) && (USE_KEYBOARD_NKRO != 0)
+#if defined(DATA_TX_UART_vect) && (NKRO_REPORT_SIZE > 8)
+#error "the NKRO keyboard report does not fit into the 8 byte uart frame, reduce the range NKRO_FIRST_KEY..NKRO_LAST_KEY"
+#endif
+#if (NKRO_FIRST_KEY < 0x04) || (NKRO_LAST_KEY > 0x65) || (NKRO_FIRST_KEY > NKRO_LAST_KEY)
+#error "invalid NKRO key range"
+#endif
+#endif
+
+#if (USE_KEYBOARD_NKRO != 0)
+#define KEYBOARD_REPORT_SIZE NKRO_REPORT_SIZE
+#else
+#define KEYBOARD_REPORT_SIZE 8
+#endif
+
+#if (USE_KEYBOARD != 0) && (KEYBOARD_REPORT_SIZE > 8)
+static uint8_t ReportBuffer[KEYBOARD_REPORT_SIZE];
+#else
 static uint8_t ReportBuffer[8];
+#endif
 static uint8_t InputState[NUMBER_OF_INPUTS];
 static uint8_t shift_key = 0;
 static uint8_t shift_key_cleanup = 0;
-static uint8_t need_key_update = 0;
-static uint8_t need_consumer_update = 0;
+
+// report scheduler, every report id with new data is pending since the panel tick that changed it.
+// The pending report with the earliest deadline (pending time + latency target of the report id)
+// is sent first, as many as the endpoint takes.
+
+#define NUM_REPORT_IDS (ID_KeyboardNKRO + 1)
+
+#if !defined(LATENCY_KEYBOARD_MS)
+#define LATENCY_KEYBOARD_MS   4
+#endif
+#if !defined(LATENCY_CONSUMER_MS)
+#define LATENCY_CONSUMER_MS  16
+#endif
+#if !defined(LATENCY_JOYSTICK_MS)
+#define LATENCY_JOYSTICK_MS   4
+#endif
+#if !defined(LATENCY_ACCELGYRO_MS)
+#define LATENCY_ACCELGYRO_MS  8
+#endif
+#if !defined(LATENCY_MOUSE_MS)
+#define LATENCY_MOUSE_MS      2
+#endif
+
+static const uint8_t ReportLatencyMs[NUM_REPORT_IDS] =
+{
+	[ID_Keyboard]     = LATENCY_KEYBOARD_MS,
+	[ID_Consumer]     = LATENCY_CONSUMER_MS,
+	[ID_Joystick1]    = LATENCY_JOYSTICK_MS,
+	[ID_Joystick2]    = LATENCY_JOYSTICK_MS,
+	[ID_Joystick3]    = LATENCY_JOYSTICK_MS,
+	[ID_Joystick4]    = LATENCY_JOYSTICK_MS,
+	[ID_AccelGyro]    = LATENCY_ACCELGYRO_MS,
+	[ID_Mouse]        = LATENCY_MOUSE_MS,
+	[ID_KeyboardNKRO] = LATENCY_KEYBOARD_MS,
+};
+
+static uint16_t report_pending = 0;        // bit per report id
+static uint16_t report_pending_input = 0;  // the subset that was set by input edges (not by the analog refresh)
+static uint16_t report_pending_since_ms[NUM_REPORT_IDS];
+static uint16_t panel_time_ms = 0;
+
+#if defined(ENABLE_PANEL_STATS)
+static panel_stats_t report_stats[NUM_REPORT_IDS];
+#endif
+
+
+// accumulated report state, updated on the debounced input edges (see SetNeedUpdate),
+// so that building a report does not need to look at all inputs again
+
+#if (USE_KEYBOARD != 0)
+static uint8_t keyboard_report[KEYBOARD_REPORT_SIZE]; // report id, modifiers, key slots or key bitmap
+#if (USE_KEYBOARD_NKRO == 0)
+static uint8_t keyboard_overflow = 0;
+#endif
+#endif
+
+static uint8_t consumer_state = 0;
+
+typedef struct {
+	uint8_t directions; // JOY_DIR_xxx bits, in the order of the codes J1_Left .. J1_Down
+	uint8_t buttons;
+} joy_state_t;
+
+enum {
+	JOY_DIR_LEFT  = 1 << (J1_Left - J1_Left),
+	JOY_DIR_RIGHT = 1 << (J1_Right - J1_Left),
+	JOY_DIR_UP    = 1 << (J1_Up - J1_Left),
+	JOY_DIR_DOWN  = 1 << (J1_Down - J1_Left),
+};
 
 #if (NUM_JOYSTICKS >= 1)
-static uint8_t need_joystick_update[NUM_JOYSTICKS];
+static joy_state_t joy_state[NUM_JOYSTICKS];
 #endif
 
 #if (USE_ACCELGYRO)
-static uint8_t need_accelgyro_update = 0;
+static joy_state_t accelgyro_state;
 #endif
 
 #if (USE_MOUSE != 0)
-static uint8_t need_mouse_update = 0;
-static uint8_t mouse_x_last_clk_state = 0;
-static uint8_t mouse_x_last_dir_state = 0;
-static int8_t mouse_x_count = 0;
-static uint8_t mouse_y_last_clk_state = 0;
-static uint8_t mouse_y_last_dir_state = 0;
-static int8_t mouse_y_count = 0;
+static uint8_t mouse_buttons = 0;
+static uint8_t mouse_x_last_state = 0;
+static uint8_t mouse_y_last_state = 0;
+static volatile int16_t mouse_x_count = 0;
+static volatile int16_t mouse_y_count = 0;
 #if !defined(MOUSE_X_DELTA)
 #define MOUSE_X_DELTA 1
 #endif
@@ -103,12 +187,67 @@ static int8_t mouse_y_count = 0;
 #endif
 
 #if defined(ENABLE_ANALOG_INPUT)
-static uint16_t adc_values[NUM_ADC_CHANNELS] = {0};
+
+// ADC pipeline: the ISR stays on one channel for 2^ADC_OVERSAMPLING_LOG2 conversions and sums
+// them up (decimation), then the optional median-of-3 and IIR low-pass filters are applied.
+// adc_values[] hold the filtered values as 10.6 fixed point, a new report is only sent
+// if a value moved by more than ADC_DEADBAND (in 10 bit ADC steps) since the last one.
+
+#if !defined(ADC_OVERSAMPLING_LOG2)
+#define ADC_OVERSAMPLING_LOG2  2
+#endif
+
+#if !defined(ADC_MEDIAN_FILTER)
+#define ADC_MEDIAN_FILTER      0
+#endif
+
+#if !defined(ADC_IIR_SHIFT)
+#define ADC_IIR_SHIFT          2  // y += (x - y) / 2^ADC_IIR_SHIFT, 0 disables the filter
+#endif
+
+#if !defined(ADC_DEADBAND)
+#define ADC_DEADBAND           1
+#endif
+
+#define ADC_FRACT_BITS         6
+
+#if (ADC_OVERSAMPLING_LOG2 > ADC_FRACT_BITS)
+#error "ADC_OVERSAMPLING_LOG2 is limited to 6 (64 samples)"
+#endif
+
+static volatile uint16_t adc_values[NUM_ADC_CHANNELS] = {0};
+static uint16_t adc_reported[NUM_ADC_CHANNELS] = {0};
+#if (ADC_MEDIAN_FILTER != 0)
+static uint16_t adc_history[NUM_ADC_CHANNELS][2];
+#endif
 static const uint8_t adc_mux_table[NUM_ADC_CHANNELS] = {
 	#define MAP(port, pin, mux, minval, maxval, joyid, axis) mux,
 	ADC_MAPPING_TABLE(MAP)
 	#undef MAP
 };
+
+// has the filtered value moved out of the deadband around the last reported value?
+
+static uint8_t ADC_moved(uint8_t id)
+{
+	uint16_t x;
+
+	ATOMIC_BLOCK(ATOMIC_FORCEON)
+	{
+		x = adc_values[id];
+	}
+
+	uint16_t const d = (x > adc_reported[id]) ? (x - adc_reported[id]) : (adc_reported[id] - x);
+
+	if (d <= ((uint16_t)ADC_DEADBAND << ADC_FRACT_BITS)) {
+		return 0;
+	}
+
+	adc_reported[id] = x;
+
+	return 1;
+}
+
 #endif
 
 
@@ -139,29 +278,192 @@ static uint8_t IsConsumerCode(uint8_t key) { return (key >= AC_VolumeUp) && (key
 static uint8_t GetKey(uint8_t index) { return (shift_key != 0) ? GetKeyShiftMap(index) : GetKeyNormalMap(index); }
 
 
-#if (NUM_JOYSTICKS >= 1)
+// split a keyboard code into the modifier and the key it generates (for the key macros like KM_ALT_F4)
 
-static uint8_t IsJoystickCode(uint8_t key, uint8_t joy)
+static void SplitKeyboardCode(uint8_t key, uint8_t *pmod, uint8_t *pcode)
 {
-	key -= (joy * NR_OF_EVENTS_PER_JOY);
-
-	return (key >= J1_Left) && (key < (J1_Left + NR_OF_EVENTS_PER_JOY));
+	switch (key)
+	{
+	case KM_ALT_F4:
+		*pmod = MOD_LeftAlt;
+		*pcode = KEY_F4;
+		break;
+	case KM_SHIFT_F7:
+		*pmod = MOD_LeftShift;
+		*pcode = KEY_F7;
+		break;
+	default:
+		*pmod = IsModifierCode(key) ? key : 0;
+		*pcode = IsModifierCode(key) ? 0 : key;
+		break;
+	}
 }
 
-static uint8_t NeedJoystickUpdate(void)
+// is there still another input pressed that generates this code?
+// only evaluated on release edges, a code can be mapped to several inputs
+
+static uint8_t IsCodeDown(uint8_t code)
 {
 	uint8_t i;
 
-	for (i = 0; i < NUM_JOYSTICKS; i++)
+	for (i = 0; i < NUMBER_OF_INPUTS; i++)
 	{
-		if (need_joystick_update[i]) {
-			return 1;
+		if (IsKeyDown(i))
+		{
+			uint8_t const key = GetKey(i);
+
+			if (key == code) {
+				return 1;
+			}
+
+			if (IsKeyboardCode(key))
+			{
+				uint8_t mod;
+				uint8_t k;
+				SplitKeyboardCode(key, &mod, &k);
+
+				if ((mod == code) || (k == code)) {
+					return 1;
+				}
+			}
 		}
 	}
 
 	return 0;
 }
 
+static void UpdateStateBit(uint8_t *p, uint8_t mask, uint8_t code, uint8_t down)
+{
+	if (down)
+	{
+		*p |= mask;
+	}
+	else if (!IsCodeDown(code))
+	{
+		*p &= ~mask;
+	}
+}
+
+#if (USE_KEYBOARD != 0)
+
+static void KeyboardSetCode(uint8_t code, uint8_t down)
+{
+	if (IsModifierCode(code))
+	{
+		UpdateStateBit(&keyboard_report[1], ModifierBit(code), code, down);
+		return;
+	}
+
+	#if (USE_KEYBOARD_NKRO != 0)
+
+	if ((code >= NKRO_FIRST_KEY) && (code <= NKRO_LAST_KEY))
+	{
+		uint8_t const n = code - NKRO_FIRST_KEY;
+		UpdateStateBit(&keyboard_report[2 + (n >> 3)], 1 << (n & 0x07), code, down);
+	}
+
+	#else
+
+	uint8_t i;
+
+	if (down)
+	{
+		for (i = 2; i < sizeof(keyboard_report); i++)
+		{
+			if (keyboard_report[i] == code) {
+				return;
+			}
+
+			if (keyboard_report[i] == 0)
+			{
+				keyboard_report[i] = code;
+				return;
+			}
+		}
+
+		// all slots are in use, the key is reported when a slot gets free
+		keyboard_overflow = 1;
+	}
+	else if (!IsCodeDown(code))
+	{
+		for (i = 2; i < sizeof(keyboard_report); i++)
+		{
+			if (keyboard_report[i] == code)
+			{
+				memmove(&keyboard_report[i], &keyboard_report[i + 1], sizeof(keyboard_report) - i - 1);
+				keyboard_report[sizeof(keyboard_report) - 1] = 0;
+				break;
+			}
+		}
+
+		if (keyboard_overflow)
+		{
+			keyboard_overflow = 0;
+
+			for (i = 0; i < NUMBER_OF_INPUTS; i++)
+			{
+				uint8_t const key = GetKey(i);
+
+				if (IsKeyDown(i) && IsKeyboardCode(key) && !IsModifierCode(key))
+				{
+					uint8_t mod;
+					uint8_t k;
+					SplitKeyboardCode(key, &mod, &k);
+					KeyboardSetCode(k, 1);
+				}
+			}
+		}
+	}
+
+	#endif
+}
+
+static void KeyboardUpdate(uint8_t key, uint8_t down)
+{
+	uint8_t mod;
+	uint8_t code;
+
+	SplitKeyboardCode(key, &mod, &code);
+
+	if (mod != 0) {
+		KeyboardSetCode(mod, down);
+	}
+
+	if (code != 0) {
+		KeyboardSetCode(code, down);
+	}
+}
+
+#endif
+
+#if (NUM_JOYSTICKS >= 1) || (USE_ACCELGYRO)
+
+// 'event' is the code relative to the first code of the joystick (J1_Left .. J1_Button8)
+
+static void JoystickUpdate(joy_state_t *p, uint8_t key, uint8_t event, uint8_t down)
+{
+	if (event < (J1_Button1 - J1_Left))
+	{
+		UpdateStateBit(&p->directions, 1 << event, key, down);
+	}
+	else
+	{
+		UpdateStateBit(&p->buttons, JoyButtonBit(event + J1_Left), key, down);
+	}
+}
+
+#endif
+
+
+#if (NUM_JOYSTICKS >= 1)
+
+static uint8_t IsJoystickCode(uint8_t key, uint8_t joy)
+{
+	key -= (joy * NR_OF_EVENTS_PER_JOY);
+
+	return (key >= J1_Left) && (key < (J1_Left + NR_OF_EVENTS_PER_JOY));
+}
+
 #endif
 
 #if (USE_ACCELGYRO)
@@ -182,103 +484,145 @@ static uint8_t IsMouseButtonCode(uint8_t key)
 	return (key >= MB_Left) && (key <= MB_Middle);
 }
 
+// Quadrature decoder table, indexed by (last_state << 2) | state, with state = (clk << 1) | dir.
+// Every edge of either signal is counted (x4 decoding), invalid transitions (both signals
+// changed at once) are dropped.
+
+static const int8_t QuadratureTable[16] =
+{
+	 0, +1, -1,  0,
+	-1,  0,  0, +1,
+	+1,  0,  0, -1,
+	 0, -1, +1,  0,
+};
+
 static void MouseMoveX(uint8_t direction)
 {
 	if (direction)
 	{
-		if (mouse_x_count > -(127 - MOUSE_X_DELTA)) {
+		if (mouse_x_count > -(32767 - MOUSE_X_DELTA)) {
 		    mouse_x_count -= MOUSE_X_DELTA;
 		}
 	}
 	else
 	{
-		if (mouse_x_count < (127 - MOUSE_X_DELTA)) {
+		if (mouse_x_count < (32767 - MOUSE_X_DELTA)) {
 		    mouse_x_count += MOUSE_X_DELTA;
 		}
 	}
-
-	need_mouse_update = 1;
 }
 
 static void MouseMoveY(uint8_t direction)
 {
 	if (direction)
 	{
-		if (mouse_y_count > -(127 - MOUSE_Y_DELTA)) {
+		if (mouse_y_count > -(32767 - MOUSE_Y_DELTA)) {
 		    mouse_y_count -= MOUSE_Y_DELTA;
 		}
 	}
 	else
 	{
-		if (mouse_y_count < (127 - MOUSE_Y_DELTA)) {
+		if (mouse_y_count < (32767 - MOUSE_Y_DELTA)) {
 		    mouse_y_count += MOUSE_Y_DELTA;
 		}
 	}
-
-	need_mouse_update = 1;
 }
 
-static void CheckMouseUpdate(void)
+// decode the new clk/dir state of both axes, 'state' is (y_clk << 3) | (y_dir << 2) | (x_clk << 1) | x_dir
+
+static void MouseDecode(uint8_t state)
 {
 	#if defined(MOUSE_X_CLK_INDEX) && defined(MOUSE_X_DIR_INDEX)
-
-	uint8_t mouse_clk_state = InputState[MOUSE_X_CLK_INDEX];
-	uint8_t mouse_dir_state = InputState[MOUSE_X_DIR_INDEX];
-
-	if (mouse_clk_state != mouse_x_last_clk_state)
 	{
-		if (mouse_dir_state == mouse_x_last_dir_state) {
-			MouseMoveX(mouse_clk_state ^ mouse_dir_state);
-		}
+		int8_t const step = QuadratureTable[(mouse_x_last_state << 2) | (state & 0x03)];
+		mouse_x_last_state = state & 0x03;
 
-		mouse_x_last_clk_state = mouse_clk_state;
+		if (step != 0) {
+			MouseMoveX(step < 0);
+		}
 	}
+	#endif
 
-	if (mouse_dir_state != mouse_x_last_dir_state)
+	#if defined(MOUSE_Y_CLK_INDEX) && defined(MOUSE_Y_DIR_INDEX)
 	{
-		if (mouse_clk_state == mouse_x_last_clk_state) {
-			MouseMoveX(!(mouse_clk_state ^ mouse_dir_state));
-		}
+		int8_t const step = QuadratureTable[(mouse_y_last_state << 2) | ((state >> 2) & 0x03)];
+		mouse_y_last_state = (state >> 2) & 0x03;
 
-		mouse_x_last_dir_state = mouse_dir_state;
+		if (step != 0) {
+			MouseMoveY(step < 0);
+		}
 	}
+	#endif
+}
+
+#if defined(MOUSE_PCINT_vect)
 
+// read the clk/dir pins directly from the port registers (active low, like the debounced inputs)
+
+static uint8_t MouseReadPins(void)
+{
+	uint8_t state = 0;
+
+	#if defined(MOUSE_X_CLK_INDEX) && defined(MOUSE_X_DIR_INDEX)
+	#define MAP(port, pin, normal_id, shift_id) \
+		if ((port##pin##_index == MOUSE_X_CLK_INDEX) && !(PIN##port & (1 << pin))) { state |= 0x02; } \
+		if ((port##pin##_index == MOUSE_X_DIR_INDEX) && !(PIN##port & (1 << pin))) { state |= 0x01; }
+	PANEL_MAPPING_TABLE(MAP)
+	#undef MAP
 	#endif
 
 	#if defined(MOUSE_Y_CLK_INDEX) && defined(MOUSE_Y_DIR_INDEX)
+	#define MAP(port, pin, normal_id, shift_id) \
+		if ((port##pin##_index == MOUSE_Y_CLK_INDEX) && !(PIN##port & (1 << pin))) { state |= 0x08; } \
+		if ((port##pin##_index == MOUSE_Y_DIR_INDEX) && !(PIN##port & (1 << pin))) { state |= 0x04; }
+	PANEL_MAPPING_TABLE(MAP)
+	#undef MAP
+	#endif
 
-	mouse_clk_state = InputState[MOUSE_Y_CLK_INDEX];
-	mouse_dir_state = InputState[MOUSE_Y_DIR_INDEX];
+	return state;
+}
 
-	if (mouse_clk_state != mouse_y_last_clk_state)
-	{
-		if (mouse_dir_state == mouse_y_last_dir_state) {
-			MouseMoveY(mouse_clk_state ^ mouse_dir_state);
-		}
+#else
 
-		mouse_y_last_clk_state = mouse_clk_state;
-	}
+// no pin change interrupt available, decode the inputs sampled by the panel scan
 
-	if (mouse_dir_state != mouse_y_last_dir_state)
-	{
-		if (mouse_clk_state == mouse_y_last_clk_state) {
-			MouseMoveY(!(mouse_clk_state ^ mouse_dir_state));
-		}
+static void CheckMouseUpdate(void)
+{
+	uint8_t state = 0;
 
-		mouse_y_last_dir_state = mouse_dir_state;
-	}
+	#if defined(MOUSE_X_CLK_INDEX) && defined(MOUSE_X_DIR_INDEX)
+	state |= (InputState[MOUSE_X_CLK_INDEX] ? 0x02 : 0) | (InputState[MOUSE_X_DIR_INDEX] ? 0x01 : 0);
+	#endif
 
+	#if defined(MOUSE_Y_CLK_INDEX) && defined(MOUSE_Y_DIR_INDEX)
+	state |= (InputState[MOUSE_Y_CLK_INDEX] ? 0x08 : 0) | (InputState[MOUSE_Y_DIR_INDEX] ? 0x04 : 0);
 	#endif
+
+	MouseDecode(state);
 }
 
-static uint8_t NeedMouseUpdate(void) { return need_mouse_update; }
+#endif
+
+static uint8_t NeedMouseUpdate(void)
+{
+	uint8_t moved;
+
+	ATOMIC_BLOCK(ATOMIC_FORCEON)
+	{
+		moved = (mouse_x_count != 0) || (mouse_y_count != 0);
+	}
+
+	return moved;
+}
 
 #endif
 
 void panel_init(void)
 {
-	#if (NUM_JOYSTICKS >= 1)
-	memset(&need_joystick_update[0], 0x00, sizeof(need_joystick_update));
+	#if (USE_KEYBOARD != 0) && (USE_KEYBOARD_NKRO != 0)
+	keyboard_report[0] = ID_KeyboardNKRO;
+	#elif (USE_KEYBOARD != 0)
+	keyboard_report[0] = ID_Keyboard;
 	#endif
 
 	#define MAP(port, pin, normal_id, shift_id) \
@@ -287,6 +631,17 @@ void panel_init(void)
 	PANEL_MAPPING_TABLE(MAP)
 	#undef MAP
 
+	#if (USE_MOUSE != 0) && defined(MOUSE_PCINT_vect)
+	ATOMIC_BLOCK(ATOMIC_FORCEON)
+	{
+		uint8_t const state = MouseReadPins();
+		mouse_x_last_state = state & 0x03;
+		mouse_y_last_state = (state >> 2) & 0x03;
+
+		mouse_pcint_init();
+	}
+	#endif
+
 	#if defined(ENABLE_ANALOG_INPUT) && defined(ADC_MAPPING_TABLE)
 	#define MAP(port, pin, mux, minval, maxval, joyid, axis) \
 		PORT##port &= ~(1 << pin); \
@@ -298,26 +653,52 @@ void panel_init(void)
 	#endif
 };
 
+static void SetReportPending(uint8_t id, uint8_t from_input)
+{
+	uint16_t const mask = (uint16_t)1 << id;
+
+	if (!(report_pending & mask))
+	{
+		report_pending |= mask;
+		report_pending_since_ms[id] = panel_time_ms;
+	}
+
+	if (from_input) {
+		report_pending_input |= mask;
+	}
+}
+
+// called on every debounced edge, InputState[index] already holds the new state
+
 static void SetNeedUpdate(uint8_t index)
 {
-	uint8_t key = GetKey(index);
+	uint8_t const key = GetKey(index);
+	uint8_t const down = IsKeyDown(index);
 
 	if (IsConsumerCode(key))
 	{
-		need_consumer_update = 1;
+		UpdateStateBit(&consumer_state, ConsumerBit(key), key, down);
+
+		#if (USE_CONSUMER != 0)
+		SetReportPending(ID_Consumer, 1);
+		#endif
 		return;
 	}
 
 	if (IsKeyboardCode(key))
 	{
-		need_key_update = 1;
+		#if (USE_KEYBOARD != 0)
+		KeyboardUpdate(key, down);
+		SetReportPending(keyboard_report[0], 1);
+		#endif
 		return;
 	}
 
 	#if (USE_MOUSE != 0)
 	if (IsMouseButtonCode(key))
 	{
-		need_mouse_update = 1;
+		UpdateStateBit(&mouse_buttons, MouseButtonBit(key), key, down);
+		SetReportPending(ID_Mouse, 1);
 		return;
 	}
 	#endif
@@ -330,7 +711,8 @@ static void SetNeedUpdate(uint8_t index)
 		{
 			if (IsJoystickCode(key, i))
 			{
-				need_joystick_update[i] = 1;
+				JoystickUpdate(&joy_state[i], key, key - J1_Left - (i * NR_OF_EVENTS_PER_JOY), down);
+				SetReportPending(ID_Joystick1 + i, 1);
 				return;
 			}
 		}
@@ -340,7 +722,8 @@ static void SetNeedUpdate(uint8_t index)
 	#if (USE_ACCELGYRO)
 	if (IsAccelGyroCode(key))
 	{
-		need_accelgyro_update = 1;
+		JoystickUpdate(&accelgyro_state, key, key - AG_Left, down);
+		SetReportPending(ID_AccelGyro, 1);
 		return;
 	}
 	#endif
@@ -363,8 +746,8 @@ static void ShiftKeyCleanUp(void)
 				{
 					if (GetKeyNormalMap(i) != GetKeyShiftMap(i))
 					{
-						SetNeedUpdate(i);
 						InputState[i] = 0;
+						SetNeedUpdate(i);
 					}
 				}
 			}
@@ -373,21 +756,9 @@ static void ShiftKeyCleanUp(void)
 
 	if (shift_key_cleanup == 2)
 	{
-		bool no_update = !need_consumer_update && !need_key_update;
+		// wait until the release of the remapped inputs has been reported
 
-		#if (USE_MOUSE != 0)
-		no_update = no_update && !NeedMouseUpdate();
-		#endif
-
-		#if (NUM_JOYSTICKS >= 1)
-		no_update = no_update && !NeedJoystickUpdate();
-		#endif
-
-		#if (USE_ACCELGYRO)
-		no_update = no_update && !need_accelgyro_update;
-		#endif
-
-		if (no_update)
+		if (report_pending_input == 0)
 		{
 			shift_key_cleanup = 0;
 			shift_key = IsKeyDown(SHIFT_SWITCH_INDEX);
@@ -397,96 +768,121 @@ static void ShiftKeyCleanUp(void)
 
 #endif
 
-static uint8_t NeedUpdate(void)
+// mark the reports pending that do not depend on input edges, called once per panel tick
+
+static void UpdatePending(void)
 {
 	#if defined(SHIFT_SWITCH_INDEX)
 	ShiftKeyCleanUp();
 	#endif
 
 	#if (USE_MOUSE != 0)
-	if (NeedMouseUpdate())
-	{
-		need_mouse_update = 0;
-		return ID_Mouse;
+	if (NeedMouseUpdate()) {
+		SetReportPending(ID_Mouse, 1);
 	}
 	#endif
 
-	if (need_key_update)
-	{
-		need_key_update = 0;
-		return ID_Keyboard;
+	#if defined(ENABLE_ANALOG_INPUT) && defined(ADC_MAPPING_TABLE)
+	#define MAP(port, pin, mux, minval, maxval, joyid, axis) \
+	if (ADC_moved(port##pin##_adcindex)) { \
+		if (joyid >= ID_Joystick1 && (joyid - ID_Joystick1) < NUM_JOYSTICKS) { SetReportPending(joyid, 0); } else \
+		if (joyid == ID_AccelGyro) { SetReportPending(joyid, 0); } \
 	}
+	ADC_MAPPING_TABLE(MAP)
+	#undef MAP
+	#endif
+}
 
-	if (need_consumer_update)
-	{
-		need_consumer_update = 0;
-		return ID_Consumer;
-	}
+// earliest deadline first, returns ID_Unknown if nothing is pending
 
-	uint8_t analog_update[NUM_JOYSTICKS + 1] = {0};
-	static uint8_t analog_counter[NUM_JOYSTICKS + 1];
+static uint8_t NextReport(void)
+{
+	uint8_t id;
+	uint8_t id_next = ID_Unknown;
+	int16_t due_min = 0;
 
-	#if (NUM_JOYSTICKS >= 1)
-	for (uint8_t i = 0; i < NUM_JOYSTICKS; i++)
+	if (report_pending == 0) {
+		return ID_Unknown;
+	}
+
+	for (id = ID_Keyboard; id < NUM_REPORT_IDS; id++)
 	{
-		if (analog_counter[i] < 0xFF && need_joystick_update[i])
-		    analog_counter[i] += 1;
+		if (report_pending & ((uint16_t)1 << id))
+		{
+			int16_t const due = (int16_t)(report_pending_since_ms[id] + ReportLatencyMs[id] - panel_time_ms);
+
+			if ((id_next == ID_Unknown) || (due < due_min))
+			{
+				id_next = id;
+				due_min = due;
+			}
+		}
 	}
-	#endif
 
-	#if (USE_ACCELGYRO)
-	if (analog_counter[NUM_JOYSTICKS] < 0xFF && need_accelgyro_update)
-		analog_counter[NUM_JOYSTICKS] += 1;
-	#endif
+	return id_next;
+}
 
-	#if defined(ENABLE_ANALOG_INPUT) && defined(ADC_MAPPING_TABLE)
+static void ClearReportPending(uint8_t id, uint16_t time_ms)
+{
+	uint16_t const mask = (uint16_t)1 << id;
 
-	#define MAP(port, pin, mux, minval, maxval, joyid, axis) \
-	if (joyid >= ID_Joystick1 && (joyid - ID_Joystick1) < NUM_JOYSTICKS) { analog_update[joyid - ID_Joystick1] = 1; } else \
-	if (joyid == ID_AccelGyro) { analog_update[NUM_JOYSTICKS] = 1; }
-	ADC_MAPPING_TABLE(MAP)
-	#undef MAP
+	report_pending &= ~mask;
+	report_pending_input &= ~mask;
 
-	for (uint8_t i = 0; i < sizeof(analog_update) / sizeof(analog_update[0]); i++)
+	#if defined(ENABLE_PANEL_STATS)
 	{
-		if (analog_counter[i] < 0xFF && analog_update[i] > 0)
-		    analog_counter[i] += 1;
-	}
+		panel_stats_t * const p = &report_stats[id];
+		uint16_t const delay = time_ms - report_pending_since_ms[id];
 
-	#endif
+		p->nreports += 1;
+		p->delay_sum_ms += delay;
 
-	uint8_t ac_max = 0;
-	int8_t index_max = -1;
+		if (delay > p->delay_max_ms) {
+			p->delay_max_ms = delay;
+		}
 
-	for (int8_t i = 0; i < sizeof(analog_update) / sizeof(analog_update[0]); i++)
-	{
-		if (ac_max < analog_counter[i])
-		{
-			ac_max = analog_counter[i];
-			index_max = i;
+		if (delay > ReportLatencyMs[id]) {
+			p->nlate += 1;
 		}
 	}
+	#endif
+}
 
-	if (index_max >= 0)
-	{
-		analog_counter[index_max] = 0;
+#if defined(ENABLE_PANEL_STATS)
 
-		#if (NUM_JOYSTICKS >= 1)
-		if (index_max < NUM_JOYSTICKS) {
-			need_joystick_update[index_max] = 0;
-			return index_max + ID_Joystick1;
-		}
-		#endif
+void panel_get_stats(uint8_t id, panel_stats_t *pstats)
+{
+	if (id < NUM_REPORT_IDS) {
+		*pstats = report_stats[id];
+	} else {
+		memset(pstats, 0x00, sizeof(*pstats));
+	}
+}
 
-		#if (USE_ACCELGYRO)
-		need_accelgyro_update = 0;
-		return ID_AccelGyro;
-		#endif
+static void PrintStats(void)
+{
+	static uint16_t time_next_ms = 0;
+
+	if (((int16_t)panel_time_ms - (int16_t)time_next_ms) < 0) {
+		return;
 	}
 
-	return ID_Unknown;
+	time_next_ms = panel_time_ms + 10000;
+
+	for (uint8_t id = ID_Keyboard; id < NUM_REPORT_IDS; id++)
+	{
+		panel_stats_t const * const p = &report_stats[id];
+
+		if (p->nreports > 0)
+		{
+			MsgOut("report %d: n %u, delay avg %u ms, max %u ms, late %u\n",
+				id, p->nreports, (uint16_t)(p->delay_sum_ms / p->nreports), p->delay_max_ms, p->nlate);
+		}
+	}
 }
 
+#endif
+
 static void SetInputCount(uint8_t index, uint8_t condition)
 {
 	#if (USE_MOUSE != 0) && defined(MOUSE_X_CLK_INDEX) && defined(MOUSE_X_DIR_INDEX)
@@ -620,7 +1016,7 @@ void panel_ScanInput(void)
 	PANEL_MAPPING_TABLE(MAP)
 	#undef MAP
 
-	#if (USE_MOUSE != 0)
+	#if (USE_MOUSE != 0) && !defined(MOUSE_PCINT_vect)
 	CheckMouseUpdate();
 	#endif
 }
@@ -628,77 +1024,21 @@ void panel_ScanInput(void)
 #if (USE_CONSUMER != 0)
 static uint8_t ReportConsumer(void)
 {
-	uint8_t i;
-	uint8_t consumer = 0;
-
-	for (i = 0; i < NUMBER_OF_INPUTS; i++)
-	{
-		if (IsKeyDown(i))
-		{
-			uint8_t key = GetKey(i);
-
-			if (IsConsumerCode(key)) {
-				consumer |= ConsumerBit(key);
-			}
-		}
-	}
-
 	ReportBuffer[0] = ID_Consumer;
-	ReportBuffer[1] = consumer;
+	ReportBuffer[1] = consumer_state;
 
 	return 2;
 }
 #endif
 
+#if (USE_KEYBOARD != 0)
 static uint8_t ReportKeyboard(void)
 {
-	uint8_t i;
-	uint8_t r = 2;
-
-	memset(&ReportBuffer[1], 0x00, sizeof(ReportBuffer) - 1);
+	memcpy(&ReportBuffer[0], &keyboard_report[0], sizeof(keyboard_report));
 
-	ReportBuffer[0] = ID_Keyboard;
-
-	for (i = 0; i < NUMBER_OF_INPUTS; i++)
-	{
-		if (IsKeyDown(i))
-		{
-			uint8_t key = GetKey(i);
-
-			if (IsKeyboardCode(key))
-			{
-				if (IsModifierCode(key))
-				{
-					ReportBuffer[1] |= ModifierBit(key);
-				}
-				else
-				{
-					if (r < sizeof(ReportBuffer))
-					{
-						switch (key)
-						{
-						case KM_ALT_F4:
-							ReportBuffer[1] |= ModifierBit(MOD_LeftAlt);
-							ReportBuffer[r] = KEY_F4;
-							break;
-						case KM_SHIFT_F7:
-							ReportBuffer[1] |= ModifierBit(MOD_LeftShift);
-							ReportBuffer[r] = KEY_F7;
-							break;
-						default:
-							ReportBuffer[r] = key;
-							break;
-						}
-
-						r++;
-					}
-				}
-			}
-		}
-	}
-
-	return sizeof(ReportBuffer);
+	return sizeof(keyboard_report);
 }
+#endif
 
 #if defined(ENABLE_ANALOG_INPUT)
 
@@ -714,14 +1054,16 @@ uint16_t ADC_getvalue(uint8_t id)
 	return x;
 }
 
+// 'x' is the filtered 10.6 fixed point value
+
 static int16_t joyval12(uint16_t x, int16_t minval, int16_t maxval)
 {
-	return (int16_t)(((int32_t)x * (int32_t)(maxval - minval) + (1 << 9)) >> 10) + minval - 2047;
+	return (int16_t)(((int32_t)x * (int32_t)(maxval - minval) + (1L << 15)) >> 16) + minval - 2047;
 }
 
 static int8_t joyval8(uint16_t x, int16_t minval, int16_t maxval)
 {
-	return (int8_t)(((int32_t)x * (int32_t)(maxval - minval) + (1 << 9)) >> 10) + minval - 127;
+	return (int8_t)(((int32_t)x * (int32_t)(maxval - minval) + (1L << 15)) >> 16) + minval - 127;
 }
 
 #endif
@@ -730,7 +1072,6 @@ static int8_t joyval8(uint16_t x, int16_t minval, int16_t maxval)
 
 static uint8_t ReportJoystick(uint8_t id)
 {
-	uint8_t i;
 	int16_t joy_x = 0;
 	int16_t joy_y = 0;
 	uint8_t joy_b = 0;
@@ -745,44 +1086,14 @@ static uint8_t ReportJoystick(uint8_t id)
 	#undef MAP
 	#endif
 
-	id = (id - ID_Joystick1) * NR_OF_EVENTS_PER_JOY;
+	joy_state_t const * const p = &joy_state[id - ID_Joystick1];
 
-	for (i = 0; i < NUMBER_OF_INPUTS; i++)
-	{
-		if (IsKeyDown(i))
-		{
-			uint8_t key = GetKey(i) - id;
-			switch (key)
-			{
-			case J1_Left:
-				joy_x = -2047;
-				break;
-			case J1_Right:
-				joy_x = +2047;
-				break;
-			case J1_Up:
-				joy_y = -2047;
-				break;
-			case J1_Down:
-				joy_y = +2047;
-				break;
+	if (p->directions & JOY_DIR_LEFT)  { joy_x = -2047; }
+	if (p->directions & JOY_DIR_RIGHT) { joy_x = +2047; }
+	if (p->directions & JOY_DIR_UP)    { joy_y = -2047; }
+	if (p->directions & JOY_DIR_DOWN)  { joy_y = +2047; }
 
-			case J1_Button1:
-			case J1_Button2:
-			case J1_Button3:
-			case J1_Button4:
-			case J1_Button5:
-			case J1_Button6:
-			case J1_Button7:
-			case J1_Button8:
-				joy_b |= JoyButtonBit(key);
-				break;
-
-			default:
-				break;
-			}
-		}
-	}
+	joy_b = p->buttons;
 
 	ReportBuffer[1] = ((uint16_t)joy_x & 0xFF);
 	ReportBuffer[2] = (((uint16_t)joy_y & 0x0F) << 4) | (((uint16_t)joy_x >> 8) & 0x0F);
@@ -822,44 +1133,14 @@ static uint8_t ReportAccelGyro()
 	#undef MAP
 	#endif
 
-	id = (id - ID_Joystick1) * NR_OF_EVENTS_PER_JOY;
-
-	for (uint8_t i = 0; i < NUMBER_OF_INPUTS; i++)
-	{
-		if (IsKeyDown(i))
-		{
-			uint8_t key = GetKey(i) - id;
-			switch (key)
-			{
-			case J1_Left:
-				joy_x = -127;
-				break;
-			case J1_Right:
-				joy_x = +127;
-				break;
-			case J1_Up:
-				joy_y = -127;
-				break;
-			case J1_Down:
-				joy_y = +127;
-				break;
+	joy_state_t const * const p = &accelgyro_state;
 
-			case J1_Button1:
-			case J1_Button2:
-			case J1_Button3:
-			case J1_Button4:
-			case J1_Button5:
-			case J1_Button6:
-			case J1_Button7:
-			case J1_Button8:
-				joy_b |= JoyButtonBit(key);
-				break;
+	if (p->directions & JOY_DIR_LEFT)  { joy_x = -127; }
+	if (p->directions & JOY_DIR_RIGHT) { joy_x = +127; }
+	if (p->directions & JOY_DIR_UP)    { joy_y = -127; }
+	if (p->directions & JOY_DIR_DOWN)  { joy_y = +127; }
 
-			default:
-				break;
-			}
-		}
-	}
+	joy_b = p->buttons;
 
 	ReportBuffer[1] = joy_x;
 	ReportBuffer[2] = joy_y;
@@ -879,33 +1160,49 @@ static uint8_t ReportAccelGyro()
 
 static uint8_t ReportMouse(void)
 {
-	uint8_t i;
-	uint8_t buttons = 0;
+	int16_t dx;
+	int16_t dy;
 
-	for (i = 0; i < NUMBER_OF_INPUTS; i++)
+	ATOMIC_BLOCK(ATOMIC_FORCEON)
 	{
-		if (IsKeyDown(i))
-		{
-			uint8_t key = GetKey(i);
-
-			if (IsMouseButtonCode(key)) {
-				buttons |= MouseButtonBit(key);
-			}
-		}
+		dx = mouse_x_count;
+		dy = mouse_y_count;
+		mouse_x_count = 0;
+		mouse_y_count = 0;
 	}
 
 	ReportBuffer[0] = ID_Mouse;
-	ReportBuffer[1] = buttons;
-	ReportBuffer[2] = mouse_x_count;
-	ReportBuffer[3] = mouse_y_count;
-	mouse_x_count = 0;
-	mouse_y_count = 0;
+	ReportBuffer[1] = mouse_buttons;
+	ReportBuffer[2] = ((uint16_t)dx & 0xFF);
+	ReportBuffer[3] = ((uint16_t)dx >> 8);
+	ReportBuffer[4] = ((uint16_t)dy & 0xFF);
+	ReportBuffer[5] = ((uint16_t)dy >> 8);
 
-	return 4;
+	return 6;
 }
 
 #endif
 
+#if (USE_MOUSE != 0) && defined(MOUSE_PCINT_vect)
+
+// Pin change interrupt routine, decodes the spinner/trackball signals on every edge
+// so that fast movements do not get lost between two panel scans
+
+ISR(MOUSE_PCINT_vect)
+{
+	#if defined(ENABLE_PROFILING)
+	profile_start();
+	#endif
+
+	MouseDecode(MouseReadPins());
+}
+
+#if defined(MOUSE_PCINT_ALT_vect)
+ISR(MOUSE_PCINT_ALT_vect, ISR_ALIASOF(MOUSE_PCINT_vect));
+#endif
+
+#endif
+
 
 static uint8_t BuildReport(uint8_t id)
 {
@@ -913,6 +1210,7 @@ static uint8_t BuildReport(uint8_t id)
 	{
 	#if (USE_KEYBOARD != 0)
 	case ID_Keyboard:
+	case ID_KeyboardNKRO:
 		return ReportKeyboard();
 	#endif
 
@@ -948,27 +1246,40 @@ static uint8_t BuildReport(uint8_t id)
 
 uint8_t panel_get_report(uint8_t **ppdata)
 {
-	if (ppdata == NULL) {
-		return 0;
-	}
-
 	static uint16_t time_next_ms = 0;
 	uint16_t const time_curr_ms = clock_ms();
 
-	if (((int16_t)time_curr_ms - (int16_t)time_next_ms) < 0) {
-		return 0;
+	// scan the inputs once per panel tick, whether the endpoint is free or not
+
+	if (((int16_t)time_curr_ms - (int16_t)time_next_ms) >= 0)
+	{
+		time_next_ms = time_curr_ms + DELTA_TIME_PANEL_REPORT_MS;
+		panel_time_ms = time_curr_ms;
+
+		panel_ScanInput();
+		UpdatePending();
+
+		#if defined(ENABLE_PANEL_STATS)
+		PrintStats();
+		#endif
 	}
 
-	time_next_ms = time_curr_ms + DELTA_TIME_PANEL_REPORT_MS;
+	// no room for a report?
 
-	panel_ScanInput();
+	if (ppdata == NULL) {
+		return 0;
+	}
 
-	uint8_t const id = NeedUpdate();
+	// send the most urgent pending report, the caller asks again as long as there is room
+
+	uint8_t const id = NextReport();
 
 	if (id == ID_Unknown) {
 		return 0;
 	}
 
+	ClearReportPending(id, time_curr_ms);
+
 	uint8_t const ndata = BuildReport(id);
 	*ppdata = ReportBuffer;
 
@@ -978,6 +1289,37 @@ uint8_t panel_get_report(uint8_t **ppdata)
 
 #if defined(ENABLE_ANALOG_INPUT)
 
+// filter the decimated value 'x' (10.6 fixed point) of one channel, called from the ADC ISR
+
+static void ADC_filter(uint8_t i, uint16_t x)
+{
+	#if (ADC_MEDIAN_FILTER != 0)
+	{
+		uint16_t const a = adc_history[i][0];
+		uint16_t const b = adc_history[i][1];
+
+		adc_history[i][0] = b;
+		adc_history[i][1] = x;
+
+		// median of the last three values
+		if ((a <= b && b <= x) || (x <= b && b <= a)) {
+			x = b;
+		} else if ((b <= a && a <= x) || (x <= a && a <= b)) {
+			x = a;
+		}
+	}
+	#endif
+
+	#if (ADC_IIR_SHIFT > 0)
+	{
+		int32_t const y = adc_values[i];
+		x = (uint16_t)(y + (((int32_t)x - y) >> ADC_IIR_SHIFT));
+	}
+	#endif
+
+	adc_values[i] = x;
+}
+
 // ADC Interrupt Routine
 
 ISR(ADC_vect)
@@ -986,22 +1328,35 @@ ISR(ADC_vect)
 	profile_start();
 	#endif
 
-	static int i = 0;
+	static uint8_t i = 0;
+	static uint8_t n = 0;
+	static uint16_t sum = 0;
+
+	// accumulate
+
+	sum += ADC;
+	n += 1;
 
-	// get value
+	if (n >= (1 << ADC_OVERSAMPLING_LOG2))
+	{
+		// decimate and filter
+
+		ADC_filter(i, sum << (ADC_FRACT_BITS - ADC_OVERSAMPLING_LOG2));
 
-	adc_values[i] = ADC;
+		sum = 0;
+		n = 0;
 
-	// cycle
+		// cycle
 
-	i -= 1;
+		if (i == 0)
+			i = NUM_ADC_CHANNELS;
 
-	if (i < 0) 
-		i += NUM_ADC_CHANNELS;
+		i -= 1;
 
-	// set mux channel for the next conversion
+		// set mux channel for the next conversions
 
-	ADC_setmux(adc_mux_table[i]);
+		ADC_setmux(adc_mux_table[i]);
+	}
 
 	// start new conversion
 
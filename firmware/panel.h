@@ -39,13 +39,48 @@ enum ReportIds
 	ID_Joystick4,
 	ID_AccelGyro,
 	ID_Mouse,
+	ID_KeyboardNKRO,
 };
 
+// N-key rollover keyboard report (USE_KEYBOARD_NKRO), one bit per key code in the range
+// NKRO_FIRST_KEY..NKRO_LAST_KEY (numeric HID usage codes, the default is KEY_A..KEY_Application).
+// A board can narrow the range in its hwconfig.h to the keys actually used by the mapping table.
+
+#if !defined(NKRO_FIRST_KEY)
+#define NKRO_FIRST_KEY  0x04
+#endif
+
+#if !defined(NKRO_LAST_KEY)
+#define NKRO_LAST_KEY   0x65
+#endif
+
+#define NKRO_NUM_KEYS     ((NKRO_LAST_KEY) - (NKRO_FIRST_KEY) + 1)
+#define NKRO_BITMAP_SIZE  ((NKRO_NUM_KEYS + 7) / 8)
+#define NKRO_REPORT_SIZE  (2 + NKRO_BITMAP_SIZE)
+
 static const uint16_t DELTA_TIME_PANEL_REPORT_MS = 2;
 
 void panel_init(void);
+
+// scans the inputs (once per DELTA_TIME_PANEL_REPORT_MS) and returns the next pending report,
+// pass NULL if there is currently no room for a report, then only the inputs are scanned
 uint8_t panel_get_report(uint8_t **ppdata);
 
+#if defined(ENABLE_PANEL_STATS)
+
+// queueing delay of the reports, from the panel tick that changed the data until the report is sent
+
+typedef struct {
+	uint16_t nreports;
+	uint16_t nlate;          // number of reports that missed their latency target
+	uint16_t delay_max_ms;
+	uint32_t delay_sum_ms;
+} panel_stats_t;
+
+void panel_get_stats(uint8_t id, panel_stats_t *pstats);
+
+#endif
+
 
 
 #endif  // PANEL_H__INCLUDED
@@ -48,8 +48,24 @@ written for the original API.
 #ifndef LEDWIZ_H__INCLUDED
 #define LEDWIZ_H__INCLUDED
 
+#if defined(_WIN32)
+
 #include <windows.h>
 
+#else
+
+// libledwiz on Linux offers the same API; provide the few Windows types it uses
+#include <stdint.h>
+
+#ifndef LWZ_COMPAT_BASETYPES
+#define LWZ_COMPAT_BASETYPES
+typedef void * HWND;
+typedef int BOOL;
+typedef uint32_t DWORD;
+#endif
+
+#endif
+
 
 #if defined(_MSC_VER)
 
@@ -65,6 +81,8 @@ typedef short int16_t;
 typedef unsigned short uint16_t;
 typedef int int32_t;
 typedef unsigned int uint32_t;
+typedef __int64 int64_t;
+typedef unsigned __int64 uint64_t;
 #endif
 
 #else
@@ -115,6 +133,10 @@ typedef struct {
 	DWORD cbSize;			// structure size
 	DWORD dwDevType;        // device type (LWZ_DEVICE_TYPE_xxx constant)
 	char szName[256];		// device name, from USB device descriptor
+
+	// added with adaptive write pacing, only filled in if cbSize includes them
+	DWORD dwWriteInterval;	// current minimum time between two output reports, in microseconds (0 = not paced)
+	DWORD dwWriteLatency;	// average time an output report takes to complete, in microseconds (0 = not known)
 } LWZDEVICEINFO;
 
 
@@ -159,6 +181,10 @@ This associates a device with a window message queue so the your application can
 In order to unregister, call with hwnd == NULL.
 You have to unregister if the library was manually loaded and then is going to be freed with FreeLibrary() while
 the window still exists.
+Plugged in devices are searched for on a background thread of the library, the notification callback is then invoked
+from the window procedure when that is done.
+On Linux (libledwiz.so) there is no window to hook, any non-NULL value enables hot plug monitoring instead. The
+notification callback is then invoked from a background thread of the library.
 ************************************************************************************************************************/
 
 void LWZCALL LWZ_REGISTER(LWZHANDLE hlwz, HWND hwnd);
@@ -198,6 +224,76 @@ caller is using.  Returns TRUE if the device was valid, FALSE if not.
 BOOL LWZ_GET_DEVICE_INFO(LWZHANDLE hlwz, LWZDEVICEINFO *info);
 
 
+/************************************************************************************************************************
+LWZ_UPDATE_BATCH - update several devices in one call [EXTENDED API]
+*************************************************************************************************************************
+Applies a whole frame of SBA and/or PBA updates, for any number of devices, as if LWZ_SBA and LWZ_PBA had been called
+for each entry in turn.  The ports beyond 32 of a Pinscape unit are addressed through its virtual LedWiz units, as
+usual.  The library lock is taken only once, and the devices are handed to their I/O threads only after all entries
+have been applied, so that every device starts sending its part of the frame at the same time.
+Returns the number of entries that addressed a valid device.
+************************************************************************************************************************/
+
+#define LWZ_UPDATE_SBA  0x01    // banks[] and globalPulseSpeed are valid
+#define LWZ_UPDATE_PBA  0x02    // brightness[] is valid
+
+typedef struct {
+	LWZHANDLE hlwz;             // unit, real or Pinscape virtual
+	uint32_t flags;             // LWZ_UPDATE_xxx
+	uint8_t banks[4];           // on/off bits of ports 1-32, as in LWZ_SBA
+	uint8_t globalPulseSpeed;
+	uint8_t brightness[32];     // as in LWZ_PBA
+} LWZUPDATE;
+
+int32_t LWZ_UPDATE_BATCH(LWZUPDATE const *pupdates, int32_t nupdates);
+
+
+/************************************************************************************************************************
+LWZ_UPDATE_FRAME - update several devices at a given time [EXTENDED API]
+LWZ_GET_TIME - the clock of the presentation times [EXTENDED API]
+*************************************************************************************************************************
+Same as LWZ_UPDATE_BATCH, but the updates are held back until 'present_us', a time on the clock of LWZ_GET_TIME (in
+microseconds), so that the outputs can change in step with the video frame no matter how busy the USB is.  The I/O
+thread of each device starts the write early by the time its writes have been taking, so that they complete at the
+presentation time.  Up to 8 frames per device can wait, beyond that the oldest is merged into the next.  A frame that
+is still waiting when the next one is due as well is dropped the same way, and a time that has passed means right away.
+Calls like LWZ_SBA in between take effect at once, the frames only change what they set.
+Returns the number of entries that addressed a valid device.
+************************************************************************************************************************/
+
+int32_t LWZ_UPDATE_FRAME(LWZUPDATE const *pupdates, int32_t nupdates, int64_t present_us);
+int64_t LWZ_GET_TIME(void);
+
+
+/************************************************************************************************************************
+LWZ_SET_OUTPUTS - set a range of ports of a device in one call [EXTENDED API]
+*************************************************************************************************************************
+Sets 'count' ports from 'first_port' on (1-based), one value per port: 0 switches the port off and keeps its brightness,
+any other value switches it on with that brightness or flash mode, as in LWZ_PBA (1-49, 129-132).  The range can go past
+port 32 on Pinscape units with more outputs, up to 128, without going through the virtual LedWiz units; on a virtual
+unit port 1 is the first port of its block.  Only the SBX/PBX messages for the blocks that changed are sent.  Ports of a
+block of 32 that wasn't set before start out off, at brightness 48.
+Returns the number of ports that were set, less than 'count' if the range goes beyond the last output, 0 if the device
+isn't valid.
+************************************************************************************************************************/
+
+int32_t LWZ_SET_OUTPUTS(LWZHANDLE hlwz, int32_t first_port, int32_t count, uint8_t const *values);
+
+
+/************************************************************************************************************************
+LWZ_SET_PRIORITY - mark the ports whose brightness changes are urgent [EXTENDED API]
+*************************************************************************************************************************
+On/off changes (LWZ_SBA, and ports that LWZ_SET_OUTPUTS switches on or off) are written ahead of brightness changes
+that are still waiting, so that a solenoid or flasher isn't held up by a fade on other ports.  The brightness of a port
+that comes on is written with it.  The ports set here, one bit per port as in LWZ_SBA, have their brightness changes
+written ahead as well, e.g. flashers that are driven by their brightness alone.  Pass all zero to clear them.  A fade
+that is being written is interrupted after the current report.  The PBA of a LedWiz carries all 32 levels, so if it
+has the new brightness of a port that comes on, or of a port set here, it goes first and the SBA right after it.
+************************************************************************************************************************/
+
+void LWZ_SET_PRIORITY(LWZHANDLE hlwz, unsigned int bank0, unsigned int bank1, unsigned int bank2, unsigned int bank3);
+
+
 /************************************************************************************************************************
 LWZ_RAWWRITE - write raw data to the device [EXTENDED API]
 *************************************************************************************************************************
@@ -215,6 +311,85 @@ return number of bytes read.
 uint32_t LWZ_RAWREAD(LWZHANDLE hlwz, uint8_t *pdata, uint32_t ndata);
 
 
+/************************************************************************************************************************
+LWZ_INPUT_POLL - get the next input report without waiting [EXTENDED API]
+*************************************************************************************************************************
+The first call starts a background reader for the device (Pinscape and LwCloneU2 units send input reports) that keeps
+the reports in a buffer, so that a game loop can poll for them without blocking.  Reads never wait for queued writes.
+Copies the oldest buffered report and returns its length, or 0 if there is none.  Reports that arrive while the
+buffer is full are dropped.  While the reader runs, LWZ_RAWREAD takes its reports from the same buffer.
+************************************************************************************************************************/
+
+uint32_t LWZ_INPUT_POLL(LWZHANDLE hlwz, uint8_t *pdata, uint32_t ndata);
+
+
+/************************************************************************************************************************
+LWZ_SET_INPUT_CALLBACK - get the input reports of a device through a callback [EXTENDED API]
+*************************************************************************************************************************
+Starts the background reader like LWZ_INPUT_POLL, and has it pass each input report to the callback instead of the
+buffer.  The callback is invoked from the reader thread; it must not block, and must not call back into the DLL,
+since the reader is stopped with the library lock held.  Pass NULL to go back to polling; once this returns, the old
+callback is not running and won't be called again.
+Returns FALSE if the device doesn't exist or has no input reports.
+************************************************************************************************************************/
+
+typedef void (LWZCALLBACK * LWZINPUTPROC)(void *puser, LWZHANDLE hlwz, uint8_t const *pdata, uint32_t ndata);
+
+BOOL LWZ_SET_INPUT_CALLBACK(LWZHANDLE hlwz, LWZINPUTPROC input_callback, void *puser);
+
+
+/************************************************************************************************************************
+LWZ_GET_STATS - retrieve the queue and write statistics of a device [EXTENDED API]
+*************************************************************************************************************************
+Counts what happened to the updates of a device since it was added, or since the last call with a non-zero reset, so
+that a client can tell whether its frames are being merged, queued up, or are failing on the wire.  Virtual units
+report the numbers of their physical device.  The caller must fill in 'cbSize'.
+The latency histograms have 8 buckets per power of two, in microseconds: bucket i < 8 counts the value i, bucket
+i >= 8 the values from (8 + i % 8) << (i / 8 - 1) up to (9 + i % 8) << (i / 8 - 1).  The last bucket also counts
+everything above.
+dwLatencyHist is the time from an LWZ_SBA/LWZ_PBA/LWZ_RAWWRITE call until the write that carried it completed,
+dwWriteHist the time of each single report until its write completed, for pipelined reports from when they were queued.  The
+frames of LWZ_UPDATE_FRAME are counted apart: dwPresentHist is how far from its presentation time the write of a frame
+completed, early or late.
+Callers built against the structure without the frame counters still get the other fields.
+Returns TRUE if the device was valid, FALSE if not.
+************************************************************************************************************************/
+
+#define LWZ_STATS_BUCKETS  176
+
+typedef struct {
+	DWORD cbSize;
+	DWORD dwEnqueued;           // state changes and raw messages, calls that changed nothing aren't counted
+	DWORD dwCoalesced;          // of those, the state changes merged into a write that was already pending
+	DWORD dwWritten;            // output reports written
+	DWORD dwFailed;             // output reports that failed
+	DWORD dwTimedOut;           // of those, the ones that took the whole write timeout
+	DWORD dwQueueHighWater;     // most items seen in the I/O queue of the device
+	DWORD dwLatencyHist[LWZ_STATS_BUCKETS];
+	DWORD dwWriteHist[LWZ_STATS_BUCKETS];
+	DWORD dwFramesShown;        // timed frames that were written
+	DWORD dwFramesDropped;      // timed frames that were due together with a later one and merged into it
+	DWORD dwPresentHist[LWZ_STATS_BUCKETS];
+	DWORD dwPreempted;          // writes whose brightness fades were cut short by an on/off change, see LWZ_SET_PRIORITY
+} LWZSTATS;
+
+BOOL LWZ_GET_STATS(LWZHANDLE hlwz, LWZSTATS *pstats, BOOL reset);
+
+
+/************************************************************************************************************************
+LWZ_SET_SHUTDOWN - set how the devices are released [EXTENDED API]
+*************************************************************************************************************************
+When the device list is released (LWZ_SET_NOTIFY, unloading the library), the updates that are still queued for a
+device are dropped and the write in progress is cancelled, so that a paced LedWiz or a device that was pulled can't
+hold up the application.  The last state that was set is still written to each device, or with a non-zero 'all_off'
+all outputs are switched off instead.  'timeout_ms' is the time all devices together get for that (default 1000);
+after that the library goes on and leaves the devices that are still busy to finish on their own.
+Devices that are unplugged are released the same way, without the last write.
+************************************************************************************************************************/
+
+void LWZ_SET_SHUTDOWN(DWORD timeout_ms, BOOL all_off);
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,22 +17,28 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 
-#include <windows.h>
-#include <crtdbg.h>
-#include <Setupapi.h>
+#include <ctype.h>
 
-extern "C" {
-#include <Hidsdi.h>
-}
+#include "oscompat.h"
 
+#if defined(_WIN32)
 #include <Dbt.h>
+#else
+#include <dlfcn.h>
+#endif
 
 #define LWZ_DLL_EXPORT
 #include "../include/ledwiz.h"
 #include "usbdev.h"
+#include "pbxpack.h"
 
 #define USE_SEPARATE_IO_THREAD
+#define USE_BACKGROUND_SCAN  // enumerate after a WM_DEVICECHANGE on a thread of our own
+#if !defined(LWZ_LOCKED_QUEUE)
+#define USE_LOCKFREE_QUEUE
+#endif
 #define DEBUG_LOGGING 0
 
 
@@ -56,14 +62,32 @@ static void LOG(char *f, ...)
 #endif
 
 
+#if defined(_WIN32)
 const GUID HIDguid = { 0x4d1e55b2, 0xf16f, 0x11Cf, { 0x88, 0xcb, 0x00, 0x11, 0x11, 0x00, 0x00, 0x30 } };
+#endif
 
 USHORT const VendorID_LEDWiz       = 0xFAFA;
 USHORT const VendorID_Zebs         = 0x20A0;
 USHORT const ProductID_LEDWiz_min  = 0x00F0;
 USHORT const ProductID_LEDWiz_max  = ProductID_LEDWiz_min + LWZ_MAX_DEVICES - 1;
 
+// Write pacing for devices that talk the LedWiz protocol but aren't one of
+// the clones we know, in microseconds.  A genuine LedWiz never goes below
+// the 5 ms it needs; anything else starts there as well but may learn that
+// it can go faster.  Both back off up to the maximum if writes go wrong.
+#define LEDWIZ_WRITE_INTERVAL_US        5000
+#define CLONE_MIN_WRITE_INTERVAL_US     0
+#define MAX_WRITE_INTERVAL_US           20000
+
+// LWZ_RAWREAD waits this long for an input report, like a direct read in usbdev
+#define RAWREAD_TIMEOUT_MS              500
+
+// how long releasing the device list waits for the I/O threads, see LWZ_SET_SHUTDOWN
+#define SHUTDOWN_TIMEOUT_MS             1000
+
+#if defined(_WIN32)
 static const char * lwz_process_sync_mutex_name = "lwz_process_sync_mutex";
+#endif
 
 
 // Pinscape Virtual LedWiz.  For each Pinscape unit with more than
@@ -79,10 +103,133 @@ typedef struct {
 	int base_unit;   // index of the base Pinscape unit in the devices[] array
 } ps_virtual_lwz_t;
 
+typedef void * HQUEUE;
+
+// Output state of a physical device, in blocks of 32 ports: group 0 is what
+// LWZ_SBA/LWZ_PBA address on the device itself, groups 1..3 are the ports
+// of a Pinscape unit that are reached through its virtual LedWiz units.
+#define LWZ_MAX_PORT_GROUPS  4
+
+typedef struct {
+	BYTE banks[4];      // SBA switch state, one bit per port
+	BYTE pulse_speed;   // SBA global pulse speed
+	BYTE profiles[32];  // PBA brightness levels and flash modes
+} lwz_port_group_t;
+
+#define LWZ_STATE_SWITCHES(group)  (1u << (group))
+#define LWZ_STATE_PROFILES(group)  (1u << ((group) + LWZ_MAX_PORT_GROUPS))
+
+// A frame of LWZ_UPDATE_FRAME() that waits for its time.  It holds only
+// the parts the client has set, the 'mask' bits, and is merged into the
+// desired state when it is due.
+#define LWZ_FRAME_SLOTS     8
+#define LWZ_FRAME_SLACK_US  500     // half the resolution of the timed wait, see lwz_state_frame_wait()
+
+typedef struct {
+	int64_t tpresent_us;
+	unsigned int mask;                             // LWZ_STATE_xxx bits
+	lwz_port_group_t groups[LWZ_MAX_PORT_GROUPS];
+} lwz_frame_t;
+
+// The API calls only update the desired state and schedule a write.  The
+// writer compares it with what was sent last and generates the messages
+// for the difference, so a device is never more than one update behind
+// the client no matter how fast the calls come in, and repeating the same
+// state costs nothing.
+typedef struct {
+	CRITICAL_SECTION cs;                           // protects the fields up to 'pending'
+	lwz_port_group_t desired[LWZ_MAX_PORT_GROUPS];
+	unsigned int desired_mask;                     // LWZ_STATE_xxx bits of the groups the client has set
+	bool pending;                                  // a write is scheduled that hasn't picked up 'desired' yet
+	int64_t tchange_us;                            // usbdev_time_us() of the first change the pending write covers
+
+	// timed frames, in the order of their time
+	lwz_frame_t frames[LWZ_FRAME_SLOTS];
+	int nframes;
+	bool frame_wake;                               // a write is scheduled that hasn't seen the last frame yet
+
+	// priority lane, see lwz_state_write()
+	BYTE priority[LWZ_MAX_PORT_GROUPS][4];         // ports whose brightness changes are urgent, see LWZ_SET_PRIORITY()
+	bool urgent;                                   // an urgent change came in after the last write picked up 'desired'
+
+	// statistics, see LWZ_GET_STATS(), also protected by 'cs'
+	unsigned int enqueued;                         // state changes and raw messages
+	unsigned int coalesced;                        // state changes merged into a write that was already pending
+	volatile LONG queue_high_water;                // most items seen in the I/O queue, see lwz_state_queue_level()
+	unsigned int latency_hist[USBDEV_LATENCY_BUCKETS]; // from the change until its write completed, see usbdev_latency_add()
+	unsigned int frames_shown;
+	unsigned int frames_dropped;                   // merged into a later frame that was due as well
+	unsigned int present_hist[USBDEV_LATENCY_BUCKETS]; // how far from its time a frame's write completed
+	unsigned int preempted;                        // writes whose fades were cut short by an urgent change
+
+	// only accessed by the writer
+	lwz_port_group_t sent[LWZ_MAX_PORT_GROUPS];
+	unsigned int sent_mask;                        // LWZ_STATE_xxx bits of the groups the device is known to have
+
+	bool use_pbx;                                  // send ports 1-32 as PBX as well (Pinscape)
+	bool pba_resync;                               // a PBA failed or was cut short, the device's bank counter is unknown
+	int64_t frame_lead_us;                         // how long the write of a frame takes, on average
+	bool fades_cut;                                // the last write was cut short, this one isn't, see lwz_state_write()
+
+	#if !defined(USE_SEPARATE_IO_THREAD)
+	CRITICAL_SECTION cswrite;                      // the callers are the writers, one at a time
+	#endif
+} lwz_state_t;
+
+// Input reports of a physical device, see lwz_input_open()
+typedef struct lwz_input_s lwz_input_t;
+
+// Devices found by one enumeration, see lwz_scan_devices()
+typedef struct lwz_scan_s lwz_scan_t;
+
+// What the probe found out about an LedWiz interface, see lwz_identify()
+typedef struct {
+	char device_path[USBDEV_MAX_PATH];
+	char container_id[USBDEV_MAX_ID];
+	unsigned int seen;              // serial of the last scan that saw it
+
+	UINT device_type;               // LWZ_DEVICE_TYPE_NONE if it was rejected
+	UINT input_rpt_len;
+	int num_outputs;
+	BOOL supports_sbx_pbx;
+	char device_name[256];
+
+	// write pacing, see usbdev_set_write_interval_range()
+	unsigned int interval_min_us;
+	unsigned int interval_max_us;
+} lwz_ident_t;
+
+// The identification results by path and container id, so that a rescan
+// doesn't open and query the devices we know already.  The lock is only
+// held to look up and update entries.
+#define LWZ_IDENT_CACHE  32
+
+typedef struct {
+	CRITICAL_SECTION cs;
+	unsigned int serial;
+	int count;
+	lwz_ident_t entries[LWZ_IDENT_CACHE];
+} lwz_idcache_t;
+
 typedef struct {
 	// handle to USB device
 	HUDEV hudev;
 
+	// Output state of the device.  Virtual Pinscape units use the state
+	// of the base unit.
+	lwz_state_t *pstate;
+
+	// Background reader for the input reports, started on first use
+	// by LWZ_INPUT_POLL or LWZ_SET_INPUT_CALLBACK
+	lwz_input_t *pinput;
+
+	#if defined(USE_SEPARATE_IO_THREAD)
+	// Write queue and I/O thread of the device.  Every physical device
+	// has its own, so that a paced LedWiz can't hold back the others.
+	// Virtual Pinscape units use the queue of the base unit.
+	HQUEUE hqueue;
+	#endif
+
 	// detected device type
 	UINT device_type;
 
@@ -106,24 +253,65 @@ typedef struct {
 	// Device name, from the USB HID descriptor
 	char device_name[256];
 
-	// USB HID descriptor data; we save this because it contains the file
-	// system path for the device, which we might need to re-open the
-	// file handle after a device change event
-	DWORD dat[256];
+	// File system path of the device, which we might need to re-open
+	// the file handle after a device change event
+	char device_path[USBDEV_MAX_PATH];
 } lwz_device_t;
 
-typedef void * HQUEUE;
+// What the output calls need to know about a unit.  A virtual Pinscape
+// unit is routed to the physical unit, with its port group.
+typedef struct {
+	lwz_state_t *pstate;    // NULL if there is no unit
+	HUDEV hudev;
+	HQUEUE hqueue;
+	int indx;               // the physical device
+	int port_group;
+	int num_outputs;        // of the physical device, see LWZ_SET_OUTPUTS()
+} lwz_route_t;
+
+// Snapshot of the device list for the output calls, so that they don't
+// have to take g_cs and wait for a rescan, which can take a while as it
+// opens and queries every HID device.  The snapshot is never changed
+// while it is in use: the owner of g_cs fills in the other one and swaps
+// the pointer, then waits until the readers of the old one are gone
+// before it closes a removed device.  See lwz_table_enter().
+typedef struct {
+	volatile LONG readers;
+	lwz_route_t routes[LWZ_MAX_DEVICES];
+} lwz_table_t;
 
 typedef struct
 {
 	lwz_device_t devices[LWZ_MAX_DEVICES];
+
+	lwz_table_t tables[2];
+	lwz_table_t * volatile ptable;
+
 	LWZDEVICELIST *plist;
 	HWND hwnd;
+
+	// what the earlier scans found out, see lwz_scan_devices()
+	HUCACHE hcache;
+	lwz_idcache_t idcache;
+
+	// see LWZ_SET_SHUTDOWN()
+	DWORD shutdown_timeout_ms;
+	bool shutdown_all_off;
+
+	#if defined(_WIN32)
 	HANDLE hDevNotify;
 	WNDPROC WndProc;
-
-	#if defined(USE_SEPARATE_IO_THREAD)
-	HQUEUE hqueue;
+	#if defined(USE_BACKGROUND_SCAN)
+	HANDLE hscan_thread;    // enumerates the devices after a DBT_DEVICEARRIVAL
+	HANDLE hscan_event;     // wakes it up
+	HANDLE hscan_done;      // set at the end of the thread routine
+	volatile LONG scan_quit;
+	lwz_scan_t * volatile pscan_result;  // waiting for the window thread
+	UINT scan_msg;          // posted to the window when there is a result
+	#endif
+	#else
+	void * hmonitor;        // hot plug monitor, stands in for WM_DEVICECHANGE
+	volatile bool monitor_stopping;
 	#endif
 
 	struct {
@@ -135,6 +323,8 @@ typedef struct
 } lwz_context_t;
 
 // 'g_cs' protects our state if there is more than on thread in the process using the API.
+// The output calls (LWZ_SBA, LWZ_PBA, LWZ_UPDATE_BATCH and LWZ_RAWWRITE) don't take it, they
+// go through the lwz_table_t snapshot instead.
 // Do not synchronize with other threads from within the callback routine because then it can deadlock!
 // Calling the API within the callback from the same thread is fine because the critical section does not block for that.
 CRITICAL_SECTION g_cs;
@@ -143,34 +333,78 @@ CRITICAL_SECTION g_cs;
 lwz_context_t * g_plwz = NULL;
 
 
+#if defined(_WIN32)
 static LRESULT CALLBACK lwz_wndproc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
+#else
+static void lwz_hotplug(void *puser, bool attached);
+#endif
 
 static lwz_context_t * lwz_open(HINSTANCE hinstDLL);
 static void lwz_close(lwz_context_t *h);
+static void lwz_pin_module(void);
 
 static void lwz_register(lwz_context_t *h, int indx_user, HWND hwnd);
 static HUDEV lwz_get_hdev(lwz_context_t *h, int indx_user);
+static HQUEUE lwz_get_queue(lwz_context_t *h, int indx_user);
+static void lwz_stop_output(lwz_device_t *dev, bool all_off);
+static bool lwz_close_output(lwz_device_t *dev, bool unload, DWORD tdeadline);
 static void lwz_notify_callback(lwz_context_t *h, int reason, LWZHANDLE hlwz);
 
 static void lwz_refreshlist_attached(lwz_context_t *h);
 static void lwz_refreshlist_detached(lwz_context_t *h);
+static lwz_scan_t * lwz_scan_devices(lwz_context_t *h, volatile LONG const *pquit);
+static void lwz_scan_commit(lwz_context_t *h, lwz_scan_t *pscan);
+static void lwz_scan_free(lwz_scan_t *pscan);
+static bool lwz_identify(HUDEV hudev, usbdev_info_t const *pinfo, lwz_ident_t *pident);
+static bool lwz_ident_lookup(lwz_idcache_t *pc, unsigned int serial, usbdev_info_t const *pinfo, lwz_ident_t *pident);
+static void lwz_ident_store(lwz_idcache_t *pc, unsigned int serial, lwz_ident_t const *pident);
+static void lwz_ident_forget(lwz_idcache_t *pc, char const *devicepath);
+#if defined(_WIN32) && defined(USE_BACKGROUND_SCAN)
+static void lwz_scan_start(lwz_context_t *h);
+static bool lwz_scan_stop(lwz_context_t *h, bool unload, DWORD tdeadline);
+#endif
 static void lwz_freelist(lwz_context_t *h);
-static void lwz_add(lwz_context_t *h, int indx);
 static void lwz_remove(lwz_context_t *h, int indx);
 
 enum packet_type_t
 {
-	PACKET_TYPE_SBA,		// Original LedWiz SBA
-	PACKET_TYPE_PBA,		// Original LedWiz PBA
 	PACKET_TYPE_RAW,		// raw format (for LwCloneU2 control messages)	
-	PACKET_TYPE_SBX,		// Pinscape SBX (extended SBA, for ports beyond 32)
-	PACKET_TYPE_PBX 		// Pinscape PBX (extended PBA, for ports beyond 32)
+	PACKET_TYPE_STATE,		// write the output state (SBA/PBA/SBX/PBX as needed), see lwz_state_t
+	PACKET_TYPE_NONE		// nothing was queued before the timeout, see queue_shift()
 };
 
-static void queue_close(HQUEUE hqueue, bool unload);
-static HQUEUE queue_open(void);
+static lwz_state_t * lwz_state_open(bool use_pbx);
+static void lwz_state_close(lwz_state_t *ps);
+static bool lwz_state_set_switches(lwz_state_t *ps, int group, BYTE const *pbanks, BYTE pulse_speed);
+static bool lwz_state_set_profiles(lwz_state_t *ps, int group, BYTE const *pprofiles);
+static bool lwz_state_set_outputs(lwz_state_t *ps, int first, int count, BYTE const *pvalues);
+static bool lwz_state_add_frame(lwz_state_t *ps, int64_t tpresent_us, int group, LWZUPDATE const *pupdate);
+static void lwz_state_present_all(lwz_state_t *ps);
+static DWORD lwz_state_frame_wait(lwz_state_t *ps);
+static void lwz_state_write(lwz_state_t *ps, HUDEV hudev);
+static void lwz_state_all_off(lwz_state_t *ps);
+static void lwz_state_invalidate(lwz_state_t *ps);
+static void lwz_state_count_raw(lwz_state_t *ps);
+static void lwz_state_add_latency(lwz_state_t *ps, int64_t tstart_us);
+static void lwz_state_queue_level(lwz_state_t *ps, unsigned int level);
+static lwz_state_t * lwz_get_state(lwz_context_t *h, int indx_user);
+static void lwz_state_schedule(lwz_route_t const *pr);
+
+static lwz_table_t * lwz_table_enter(lwz_context_t *h);
+static void lwz_table_leave(lwz_table_t *pt);
+static void lwz_table_publish(lwz_context_t *h);
+
+static lwz_input_t * lwz_input_open(HUDEV hudev, LWZHANDLE hlwz, UINT report_len);
+static void lwz_input_close(lwz_input_t *pi, bool unload);
+static size_t lwz_input_pop(lwz_input_t *pi, BYTE *pdata, size_t ndata, DWORD timeout_ms);
+static void lwz_input_set_callback(lwz_input_t *pi, LWZINPUTPROC proc, void *puser);
+static lwz_input_t * lwz_get_input(lwz_context_t *h, int indx_user, bool start);
+
+static void queue_stop(HQUEUE hqueue, HUDEV hudev, bool final_write);
+static bool queue_close(HQUEUE hqueue, bool unload, DWORD tdeadline);
+static HQUEUE queue_open(lwz_state_t *pstate);
 static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t const *pdata, size_t ndata);
-static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, uint8_t *pbuffer, size_t nsize);
+static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, packet_type_t *ptyp, int64_t *ptpush_us, uint8_t *pbuffer, size_t nsize, DWORD timeout_ms);
 static void queue_wait_empty(HQUEUE hqueue);
 
 
@@ -199,76 +433,35 @@ void LWZ_SBA(
 	LOG("SBA(unit=%d, {%02x,%02x,%02x,%02x}, speed=%d)\n",
 		hlwz, bank0, bank1, bank2, bank3, globalPulseSpeed);
 
-	AUTOLOCK(g_cs);
-
 	// validate the device index
 	int indx = hlwz - 1;
 	if (indx < 0 || indx >= LWZ_MAX_DEVICES)
 		return;
 
-	// Start with the standard SBA message: command code 64.  The
-	// "port group" byte is used only in SBX messages; this is unused
-	// in regular SBA messages and must be zero.
-	BYTE cmd = 64;
-	int port_group = 0;
-	packet_type_t packet_type = PACKET_TYPE_SBA;
-
-	// check to see if this is addressed to a Pinscape virtual LedWiz
-	lwz_device_t *pdev = &g_plwz->devices[indx];
-	if (pdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
-	{
-		// get the real Pinscape reference information
-		ps_virtual_lwz_t *ps = &g_plwz->devices[indx].ps_virtual_lwz;
-
-		// Figure the port group.
-		// The port group tells the Pinscape unit which group of 32
-		// ports we're addressing.  The base Pinscape interface for
-		// the unit addresses the first 32 ports (0-31).  The first
-		// *virtual* interface addresses the next 32 ports (32-64).
-		// The second virtual interface addresses the next 32, and
-		// so on.  The virtual interfaces are always numbered
-		// consecutively after the base Pinscape interface, so we
-		// can determine the group simply by looking at the indices.
-		// If the Pinscape unit is at index N, and we're at index
-		// N+1, we're the first virtual interface, so we address the
-		// first block of extended ports; if we're at N+2, we address
-		// the second block.
-		port_group = indx - ps->base_unit;
-
-		// redirect the message to the physical Pinscape device
-		indx = ps->base_unit;
-
-		// switch to Pinscape SBX message
-		cmd = 67;
-		packet_type = PACKET_TYPE_SBX;
-	}
-
-	// make sure we have a valid file handle
-	HUDEV hudev = lwz_get_hdev(g_plwz, indx);
-	if (hudev == NULL)
-		return;
-
-	// set up the SBA or SBX message
-	BYTE data[8];
-	data[0] = cmd;
-	data[1] = bank0;
-	data[2] = bank1;
-	data[3] = bank2;
-	data[4] = bank3;
-	data[5] = globalPulseSpeed;
-	data[6] = port_group;
-	data[7] = 0;
-
-	#if defined(USE_SEPARATE_IO_THREAD)
-
-	queue_push(g_plwz->hqueue, hudev, packet_type, &data[0], 8);
-
-	#else
-
-	usbdev_write(hudev, &data[0], 8);
-
-	#endif
+	// SBA messages address the first 32 ports.  Pinscape units with more
+	// outputs expose the rest through virtual LedWiz units, which are sent
+	// to the physical unit as SBX messages with a port group.  The port
+	// group tells the Pinscape unit which group of 32 ports we're
+	// addressing: the base Pinscape interface for the unit addresses the
+	// first 32 ports (0-31), the first *virtual* interface the next 32
+	// ports (32-64), and so on.  The virtual interfaces are always numbered
+	// consecutively after the base Pinscape interface, so the route of a
+	// virtual unit has the group from the difference of the indices, and
+	// the physical Pinscape device as the target.
+	lwz_table_t * const pt = lwz_table_enter(g_plwz);
+	lwz_route_t const * const pr = &pt->routes[indx];
+
+	// update the desired output state of a valid device; the message(s)
+	// are built from it when the device is written to
+	BYTE banks[4] = { (BYTE)bank0, (BYTE)bank1, (BYTE)bank2, (BYTE)bank3 };
+
+	if (pr->pstate != NULL &&
+		lwz_state_set_switches(pr->pstate, pr->port_group, banks, (BYTE)globalPulseSpeed))
+	{
+		lwz_state_schedule(pr);
+	}
 
+	lwz_table_leave(pt);
 }
 
 void LWZ_PBA(LWZHANDLE hlwz, BYTE const *pbrightness_32bytes)
@@ -280,8 +473,6 @@ void LWZ_PBA(LWZHANDLE hlwz, BYTE const *pbrightness_32bytes)
 	LOG("})\n");
 #endif
 
-	AUTOLOCK(g_cs);
-
 	// get and validate the device index
 	int indx = hlwz - 1;
 	if (indx < 0 || indx >= LWZ_MAX_DEVICES)
@@ -291,153 +482,227 @@ void LWZ_PBA(LWZHANDLE hlwz, BYTE const *pbrightness_32bytes)
 	if (pbrightness_32bytes == NULL)
 		return;
 
-	// for regular PBA messages, we'll send the caller's brightness
-	// byte array directly
-	const BYTE *pdata = pbrightness_32bytes;
-
-	// presume we'll use a send this as a standard PBA message
-	packet_type_t packet_type = PACKET_TYPE_PBA;
-
-	// Check to see if this is addressed to a Pinscape unit or Pinscape
-	// virtual LedWiz interface.  If so, switch the message to the
-	// extended PBX format instead.
-	BOOL pbx = false;
-	lwz_device_t *pdev = &g_plwz->devices[indx];
-	int port_group = 0;
-	if (pdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE && pdev->supports_sbx_pbx)
-	{
-		// It's a physical Pinscape unit, and it supports the extended
-		// SBX/PBX messages.  The updates are addressed to ports 1-32, so
-		// we could just keep the message with the PBA format.  But switch
-		// to PBX anyway, as it's a more reliable message format.  The
-		// regular PBA is stateful, as the ports being addressed are
-		// implied by the protocol state.  PBX encodes the port address
-		// directly in the message, which eliminates the possibility of
-		// the host and device getting out of sync.
-		pbx = true;
-	}
-	else if (pdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
-	{
-		// It's a Pinscape virtual LedWiz unit.  Get the underlying
-		// physical Pinscape unit reference.
-		ps_virtual_lwz_t *ps = &g_plwz->devices[indx].ps_virtual_lwz;
-
-		// Figure the port group.
-		// The port group tells the Pinscape unit which group of 8
-		// ports we're addressing.  The base Pinscape interface for
-		// the unit addresses the first 32 ports (0-31).  The first
-		// *virtual* interface addresses the next 32 ports (32-64).
-		// The second virtual interface addresses the next 32, and
-		// so on.  The virtual interfaces are always numbered
-		// consecutively after the base Pinscape interface, so we
-		// can figure which block of 32 ports this unit addresses
-		// from the unit index.  If the Pinscape unit is at index N,
-		// and we're at index N+1, we're the first virtual interface,
-		// so we address ports 32-64.  If we're at N+2, we address
-		// ports 65-96, and so on.
-		//
-		// For PBX purposes, we want the group of 8 ports we're
-		// addressing.  Each unit is 32 ports, so the unit number
-		// offset (from the base unit) gives us the group of 32
-		// ports.  So the group of 8 is offset*32/8 = offset*4.
-		port_group = 4*(indx - ps->base_unit);
-
-		// redirect the mesage to the Pinscape device as a PBX
-		pbx = true;
-		indx = ps->base_unit;
-	}
-
-	// If we're using the Pinscape extended PBX message, rewrite the
-	// message data using the PBX format.
-	BYTE bbuf[32];
-	if (pbx)
-	{
-		// Encode each set of 8 bytes as a PBX message
-		const BYTE *psrc = pdata;
-		BYTE *pdst = bbuf;
-		for (int block = 0 ; block < 4 ;
-			 ++block, ++port_group, psrc += 8, pdst += 8)
-		{
-			// encode this PBX message:
-			//
-			// 68 pp ee ee ee ee ee ee
-			//
-			// 68 = command code
-			// pp = port group: 0 for ports 1-8, 1 for 9-16, etc
-			// ee = packed brightness values, 6 bits per port
-
-			// LedWiz flash codes have to be translated for PBX to fit into 6 bits.
-			// 129->60, 130->61, 131->62, 132->63.
-			BYTE tmp[8];
-			for (int i = 0 ; i < 8 ; ++i)
-				tmp[i] = (psrc[i] >= 129 ? psrc[i] - 129 + 60 : psrc[i]) & 0x3F;
-
-			// pack the first four brightness values into tmp1, the next four into tmp2
-			unsigned int tmp1 = tmp[0] | (tmp[1]<<6) | (tmp[2]<<12) | (tmp[3]<<18);
-			unsigned int tmp2 = tmp[4] | (tmp[5]<<6) | (tmp[6]<<12) | (tmp[7]<<18);
-
-			// now construct the 8-byte PBX message
-			pdst[0] = 68;
-			pdst[1] = port_group;
-			pdst[2] = tmp1 & 0xFF;
-			pdst[3] = (tmp1 >> 8) & 0xFF;
-			pdst[4] = (tmp1 >> 16) & 0xFF;
-			pdst[5] = tmp2 & 0xFF;
-			pdst[6] = (tmp2 >> 8) & 0xFF;
-			pdst[7] = (tmp2 >> 16) & 0xFF;
-		}
-
-		// use the encoded private copy instead of the original
-		pdata = bbuf;
-		packet_type = PACKET_TYPE_PBX;
-	}
-
-	// get the USB handle
-	HUDEV hudev = lwz_get_hdev(g_plwz, indx);
-	if (hudev == NULL)
+	// If this is addressed to a Pinscape virtual LedWiz interface, the
+	// route has the Pinscape device and the block of ports beyond 32 that
+	// the brightness levels are for, see LWZ_SBA().
+	lwz_table_t * const pt = lwz_table_enter(g_plwz);
+	lwz_route_t const * const pr = &pt->routes[indx];
+
+	// update the desired output state of a valid device; the PBA or PBX
+	// messages are built from it when the device is written to
+	if (pr->pstate != NULL &&
+		lwz_state_set_profiles(pr->pstate, pr->port_group, pbrightness_32bytes))
+	{
+		lwz_state_schedule(pr);
+	}
+
+	lwz_table_leave(pt);
+}
+
+int32_t LWZ_UPDATE_BATCH(LWZUPDATE const *pupdates, int32_t nupdates)
+{
+	if (pupdates == NULL)
+		return 0;
+
+	lwz_table_t * const pt = lwz_table_enter(g_plwz);
+
+	// physical devices that need a write, scheduled once all
+	// entries are applied so that they all start together
+	bool schedule[LWZ_MAX_DEVICES] = { };
+	int32_t napplied = 0;
+
+	for (int32_t i = 0 ; i < nupdates ; ++i)
+	{
+		LWZUPDATE const *pupdate = &pupdates[i];
+
+		int indx = pupdate->hlwz - 1;
+		if (indx < 0 || indx >= LWZ_MAX_DEVICES)
+			continue;
+
+		// virtual Pinscape units address a port group of the physical
+		// unit, the same as in LWZ_SBA() and LWZ_PBA()
+		lwz_route_t const * const pr = &pt->routes[indx];
+		if (pr->pstate == NULL)
+			continue;
+
+		// brightness first, see lwz_state_write()
+		if ((pupdate->flags & LWZ_UPDATE_PBA) != 0 &&
+			lwz_state_set_profiles(pr->pstate, pr->port_group, pupdate->brightness))
+		{
+			schedule[pr->indx] = true;
+		}
+
+		if ((pupdate->flags & LWZ_UPDATE_SBA) != 0 &&
+			lwz_state_set_switches(pr->pstate, pr->port_group, pupdate->banks, pupdate->globalPulseSpeed))
+		{
+			schedule[pr->indx] = true;
+		}
+
+		napplied++;
+	}
+
+	for (int indx = 0 ; indx < LWZ_MAX_DEVICES ; ++indx)
+	{
+		if (schedule[indx])
+			lwz_state_schedule(&pt->routes[indx]);
+	}
+
+	lwz_table_leave(pt);
+
+	return napplied;
+}
+
+int32_t LWZ_SET_OUTPUTS(LWZHANDLE hlwz, int32_t first_port, int32_t count, uint8_t const *pvalues)
+{
+	int indx = hlwz - 1;
+	if (indx < 0 || indx >= LWZ_MAX_DEVICES)
+		return 0;
+
+	// no device has more ports, and the sum below can't overflow
+	if (pvalues == NULL || first_port < 1 || first_port > LWZ_MAX_PORT_GROUPS * 32 || count <= 0)
+		return 0;
+
+	lwz_table_t * const pt = lwz_table_enter(g_plwz);
+	lwz_route_t const * const pr = &pt->routes[indx];
+
+	// The ports are numbered from the unit that is addressed, so for a
+	// virtual Pinscape unit port 1 is the first port of its group.  The
+	// range is cut at the last output of the physical device.
+	int const first = pr->port_group * 32 + first_port - 1;
+	int32_t nset = 0;
+
+	if (pr->pstate != NULL && first < pr->num_outputs)
+	{
+		nset = count < pr->num_outputs - first ? count : pr->num_outputs - first;
+
+		if (lwz_state_set_outputs(pr->pstate, first, nset, pvalues))
+			lwz_state_schedule(pr);
+	}
+
+	lwz_table_leave(pt);
+
+	return nset;
+}
+
+void LWZ_SET_PRIORITY(
+	LWZHANDLE hlwz,
+	unsigned int bank0,
+	unsigned int bank1,
+	unsigned int bank2,
+	unsigned int bank3)
+{
+	LOG("SET_PRIORITY(unit=%d, {%02x,%02x,%02x,%02x})\n",
+		hlwz, bank0, bank1, bank2, bank3);
+
+	int indx = hlwz - 1;
+	if (indx < 0 || indx >= LWZ_MAX_DEVICES)
 		return;
 
-	#if defined(USE_SEPARATE_IO_THREAD)
+	lwz_table_t * const pt = lwz_table_enter(g_plwz);
+	lwz_route_t const * const pr = &pt->routes[indx];
 
-	queue_push(g_plwz->hqueue, hudev, packet_type, pdata, 32);
+	// the ports of a virtual unit are a group of the physical device,
+	// like for LWZ_SBA(); the next write picks them up
+	if (pr->pstate != NULL && pr->port_group < LWZ_MAX_PORT_GROUPS)
+	{
+		AUTOLOCK(pr->pstate->cs);
 
-	#else
+		BYTE * const ppriority = pr->pstate->priority[pr->port_group];
+		ppriority[0] = (BYTE)bank0;
+		ppriority[1] = (BYTE)bank1;
+		ppriority[2] = (BYTE)bank2;
+		ppriority[3] = (BYTE)bank3;
+	}
+
+	lwz_table_leave(pt);
+}
 
-	usbdev_write(hudev, pdata, 32);
+int32_t LWZ_UPDATE_FRAME(LWZUPDATE const *pupdates, int32_t nupdates, int64_t present_us)
+{
+	if (pupdates == NULL)
+		return 0;
 
-	#endif
+	lwz_table_t * const pt = lwz_table_enter(g_plwz);
+
+	// Unlike LWZ_UPDATE_BATCH(), nothing changes until the frame is due.
+	// The I/O thread of a device keeps the frame and applies it when it
+	// has to start writing to be done by 'present_us'; it only has to be
+	// woken up to see it.
+	bool schedule[LWZ_MAX_DEVICES] = { };
+	int32_t napplied = 0;
+
+	for (int32_t i = 0 ; i < nupdates ; ++i)
+	{
+		LWZUPDATE const *pupdate = &pupdates[i];
+
+		int indx = pupdate->hlwz - 1;
+		if (indx < 0 || indx >= LWZ_MAX_DEVICES)
+			continue;
+
+		lwz_route_t const * const pr = &pt->routes[indx];
+		if (pr->pstate == NULL)
+			continue;
+
+		if (lwz_state_add_frame(pr->pstate, present_us, pr->port_group, pupdate))
+			schedule[pr->indx] = true;
+
+		napplied++;
+	}
+
+	for (int indx = 0 ; indx < LWZ_MAX_DEVICES ; ++indx)
+	{
+		if (schedule[indx])
+			lwz_state_schedule(&pt->routes[indx]);
+	}
+
+	lwz_table_leave(pt);
+
+	return napplied;
 }
 
-DWORD LWZ_RAWWRITE(LWZHANDLE hlwz, BYTE const *pdata, DWORD ndata)
+int64_t LWZ_GET_TIME(void)
 {
-	AUTOLOCK(g_cs);
+	return usbdev_time_us();
+}
 
+DWORD LWZ_RAWWRITE(LWZHANDLE hlwz, BYTE const *pdata, DWORD ndata)
+{
 	int indx = hlwz - 1;
 
 	if (pdata == NULL || ndata == 0)
 		return 0;
 
+	if (indx < 0 || indx >= LWZ_MAX_DEVICES)
+		return 0;
+
 	if (ndata > 32)
 	    ndata = 32;
 
-	HUDEV hudev = lwz_get_hdev(g_plwz, indx);
-
-	if (hudev == NULL) {
-		return 0;
-	}
+	lwz_table_t * const pt = lwz_table_enter(g_plwz);
+	lwz_route_t const * const pr = &pt->routes[indx];
 
-	int res = 0;
 	DWORD nbyteswritten = 0;
 
-	#if defined(USE_SEPARATE_IO_THREAD)
+	// raw messages only go to physical devices
+	if (pr->pstate != NULL && pr->indx == indx)
+	{
+		lwz_state_count_raw(pr->pstate);
 
-	nbyteswritten = queue_push(g_plwz->hqueue, hudev, PACKET_TYPE_RAW, pdata, ndata);
+		#if defined(USE_SEPARATE_IO_THREAD)
 
-	#else
+		nbyteswritten = queue_push(pr->hqueue, pr->hudev, PACKET_TYPE_RAW, pdata, ndata);
 
-	usbdev_write(hudev, pdata, ndata);
+		#else
 
-	#endif
+		int64_t const tstart_us = usbdev_time_us();
+		usbdev_write(pr->hudev, pdata, ndata);
+		lwz_state_invalidate(pr->pstate);
+		lwz_state_add_latency(pr->pstate, tstart_us);
+
+		#endif
+	}
+
+	lwz_table_leave(pt);
 
 	return nbyteswritten;
 }
@@ -461,12 +726,130 @@ DWORD LWZ_RAWREAD(LWZHANDLE hlwz, BYTE *pdata, DWORD ndata)
 	}
 
 	#if defined(USE_SEPARATE_IO_THREAD)
-	queue_wait_empty(g_plwz->hqueue);
+	queue_wait_empty(lwz_get_queue(g_plwz, indx));
 	#endif
 
+	// the background reader gets all reports once it runs
+	lwz_input_t * const pinput = lwz_get_input(g_plwz, indx, false);
+	if (pinput != NULL)
+		return lwz_input_pop(pinput, pdata, ndata, RAWREAD_TIMEOUT_MS);
+
 	return usbdev_read(hudev, pdata, ndata);
 }
 
+DWORD LWZ_INPUT_POLL(LWZHANDLE hlwz, BYTE *pdata, DWORD ndata)
+{
+	AUTOLOCK(g_cs);
+
+	if (pdata == NULL)
+		return 0;
+
+	lwz_input_t * const pinput = lwz_get_input(g_plwz, hlwz - 1, true);
+	if (pinput == NULL)
+		return 0;
+
+	return lwz_input_pop(pinput, pdata, ndata, 0);
+}
+
+BOOL LWZ_SET_INPUT_CALLBACK(LWZHANDLE hlwz, LWZINPUTPROC input_callback, void *puser)
+{
+	AUTOLOCK(g_cs);
+
+	if (lwz_get_hdev(g_plwz, hlwz - 1) == NULL)
+		return FALSE;
+
+	// no reader running, so there is no callback to clear
+	lwz_input_t * const pinput = lwz_get_input(g_plwz, hlwz - 1, input_callback != NULL);
+	if (pinput == NULL)
+		return input_callback == NULL;
+
+	lwz_input_set_callback(pinput, input_callback, puser);
+
+	return TRUE;
+}
+
+BOOL LWZ_GET_STATS(LWZHANDLE hlwz, LWZSTATS *pstats, BOOL reset)
+{
+	AUTOLOCK(g_cs);
+
+	// clients built before the frame counters were added pass a smaller
+	// structure, they get what fits
+	if (pstats == NULL || pstats->cbSize < offsetof(LWZSTATS, dwFramesShown))
+		return FALSE;
+
+	int indx = hlwz - 1;
+
+	if (indx < 0 || indx >= LWZ_MAX_DEVICES)
+		return FALSE;
+
+	// virtual units share the queue and the writes of the physical device
+	if (g_plwz->devices[indx].device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+		indx = g_plwz->devices[indx].ps_virtual_lwz.base_unit;
+
+	HUDEV hudev = lwz_get_hdev(g_plwz, indx);
+	lwz_state_t * const ps = lwz_get_state(g_plwz, indx);
+
+	if (hudev == NULL || ps == NULL)
+		return FALSE;
+
+	DWORD const cbSize = pstats->cbSize < sizeof(LWZSTATS) ? pstats->cbSize : sizeof(LWZSTATS);
+
+	LWZSTATS stats;
+	memset(&stats, 0x00, sizeof(stats));
+	stats.cbSize = pstats->cbSize;
+
+	{
+		AUTOLOCK(ps->cs);
+
+		stats.dwEnqueued = ps->enqueued;
+		stats.dwCoalesced = ps->coalesced;
+		stats.dwQueueHighWater = ps->queue_high_water;
+		stats.dwFramesShown = ps->frames_shown;
+		stats.dwFramesDropped = ps->frames_dropped;
+		stats.dwPreempted = ps->preempted;
+
+		for (int i = 0; i < LWZ_STATS_BUCKETS; i++)
+		{
+			stats.dwLatencyHist[i] = ps->latency_hist[i];
+			stats.dwPresentHist[i] = ps->present_hist[i];
+		}
+
+		if (reset)
+		{
+			ps->enqueued = 0;
+			ps->coalesced = 0;
+			ps->queue_high_water = 0;
+			ps->frames_shown = 0;
+			ps->frames_dropped = 0;
+			ps->preempted = 0;
+			memset(ps->latency_hist, 0x00, sizeof(ps->latency_hist));
+			memset(ps->present_hist, 0x00, sizeof(ps->present_hist));
+		}
+	}
+
+	usbdev_stats_t ustats;
+	usbdev_get_stats(hudev, &ustats, reset != FALSE);
+
+	stats.dwWritten = ustats.written;
+	stats.dwFailed = ustats.failed;
+	stats.dwTimedOut = ustats.timed_out;
+
+	for (int i = 0; i < LWZ_STATS_BUCKETS; i++)
+		stats.dwWriteHist[i] = ustats.write_hist[i];
+
+	memcpy(pstats, &stats, cbSize);
+
+	return TRUE;
+}
+
+void LWZ_SET_SHUTDOWN(DWORD timeout_ms, BOOL all_off)
+{
+	AUTOLOCK(g_cs);
+
+	g_plwz->shutdown_timeout_ms = timeout_ms;
+	g_plwz->shutdown_all_off = all_off != FALSE;
+}
+
 void LWZ_REGISTER(LWZHANDLE hlwz, HWND hwnd)
 {
 	LOG(hwnd == 0 ? "LWZ_REGISTER(%d, null)\n" : "LWZ_REGISTER(%d, %lx)\n",
@@ -594,6 +977,19 @@ BOOL LWZ_GET_DEVICE_INFO(LWZHANDLE hlwz, LWZDEVICEINFO *info)
 	info->dwDevType = dev->device_type;
 	safe_strcpy(info->szName, sizeof(info->szName), dev->device_name);
 
+	// the write timing, if the caller's structure has room for it
+	if (info->cbSize >= offsetof(LWZDEVICEINFO, dwWriteLatency) + sizeof(info->dwWriteLatency))
+	{
+		// virtual units share the physical device
+		int const base = dev->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT ? dev->ps_virtual_lwz.base_unit : indx;
+
+		unsigned int interval_us, latency_us;
+		usbdev_get_write_timing(h->devices[base].hudev, &interval_us, &latency_us);
+
+		info->dwWriteInterval = interval_us;
+		info->dwWriteLatency = latency_us;
+	}
+
 	// success
 	return TRUE;
 }
@@ -603,6 +999,8 @@ BOOL LWZ_GET_DEVICE_INFO(LWZHANDLE hlwz, LWZDEVICEINFO *info)
 // Low level implementation 
 //**********************************************************************************************************************
 
+#if defined(_WIN32)
+
 BOOL WINAPI DllMain(
 	HINSTANCE hinstDLL,
 	DWORD fdwReason,
@@ -636,6 +1034,26 @@ BOOL WINAPI DllMain(
 	return TRUE;
 }
 
+// Keep the DLL mapped until the process exits.  An I/O thread that
+// queue_close() gives up on still runs our code when its write returns,
+// so FreeLibrary() must not unmap us under it.  This has to happen before
+// the unload starts; once the loader calls DllMain() to detach, the DLL
+// goes away no matter what.  DLL_PROCESS_DETACH then comes at the
+// process exit.
+static void lwz_pin_module(void)
+{
+	static volatile LONG pinned = 0;
+
+	if (InterlockedExchange(&pinned, 1) != 0)
+		return;
+
+	HMODULE hmod = NULL;
+	GetModuleHandleExA(
+		GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+		(LPCSTR)&lwz_pin_module,
+		&hmod);
+}
+
 static LRESULT CALLBACK lwz_wndproc(
 	HWND hwnd,
     UINT uMsg,
@@ -649,15 +1067,46 @@ static LRESULT CALLBACK lwz_wndproc(
 	// get the original WndProc
 	WNDPROC OriginalWndProc = h->WndProc;
 
-	// check the message type
-	switch (uMsg)
+	#if defined(USE_BACKGROUND_SCAN)
+
+	// the scan thread is done, add what it found (this is our own
+	// message, so don't forward it)
+	if (uMsg == h->scan_msg && h->scan_msg != 0)
 	{
-	case WM_DEVICECHANGE:
-		// device change - check which type (attach or detach)
-		switch (wParam)
+		lwz_scan_t * const pscan = (lwz_scan_t *)InterlockedExchangePointer(
+			(PVOID volatile *)&h->pscan_result, NULL);
+
+		if (pscan != NULL)
 		{
-		case DBT_DEVICEARRIVAL:
-			lwz_refreshlist_attached(h);
+			lwz_scan_commit(h, pscan);
+			lwz_scan_free(pscan);
+		}
+
+		return 0;
+	}
+
+	#endif
+
+	// check the message type
+	switch (uMsg)
+	{
+	case WM_DEVICECHANGE:
+		// device change - check which type (attach or detach)
+		switch (wParam)
+		{
+		case DBT_DEVICEARRIVAL:
+			// Opening and querying all HID interfaces can take seconds,
+			// so leave that to the scan thread if there is one; the
+			// notifications come from here once it is done.
+			#if defined(USE_BACKGROUND_SCAN)
+			if (h->hscan_thread != NULL)
+			{
+				SetEvent(h->hscan_event);
+				break;
+			}
+			#endif
+
+			lwz_refreshlist_attached(h);
 			break;
 			
 		case DBT_DEVICEREMOVECOMPLETE:
@@ -686,6 +1135,97 @@ static LRESULT CALLBACK lwz_wndproc(
 	return 0;
 }
 
+#else
+
+// Without a DLL entry point, set up and tear down the library context
+// when the shared object is loaded and unloaded.
+
+__attribute__((constructor))
+static void lwz_so_load(void)
+{
+	LOG("*****\n"
+		"libledwiz loading\n\n");
+	InitializeCriticalSection(&g_cs);
+
+	g_plwz = lwz_open(NULL);
+}
+
+__attribute__((destructor))
+static void lwz_so_unload(void)
+{
+	if (g_plwz == NULL)
+		return;
+
+	{
+		AUTOLOCK(g_cs);
+
+		lwz_close(g_plwz);
+		g_plwz = NULL;
+	}
+
+	DeleteCriticalSection(&g_cs);
+}
+
+// Same as on Windows: with RTLD_NODELETE on our own handle, dlclose()
+// leaves the library mapped for an abandoned I/O thread, and the
+// destructor above runs at exit() instead.
+static void lwz_pin_module(void)
+{
+	static volatile LONG pinned = 0;
+
+	if (InterlockedExchange(&pinned, 1) != 0)
+		return;
+
+	Dl_info info;
+
+	if (dladdr((void *)&lwz_pin_module, &info) != 0 && info.dli_fname != NULL)
+		dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE);
+}
+
+// Hot plug monitor callback.  This comes from the monitor thread, which
+// is the only difference to Windows where the notification callbacks are
+// invoked from the thread of the registered window.  The monitor can only
+// be stopped with g_cs held, so don't block on g_cs here forever or that
+// would deadlock; give up once the monitor is on its way out.
+// The enumeration is done before taking g_cs, the other API calls don't
+// have to wait for it.
+static void lwz_hotplug(void *puser, bool attached)
+{
+	lwz_context_t * const h = (lwz_context_t *)puser;
+
+	lwz_scan_t * const pscan = attached ? lwz_scan_devices(h, NULL) : NULL;
+
+	while (!TryEnterCriticalSection(&g_cs))
+	{
+		if (h->monitor_stopping)
+		{
+			lwz_scan_free(pscan);
+			return;
+		}
+
+		Sleep(10);
+	}
+
+	if (!h->monitor_stopping)
+	{
+		if (attached)
+		{
+			if (pscan != NULL)
+				lwz_scan_commit(h, pscan);
+		}
+		else
+		{
+			lwz_refreshlist_detached(h);
+		}
+	}
+
+	LeaveCriticalSection(&g_cs);
+
+	lwz_scan_free(pscan);
+}
+
+#endif
+
 static lwz_context_t * lwz_open(HINSTANCE hinstDLL)
 {
 	// allocate the context
@@ -700,14 +1240,18 @@ static lwz_context_t * lwz_open(HINSTANCE hinstDLL)
 	for (int i = 0 ; i < LWZ_MAX_DEVICES ; ++i)
 		h->devices[i].device_type = LWZ_DEVICE_TYPE_NONE;
 
-	// set up the I/O queue and worker thread
-	#if defined(USE_SEPARATE_IO_THREAD)
-	if ((h->hqueue = queue_open()) == NULL)
-	{
-		free(h);
-		return NULL;
-	}
-	#endif
+	// no routes yet
+	h->ptable = &h->tables[0];
+
+	// nothing scanned yet; without the interface cache every scan opens
+	// all HID interfaces again
+	h->hcache = usbdev_cache_create();
+	InitializeCriticalSection(&h->idcache.cs);
+
+	h->shutdown_timeout_ms = SHUTDOWN_TIMEOUT_MS;
+	h->shutdown_all_off = false;
+
+	// the I/O queues are set up per device, as they are found
 
 	return h;
 }
@@ -720,22 +1264,29 @@ static void lwz_close(lwz_context_t *h)
 	// close all open device handles and
 	// unhook our window proc (and unregister the device change notifications)
 
+	#if defined(_WIN32) && defined(USE_BACKGROUND_SCAN)
+	bool const scan_stopped = lwz_scan_stop(h, true, GetTickCount() + h->shutdown_timeout_ms);
+	#else
+	bool const scan_stopped = true;
+	#endif
+
 	lwz_freelist(h);
 	lwz_register(h, 0, NULL);
 
-	#if defined(USE_SEPARATE_IO_THREAD)
-	if (h->hqueue != NULL)
-	{
-		queue_close(h->hqueue, true);
-		h->hqueue = NULL;
-	}
-	#endif
+	// a scan thread that was left behind still uses the context
+	if (!scan_stopped)
+		return;
 
 	// free resources
 
+	usbdev_cache_free(h->hcache);
+	DeleteCriticalSection(&h->idcache.cs);
+
 	free(h);
 }
 	
+#if defined(_WIN32)
+
 static void lwz_register(lwz_context_t *h, int indx, HWND hwnd)
 {
 	// if there's a non-null window handle, register, otherwise unregister
@@ -783,10 +1334,19 @@ static void lwz_register(lwz_context_t *h, int indx, HWND hwnd)
 
 			h->hDevNotify = RegisterDeviceNotificationA(hwnd, &dbch, DEVICE_NOTIFY_WINDOW_HANDLE);
 		}
+
+		#if defined(USE_BACKGROUND_SCAN)
+		lwz_scan_start(h);
+		#endif
 	}
 	else
 	{
 		// Null window handle - unregister
+
+		// stop the scan thread first, it posts to the window
+		#if defined(USE_BACKGROUND_SCAN)
+		lwz_scan_stop(h, false, 0);
+		#endif
 		
 		// unregister the device notification
 		if (h->hDevNotify)
@@ -809,6 +1369,172 @@ static void lwz_register(lwz_context_t *h, int indx, HWND hwnd)
 	}
 }
 
+#if defined(USE_BACKGROUND_SCAN)
+
+// The scan thread enumerates the devices whenever the window procedure
+// sees a DBT_DEVICEARRIVAL.  It does not touch the device list; the result
+// is handed over to the window thread, which adds the devices and invokes
+// the notification callbacks as before.  Arrivals that come in while it is
+// busy are handled by one more scan.
+
+static DWORD WINAPI ScanThreadProc(LPVOID lpParameter)
+{
+	lwz_context_t * const h = (lwz_context_t *)lpParameter;
+
+	// lwz_scan_stop() may leave us behind, don't look at
+	// the context's handles once we have to quit
+	HANDLE const hevent = h->hscan_event;
+	HANDLE const hdone = h->hscan_done;
+
+	for (;;)
+	{
+		WaitForSingleObject(hevent, INFINITE);
+
+		if (h->scan_quit != 0)
+			break;
+
+		lwz_scan_t * const pscan = lwz_scan_devices(h, &h->scan_quit);
+
+		if (h->scan_quit != 0)
+		{
+			lwz_scan_free(pscan);
+			break;
+		}
+
+		if (pscan == NULL)
+			continue;
+
+		// a result the window thread did not pick up yet is out of date
+		lwz_scan_free((lwz_scan_t *)InterlockedExchangePointer(
+			(PVOID volatile *)&h->pscan_result, pscan));
+
+		PostMessageA(h->hwnd, h->scan_msg, 0, 0);
+	}
+
+	SetEvent(hdone);
+
+	return 0;
+}
+
+static void lwz_scan_start(lwz_context_t *h)
+{
+	if (h->hscan_thread != NULL)
+		return;
+
+	if (h->scan_msg == 0)
+		h->scan_msg = RegisterWindowMessageA("lwz_scan_done");
+
+	h->scan_quit = 0;
+	h->hscan_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+	h->hscan_done = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (h->scan_msg != 0 && h->hscan_event != NULL && h->hscan_done != NULL)
+		h->hscan_thread = CreateThread(NULL, 0, ScanThreadProc, (void*)h, 0, NULL);
+
+	// without the thread the window procedure scans by itself
+	if (h->hscan_thread == NULL)
+		lwz_scan_stop(h, false, 0);
+	else
+		lwz_pin_module();  // the thread may outlive an unload, see lwz_scan_stop()
+}
+
+// Stop the scan thread.  It quits after the interface it is probing.
+// Within the DLL unload, like queue_close(), we neither wait for the
+// thread itself nor past the deadline (a GetTickCount() value); a thread
+// that is still stuck in an interface by then is left alone with its
+// events, and the result is false.  The caller must not free the
+// context then.
+static bool lwz_scan_stop(lwz_context_t *h, bool unload, DWORD tdeadline)
+{
+	if (h->hscan_thread != NULL)
+	{
+		InterlockedExchange(&h->scan_quit, 1);
+		SetEvent(h->hscan_event);
+
+		if (unload)
+		{
+			LONG const remaining = (LONG)(tdeadline - GetTickCount());
+
+			if (WaitForSingleObject(h->hscan_done, remaining > 0 ? (DWORD)remaining : 0) != WAIT_OBJECT_0)
+			{
+				CloseHandle(h->hscan_thread);
+				h->hscan_thread = NULL;
+				h->hscan_event = NULL;
+				h->hscan_done = NULL;
+				return false;
+			}
+		}
+		else
+		{
+			WaitForSingleObject(h->hscan_thread, INFINITE);
+		}
+
+		CloseHandle(h->hscan_thread);
+		h->hscan_thread = NULL;
+	}
+
+	if (h->hscan_event != NULL)
+	{
+		CloseHandle(h->hscan_event);
+		h->hscan_event = NULL;
+	}
+
+	if (h->hscan_done != NULL)
+	{
+		CloseHandle(h->hscan_done);
+		h->hscan_done = NULL;
+	}
+
+	// the window thread won't pick this up any more
+	lwz_scan_free((lwz_scan_t *)InterlockedExchangePointer(
+		(PVOID volatile *)&h->pscan_result, NULL));
+
+	return true;
+}
+
+#endif
+
+#else
+
+// There are no window messages to hook here, so the window handle is just
+// a token: registering (any non-null value) starts a hot plug monitor that
+// refreshes the device list and invokes the notification callbacks.
+static void lwz_register(lwz_context_t *h, int indx, HWND hwnd)
+{
+	if (hwnd != NULL)
+	{
+		if (h->hwnd != NULL && h->hwnd != hwnd)
+			return;
+
+		if (indx < 0 ||	indx >= LWZ_MAX_DEVICES)
+			return;
+
+		if (h->devices[indx].hudev == NULL)
+			return;
+
+		h->hwnd = hwnd;
+
+		if (h->hmonitor == NULL)
+		{
+			h->monitor_stopping = false;
+			h->hmonitor = usbdev_hotplug_start(lwz_hotplug, h);
+		}
+	}
+	else
+	{
+		if (h->hmonitor != NULL)
+		{
+			h->monitor_stopping = true;
+			usbdev_hotplug_stop(h->hmonitor);
+			h->hmonitor = NULL;
+		}
+
+		h->hwnd = NULL;
+	}
+}
+
+#endif
+
 static HUDEV lwz_get_hdev(lwz_context_t *h, int indx)
 {
 	if (indx < 0 ||
@@ -820,6 +1546,161 @@ static HUDEV lwz_get_hdev(lwz_context_t *h, int indx)
 	return h->devices[indx].hudev;
 }
 
+static HQUEUE lwz_get_queue(lwz_context_t *h, int indx)
+{
+	#if defined(USE_SEPARATE_IO_THREAD)
+
+	if (indx < 0 ||
+	    indx >= LWZ_MAX_DEVICES)
+	{
+		return NULL;
+	}
+
+	return h->devices[indx].hqueue;
+
+	#else
+
+	return NULL;
+
+	#endif
+}
+
+// Get the current snapshot for an output call, and keep it from being
+// reused until lwz_table_leave().  Nothing here ever waits: if the
+// snapshot was replaced before the reader could count itself in, it
+// takes the new one.  A reader that counted itself in on the old one
+// too late doesn't use it, so lwz_table_publish() only has to wait for
+// the readers that were already in.
+static lwz_table_t * lwz_table_enter(lwz_context_t *h)
+{
+	for (;;)
+	{
+		lwz_table_t * const pt = h->ptable;
+
+		InterlockedIncrement(&pt->readers);
+
+		if (pt == h->ptable)
+			return pt;
+
+		InterlockedDecrement(&pt->readers);
+	}
+}
+
+static void lwz_table_leave(lwz_table_t *pt)
+{
+	InterlockedDecrement(&pt->readers);
+}
+
+// Build a new snapshot from devices[] and make it the current one.  Must
+// be called with g_cs held after devices[] changed, and before a device
+// that is no longer in it gets closed.  Must not be called by a reader.
+static void lwz_table_publish(lwz_context_t *h)
+{
+	lwz_table_t * const pold = h->ptable;
+	lwz_table_t * const pnew = pold == &h->tables[0] ? &h->tables[1] : &h->tables[0];
+
+	// nobody uses the spare one, see the end of this routine
+	memset(pnew->routes, 0x00, sizeof(pnew->routes));
+
+	for (int indx = 0 ; indx < LWZ_MAX_DEVICES ; ++indx)
+	{
+		lwz_device_t const * const dev = &h->devices[indx];
+		int base = indx;
+
+		if (dev->device_type == LWZ_DEVICE_TYPE_NONE)
+			continue;
+
+		if (dev->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+			base = dev->ps_virtual_lwz.base_unit;
+
+		lwz_device_t const * const pdev = &h->devices[base];
+
+		if (pdev->hudev == NULL || pdev->pstate == NULL || pdev->device_type == LWZ_DEVICE_TYPE_NONE)
+			continue;
+
+		lwz_route_t * const pr = &pnew->routes[indx];
+		pr->pstate = pdev->pstate;
+		pr->hudev = pdev->hudev;
+		#if defined(USE_SEPARATE_IO_THREAD)
+		pr->hqueue = pdev->hqueue;
+		#endif
+		pr->indx = base;
+		pr->port_group = indx - base;
+		pr->num_outputs = pdev->num_outputs < LWZ_MAX_PORT_GROUPS * 32 ? pdev->num_outputs : LWZ_MAX_PORT_GROUPS * 32;
+	}
+
+	// the routes have to be visible before the pointer
+	MemoryBarrier();
+	InterlockedExchangePointer((PVOID volatile *)&h->ptable, pnew);
+
+	// Wait for the calls that still use the old snapshot.  They are quick,
+	// unless the queue of a device is full and they have to wait for room.
+	for (int n = 0 ; pold->readers != 0 ; ++n)
+		Sleep(n < 16 ? 0 : 1);
+}
+
+// Have the I/O thread of a device wind down, without waiting for it: what
+// is still queued is dropped, and the last state the client has set is
+// written once more (or all outputs are switched off).  Stopping all
+// devices first lets them do that in parallel.
+static void lwz_stop_output(lwz_device_t *dev, bool all_off)
+{
+	if (dev->pstate == NULL)
+		return;
+
+	if (all_off)
+		lwz_state_all_off(dev->pstate);
+
+	#if defined(USE_SEPARATE_IO_THREAD)
+
+	queue_stop(dev->hqueue, dev->hudev, true);
+
+	#else
+
+	if (all_off)
+	{
+		AUTOLOCK(dev->pstate->cswrite);
+		lwz_state_write(dev->pstate, dev->hudev);
+	}
+
+	#endif
+}
+
+// Close the write queue of a device, stop its I/O thread and free the
+// output state; also stop the input reader.  A queue that isn't stopped yet
+// is dropped without the final write.  Waits for the I/O thread up to the
+// deadline (a GetTickCount() value); if it is still stuck in a write then,
+// it is left to clean up after itself, and the result is false.
+static bool lwz_close_output(lwz_device_t *dev, bool unload, DWORD tdeadline)
+{
+	bool done = true;
+
+	if (dev->pinput != NULL)
+	{
+		lwz_input_close(dev->pinput, unload);
+		dev->pinput = NULL;
+	}
+
+	#if defined(USE_SEPARATE_IO_THREAD)
+
+	if (dev->hqueue != NULL)
+	{
+		queue_stop(dev->hqueue, dev->hudev, false);
+		done = queue_close(dev->hqueue, unload, tdeadline);
+		dev->hqueue = NULL;
+	}
+
+	#endif
+
+	// otherwise the I/O thread frees it
+	if (done)
+		lwz_state_close(dev->pstate);
+
+	dev->pstate = NULL;
+
+	return done;
+}
+
 static void lwz_notify_callback(lwz_context_t *h, int reason, LWZHANDLE hlwz)
 {
 	if (h->cb.notify != 0)
@@ -928,6 +1809,10 @@ static void lwz_remove(lwz_context_t *h, int indx)
 
 static void lwz_refreshlist_detached(lwz_context_t *h)
 {
+	// units to remove, in the order the user callback hears about them
+	int removed[LWZ_MAX_DEVICES];
+	int nremoved = 0;
+
 	// check for removed devices
 	// i.e. try to re-open all registered devices in our internal list
 
@@ -935,19 +1820,9 @@ static void lwz_refreshlist_detached(lwz_context_t *h)
 	{
 		if (h->devices[i].hudev != NULL)
 		{
-			// try opening the device handle again
-			SP_DEVICE_INTERFACE_DETAIL_DATA_A * pdiddat = (SP_DEVICE_INTERFACE_DETAIL_DATA_A *)&h->devices[i].dat[0];
-			HANDLE hdev = CreateFileA(
-				pdiddat->DevicePath,
-				GENERIC_READ | GENERIC_WRITE,
-				FILE_SHARE_READ | FILE_SHARE_WRITE,
-				NULL,
-				OPEN_EXISTING,
-				0,
-				NULL);
-
-			// if we couldn't open the handle, the device must have been unplugged
-			if (hdev == INVALID_HANDLE_VALUE)
+			// try opening the device handle again; if we couldn't open
+			// the handle, the device must have been unplugged
+			if (!usbdev_exists(h->devices[i].device_path))
 			{
 				// get the device descriptor entry
 				lwz_device_t *dev = &h->devices[i];
@@ -975,358 +1850,522 @@ static void lwz_refreshlist_detached(lwz_context_t *h)
 						{
 							// it's one of ours - remove this interface too
 							vdev->device_type = LWZ_DEVICE_TYPE_NONE;
-							lwz_remove(h, vidx);
+							removed[nremoved++] = vidx;
 						}
 					}
 				}
 
-				// close our existing USB file handle
-				usbdev_release(dev->hudev);
-				dev->hudev = NULL;
 				dev->device_type = LWZ_DEVICE_TYPE_NONE;
-
-				// remove the device from the user list and notify the user callback
-				lwz_remove(h, i);
-			}
-			else
-			{
-				// Success - we have a valid new handle to the file.  We only
-				// needed the new handle to see if we could create it, though,
-				// so we have no more use for it; close it.
-				CloseHandle(hdev);
+				removed[nremoved++] = i;
 			}
 		}
 	}
+
+	if (nremoved == 0)
+		return;
+
+	// take them out of the output calls' snapshot; once that's done
+	// nobody else uses them any more
+	lwz_table_publish(h);
+
+	for (int k = 0; k < nremoved; k++)
+	{
+		lwz_device_t *dev = &h->devices[removed[k]];
+
+		// close our existing USB file handle (virtual units have none),
+		// and identify the device again if it comes back
+		if (dev->hudev != NULL)
+		{
+			usbdev_cache_forget(h->hcache, dev->device_path);
+			lwz_ident_forget(&h->idcache, dev->device_path);
+
+			lwz_close_output(dev, false, GetTickCount() + h->shutdown_timeout_ms);
+			usbdev_release(dev->hudev);
+			dev->hudev = NULL;
+		}
+
+		// remove the device from the user list and notify the user callback
+		lwz_remove(h, removed[k]);
+	}
 }
 
-static void lwz_refreshlist_attached(lwz_context_t *h)
+// The devices found by one enumeration, by unit slot.  The scan identifies
+// them (or looks them up in the cache) without touching the device list,
+// so it doesn't need g_cs and can run on any thread; lwz_scan_commit()
+// opens and adds them afterwards.
+struct lwz_scan_s {
+	lwz_idcache_t *pidcache;
+	volatile LONG const *pquit;  // set when the scan is to be abandoned, may be NULL
+	unsigned int serial;
+	int num_found;
+	int order[LWZ_MAX_DEVICES];  // slots in the order the devices were found
+	lwz_ident_t found[LWZ_MAX_DEVICES];  // empty path if none
+};
+
+// usbdev_enumerate() callback: check one HID interface, and keep it for
+// the device list if it's an LedWiz or one of the clones/emulators
+static void lwz_probe_device(void *puser, usbdev_info_t const *pinfo)
 {
-	LOG("Refreshing attached device list\n");
+	lwz_scan_t * const pscan = (lwz_scan_t *)puser;
 
-	// no new devices found yet
-	int num_new_devices = 0;
-	int new_devices[LWZ_MAX_DEVICES];
+	// the rest of the interfaces are skipped, see lwz_scan_stop()
+	if (pscan->pquit != NULL && *pscan->pquit != 0)
+		return;
 
-	// set up a search on all HID devices
-	HDEVINFO hDevInfo = SetupDiGetClassDevsA(
-		&HIDguid, 
-		NULL, 
-		NULL, 
-		DIGCF_PRESENT | DIGCF_INTERFACEDEVICE);
+	LOG(". Found USB HID device, VID %04X, PID %04X\n", pinfo->vendor_id, pinfo->product_id);
+
+	// Check to see if this looks like an LedWiz VID/PID combo.  LedWiz devices
+	// identify as Vendor ID FAFA, Product ID 00F0..00FF.  The low 4 bits of the
+	// product ID is by convention the LedWiz "unit number".  The API uses this
+	// to distinguish multiple units in one system and direct commands to the
+	// desired unit.  The nominal unit number is in the range 1..16, so it's
+	// equivalent to (ProductID & 0x000F) + 1.
+	int indx = (int)pinfo->product_id - (int)ProductID_LEDWiz_min;
+	if (!((pinfo->vendor_id == VendorID_LEDWiz || pinfo->vendor_id == VendorID_Zebs) &&
+	      indx >= 0 && indx < LWZ_MAX_DEVICES))
+	{
+		return;
+	}
 
-	// we can't proceed unless we got the HID list
-	if (hDevInfo == INVALID_HANDLE_VALUE)
+	// It's an LedWiz, according to the VID/PID
+	LOG(".. vendor/product code matches LedWiz, checking HID descriptors\n", indx+1);
+
+	LOG(".. HID capabilities: output report length %d\n", pinfo->output_report_len);
+
+	// Before we conclude for sure that it's an LedWiz, though, do some more
+	// checks.  Apply heuristic filters:
+	//
+	// 1. Output report byte length
+	// The LedWiz command interface has an eight byte output report.
+	// Note that the Windows HID drivers always include a one-byte
+	// "report ID" prefix in reports read or written through the
+	// driver.  The LedWiz itself doesn't transmit the prefix byte
+	// because (per USB HID conventions) it's never included by
+	// devices that have only one report type, as is the case for
+	// an LedWiz.  The transport normalizes the lengths to the
+	// payload size without that prefix, so we're looking for 8.
+	//
+	// 2. USB Usage
+	// Test that this is NOT a keyboard interface (USB usage page 
+	// 1, usage 6).  The Pinscape controller presents a keyboard
+	// interface in addition its joystick interface, which looks
+	// to the HID scan like a completely separate device.  We want
+	// to skip that virtual device since it doesn't accept LedWiz 
+	// output reports.  (Note that it would filter out more false
+	// positivies if we "ruled in" specific HID usages rather than
+	// only "ruling out" the keyboard, but that would also be less
+	// flexible at recognizing future product updates from GGG and
+	// future clones and emulators.  In practice, false positives
+	// from random third-party devices don't actually seem to
+	// happen, so on balance it seems much better to err on the
+	// side of filtering in unknown devices that pass our other
+	// tests.)
+	//
+	// 3. Link collection count (REMOVED)
+	// In the past, we also checked the link collection count to
+	// make sure caps.NumberLinkCollectionNodes == 1.  This was a
+	// further ad hoc check that the original LedWiz device and
+	// LWCloneU2 devices both passed, and which the Pinscape device
+	// deliberately passed because it was known that LWCloneU2 did
+	// this test.  However, this test is now too restrictive in 
+	// that a newer real LedWiz product, the LedWiz+GP, fails the
+	// test.  So I'm removing the link collection node test.  That
+	// test was purely speculative anyway: as far as I know, there
+	// are no actual false positives that it filtered out, so it
+	// was just there *in case* something came along that spoofed
+	// an LedWiz as far as all of the other tests go.
+	if (!(pinfo->output_report_len == 8
+		&& !(pinfo->usage_page == 1 && pinfo->usage == 6))) // USB keyboard = page 1/usage 6
+	{
 		return;
+	}
 
-	// go through all available devices and look for the proper VID/PID
-	for (DWORD dwindex = 0 ; ; dwindex++)
-	{
-		// get the next interface in the HID list
-		SP_DEVICE_INTERFACE_DATA didat = {};
-		didat.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
-		BOOL bres = SetupDiEnumDeviceInterfaces(
-			hDevInfo,
-			NULL,
-			&HIDguid,
-			dwindex,
-			&didat);
-
-		// if that failed, we've reached the end of the list
-		if (bres == FALSE)
-			break;
+	LOG(".. report length and USB usage match LedWiz\n");
 
-		// retrieve the device detail
-		lwz_device_t device_tmp = { };
-		SP_DEVICE_INTERFACE_DETAIL_DATA_A * pdiddat = (SP_DEVICE_INTERFACE_DETAIL_DATA_A *)&device_tmp.dat[0];
-		pdiddat->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
-		bres = SetupDiGetDeviceInterfaceDetailA(
-			hDevInfo,
-			&didat,
-			pdiddat,
-			sizeof(device_tmp.dat),
-			NULL,
-			NULL);
-
-		// if we couldn't get the device detail, proceed to the next device
-		if (bres == FALSE)
-			continue;
-		
+	lwz_ident_t ident;
+
+	if (lwz_ident_lookup(pscan->pidcache, pscan->serial, pinfo, &ident))
+	{
+		LOG(".. known from an earlier scan\n");
+	}
+	else
+	{
 		// open the file handle to the USB device
-		device_tmp.hudev = usbdev_create(pdiddat->DevicePath);
-		if (device_tmp.hudev != NULL)
+		HUDEV const hudev = usbdev_create(pinfo->path);
+		if (hudev == NULL)
+			return;
+
+		bool const conclusive = lwz_identify(hudev, pinfo, &ident);
+		usbdev_release(hudev);
+
+		if (conclusive)
+			lwz_ident_store(pscan->pidcache, pscan->serial, &ident);
+	}
+
+	// if we decided to keep this device, take it along, the first one
+	// found for a slot wins
+	if (ident.device_type != LWZ_DEVICE_TYPE_NONE)
+	{
+		if (pscan->found[indx].device_path[0] == '\0')
+		{
+			pscan->found[indx] = ident;
+			pscan->order[pscan->num_found++] = indx;
+		}
+		else
 		{
-			// retrieve the HID attributes
-			HIDD_ATTRIBUTES attrib = {};
-			attrib.Size = sizeof(HIDD_ATTRIBUTES);
-			BOOLEAN bSuccess = HidD_GetAttributes(
-				usbdev_handle(device_tmp.hudev),
-				&attrib);
+			LOG(".. unit slot already taken by another device on this scan\n");
+		}
+	}
+}
 
-			LOG(". Found USB HID device, VID %04X, PID %04X\n", attrib.VendorID, attrib.ProductID);
-			
-			// Check to see if this looks like an LedWiz VID/PID combo.  LedWiz devices
-			// identify as Vendor ID FAFA, Product ID 00F0..00FF.  The low 4 bits of the
-			// product ID is by convention the LedWiz "unit number".  The API uses this
-			// to distinguish multiple units in one system and direct commands to the
-			// desired unit.  The nominal unit number is in the range 1..16, so it's
-			// equivalent to (ProductID & 0x000F) + 1.
-			int indx = (int)attrib.ProductID - (int)ProductID_LEDWiz_min;
-			if (bSuccess && 
-			    (attrib.VendorID == VendorID_LEDWiz || attrib.VendorID == VendorID_Zebs) &&
-			    indx >= 0 && indx < LWZ_MAX_DEVICES)
-			{
-				// It's an LedWiz, according to the VID/PID
-				LOG(".. vendor/product code matches LedWiz, checking HID descriptors\n", indx+1);
+// Find out what kind of LedWiz device this is.  Pinscape units are asked
+// for their configuration; returns false if one didn't answer, so that it
+// is asked again on the next scan.
+static bool lwz_identify(HUDEV hudev, usbdev_info_t const *pinfo, lwz_ident_t *pident)
+{
+	bool answered = true;
 
-				// Before we conclude for sure that it's an LedWiz, though, do some more
-				// checks.  Retrieve the preparsed data for the device.
-				PHIDP_PREPARSED_DATA p_prepdata = NULL;
-				if (HidD_GetPreparsedData(usbdev_handle(device_tmp.hudev), &p_prepdata) == TRUE)
-				{
-					LOG(".. retrieved preparsed data OK\n");
+	memset(pident, 0x00, sizeof(*pident));
+	safe_strcpy(pident->device_path, sizeof(pident->device_path), pinfo->path);
+	safe_strcpy(pident->container_id, sizeof(pident->container_id), pinfo->container_id);
 
-					// get the HID capabilities struct
-					HIDP_CAPS caps = {};
-					if (HIDP_STATUS_SUCCESS == HidP_GetCaps(p_prepdata, &caps))
-					{
-						LOG(".. retrieved HID capabilities: "
-							" link collection nodes %d, output report length %d\n",
-							caps.NumberLinkCollectionNodes, caps.OutputReportByteLength);
-						
-						// Apply heuristic filters:
-						//
-						// 1. Output report byte length
-						// The LedWiz command interface has an eight byte output report.
-						// Note that the Windows HID drivers always include a one-byte
-						// "report ID" prefix in reports read or written through the
-						// driver.  The LedWiz itself doesn't transmit the prefix byte
-						// because (per USB HID conventions) it's never included by
-						// devices that have only one report type, as is the case for
-						// an LedWiz.  However, the Windows HID drivers normalize this
-						// by including the prefix byte to user programs whether it's
-						// in the physical reports or not.  For consistency, Windows
-						// HID also normalizes the report length seen in the HID caps,
-						// so the byte length we're looking for is 9.
-						//
-						// 2. USB Usage
-						// Test that this is NOT a keyboard interface (USB usage page 
-						// 1, usage 6).  The Pinscape controller presents a keyboard
-						// interface in addition its joystick interface, which looks
-						// to the HID scan like a completely separate device.  We want
-						// to skip that virtual device since it doesn't accept LedWiz 
-						// output reports.  (Note that it would filter out more false
-						// positivies if we "ruled in" specific HID usages rather than
-						// only "ruling out" the keyboard, but that would also be less
-						// flexible at recognizing future product updates from GGG and
-						// future clones and emulators.  In practice, false positives
-						// from random third-party devices don't actually seem to
-						// happen, so on balance it seems much better to err on the
-						// side of filtering in unknown devices that pass our other
-						// tests.)
-						//
-						// 3. Link collection count (REMOVED)
-						// In the past, we also checked the link collection count to
-						// make sure caps.NumberLinkCollectionNodes == 1.  This was a
-						// further ad hoc check that the original LedWiz device and
-						// LWCloneU2 devices both passed, and which the Pinscape device
-						// deliberately passed because it was known that LWCloneU2 did
-						// this test.  However, this test is now too restrictive in 
-						// that a newer real LedWiz product, the LedWiz+GP, fails the
-						// test.  So I'm removing the link collection node test.  That
-						// test was purely speculative anyway: as far as I know, there
-						// are no actual false positives that it filtered out, so it
-						// was just there *in case* something came along that spoofed
-						// an LedWiz as far as all of the other tests go.
-						if (caps.OutputReportByteLength == 9
-							&& !(caps.UsagePage == 1 && caps.Usage == 6)) // USB keyboard = page 1/usage 6
-						{
-							LOG(".. link collection node count, report length, and USB usage match LedWiz\n");
-
-							// presume it's a real LedWiz or some clone/emulation we don't
-							// handle specially
-							device_tmp.device_type = LWZ_DEVICE_TYPE_LEDWIZ;
-
-							// Remember the input report (device to host) length.  Note that
-							// the length in the caps is normalized to include the synthesized
-							// report ID, so subtract one to get the actual device report size.
-							device_tmp.input_rpt_len = caps.InputReportByteLength - 1;
-
-							// presume it has the standard LedWiz complement of 32 ports
-							device_tmp.num_outputs = 32;
-							device_tmp.supports_sbx_pbx = false;
-
-							// If it's using the zebsboard VID, make sure the manufacturer ID looks right
-							if (attrib.VendorID == VendorID_Zebs)
-							{
-								// get the manufacturer ID string, in lower-case, for further testing
-								wchar_t manustr[256] = { 0 };
-								HidD_GetManufacturerString(usbdev_handle(device_tmp.hudev), manustr, 256);
-								_wcslwr_s(manustr);
-
-								if (wcsstr(manustr, L"zebsboards") != NULL)
-								{
-									// mark it as a zeb's output control device
-									LOG(".. ZB Output Control detected\n");
-									device_tmp.device_type = LWZ_DEVICE_TYPE_ZB;
-
-									// this device doesn't need USB delays
-									usbdev_set_min_write_interval(device_tmp.hudev, 0);
-								}
-								else
-								{
-									// it's not a Zebsboards unit, so it must not be an LedWiz
-									// emulator after all
-									LOG(".. Device uses VID 0x20A0, but manufacturer string doesn't contain 'zebsboards' - rejecting\n");
-									device_tmp.device_type = LWZ_DEVICE_TYPE_NONE;
-								}
-							}
-
-							// get the product ID string, so that we can further identify
-							// whether the device is a real LedWiz or one of the specific
-							// types of clones we know about
-							wchar_t prodstr[256];
-							device_tmp.device_name[0] = '\0';
-							if (HidD_GetProductString(usbdev_handle(device_tmp.hudev), prodstr, 256))
-							{
-								// save the product string
-								size_t retlen;
-								wcstombs_s(
-									&retlen,
-									device_tmp.device_name,
-									sizeof(device_tmp.device_name),
-									prodstr,
-									_TRUNCATE);
-								
-								// check for the special device types
-								if (wcsstr(prodstr, L"Pinscape Controller") != 0)
-								{
-									// It's a Pinscape unit
-									LOG(".. Pinscape Controller identified\n");
-									device_tmp.device_type = LWZ_DEVICE_TYPE_PINSCAPE;
-
-									// Pinscape doesn't need USB delays
-									usbdev_set_min_write_interval(device_tmp.hudev, 0);
-									
-									// Query the number of outputs by sending a QUERY CONFIGURATION
-									// special request (65 4).  Clear the input buffer before making
-									// the request, since the input buffer could be full of regular
-									// joystick reports.  We could time out before getting to the
-									// config report reply if we don't clear out old joystick
-									// reports first.
-									char qbuf[8] = { 65, 4, 0, 0, 0, 0, 0, 0 };
-									usbdev_clear_input(device_tmp.hudev, caps.InputReportByteLength);
-									usbdev_write(device_tmp.hudev, qbuf, 8);
-
-									// wait for the proper reply; retry a few times if necessary
-									BYTE rbuf[65];
-									for (int i = 0 ; i < 64 ; ++i)
-									{
-										// Read a report, and check for a CONFIGURATION REPORT
-										// reply (00 88 ...).  We're interested in the number of
-										// outputs at bytes 2:3, and the bit flags at byte 11.
-										if (usbdev_read(device_tmp.hudev, rbuf, device_tmp.input_rpt_len) > 0
-											&& (rbuf[0] == 0x00 && rbuf[1] == 0x88))
-										{
-											// It's the configuration report.
-											//
-											// If byte 11 has bit 0x02 set, the installed firmware
-											// supports the SBX/PBX protocol extensions that we need
-											// to access ports beyond the first 32.
-											if ((rbuf[11] & 0x02) != 0)
-											{
-												// SBX/PBX are supported, so we can access all
-												// output ports.  Note that actual number of ports.
-												device_tmp.supports_sbx_pbx = true;
-												device_tmp.num_outputs = rbuf[2] | (rbuf[3] << 8);
-											}
-
-											// add the pinscape unit number to the name
-											char unitno[20];
-											_snprintf_s(
-												unitno, sizeof(unitno), _TRUNCATE,
-												" (Unit %d)", int(rbuf[4] + 1));
-											safe_strcat(
-												device_tmp.device_name,
-												sizeof(device_tmp.device_name),
-												unitno);
-											
-											// we can stop looking for a report now
-											break;
-										}
-									}
-								}
-								else if (wcslen(prodstr) >= 9
-										 && memcmp(prodstr, L"LWCloneU2", 9*sizeof(wchar_t)) == 0)
-								{
-									// It's an LWCloneU2 unit
-									LOG(".. LWCloneU2 identified\n");
-									device_tmp.device_type = LWZ_DEVICE_TYPE_LWCLONEU2;
-
-									// LWCloneU2 doesn't need USB delays
-									usbdev_set_min_write_interval(device_tmp.hudev, 0);
-								}
-							}
-
-							// if we decided to keep this device, add it
-							if (device_tmp.device_type != LWZ_DEVICE_TYPE_NONE)
-							{
-								LOG(".. attempting to add device\n");
-
-								// If this slot contains a Pinscape virtual LedWiz interface,
-								// remove the virtual device so that we can use the slot for
-								// the real device.  Real devices always override virtual ones.
-								if (h->devices[indx].device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
-								{
-									// remove the virtual interface and notify the user callback
-									LOG(".. this slot has a Pinscape virtual LedWiz; this real device overrides that\n");
-									h->devices[indx].device_type = LWZ_DEVICE_TYPE_NONE;
-									lwz_remove(h, indx);
-								}
-
-								// if this slot isn't populated yet, add the device
-								if (h->devices[indx].hudev == NULL)
-								{
-									// copy the temp device struct to the active device list entry
-									memcpy(&h->devices[indx], &device_tmp, sizeof(device_tmp));
-
-									// the device list entry now owns the file handle, so forget it
-									// in the temp struct
-									device_tmp.hudev = NULL;
-
-									LOG(".. device added successfully, %d devices total\n", num_new_devices);
-
-									// add it to our list of new devices found on this search
-									if (num_new_devices < LWZ_MAX_DEVICES)
-										new_devices[num_new_devices++] = indx;
-
-								}
-								else
-								{
-									LOG(".. unit slot already in use; device not added\n");
-								}
-							}
-						}
-					}
+	// presume it's a real LedWiz or some clone/emulation we don't
+	// handle specially
+	pident->device_type = LWZ_DEVICE_TYPE_LEDWIZ;
 
-					HidD_FreePreparsedData(p_prepdata);
-				}
-			}
+	// Remember the input report (device to host) length
+	pident->input_rpt_len = pinfo->input_report_len;
+
+	// presume it has the standard LedWiz complement of 32 ports
+	pident->num_outputs = 32;
+	pident->supports_sbx_pbx = false;
+
+	// and the pacing of one
+	pident->interval_min_us = LEDWIZ_WRITE_INTERVAL_US;
+	pident->interval_max_us = LEDWIZ_WRITE_INTERVAL_US;
+
+	// If it's using the zebsboard VID, make sure the manufacturer ID looks right
+	if (pinfo->vendor_id == VendorID_Zebs)
+	{
+		// get the manufacturer ID string, in lower-case, for further testing
+		char manustr[USBDEV_MAX_STRING];
+		safe_strcpy(manustr, sizeof(manustr), pinfo->manufacturer);
+		for (char *p = manustr ; *p != '\0' ; ++p)
+			*p = (char)tolower((unsigned char)*p);
+
+		if (strstr(manustr, "zebsboards") != NULL)
+		{
+			// mark it as a zeb's output control device
+			LOG(".. ZB Output Control detected\n");
+			pident->device_type = LWZ_DEVICE_TYPE_ZB;
+
+			// this device doesn't need USB delays
+			pident->interval_min_us = 0;
+			pident->interval_max_us = 0;
+		}
+		else
+		{
+			// it's not a Zebsboards unit, so it must not be an LedWiz
+			// emulator after all
+			LOG(".. Device uses VID 0x20A0, but manufacturer string doesn't contain 'zebsboards' - rejecting\n");
+			pident->device_type = LWZ_DEVICE_TYPE_NONE;
+		}
+	}
 
-			// If the temp struct has a valid file handle, close it.  Note that if
-			// we decided the entry was a valid device, the temp struct won't have
-			// a file handle because the active device list entry took ownership
-			// of it, and nulled the reference here.
-			if (device_tmp.hudev != NULL)
+	// use the product ID string to further identify whether the device
+	// is a real LedWiz or one of the specific types of clones we know about
+	char const * const prodstr = pinfo->product;
+	safe_strcpy(pident->device_name, sizeof(pident->device_name), prodstr);
+
+	// check for the special device types
+	if (strstr(prodstr, "Pinscape Controller") != 0)
+	{
+		// It's a Pinscape unit
+		LOG(".. Pinscape Controller identified\n");
+		pident->device_type = LWZ_DEVICE_TYPE_PINSCAPE;
+
+		// Pinscape doesn't need USB delays, not for the query either
+		pident->interval_min_us = 0;
+		pident->interval_max_us = 0;
+		usbdev_set_min_write_interval(hudev, 0);
+
+		// Query the number of outputs by sending a QUERY CONFIGURATION
+		// special request (65 4).  Clear the input buffer before making
+		// the request, since the input buffer could be full of regular
+		// joystick reports.  We could time out before getting to the
+		// config report reply if we don't clear out old joystick
+		// reports first.
+		char qbuf[8] = { 65, 4, 0, 0, 0, 0, 0, 0 };
+		usbdev_clear_input(hudev, pident->input_rpt_len + 1);
+		usbdev_write(hudev, qbuf, 8);
+
+		// wait for the proper reply; retry a few times if necessary
+		answered = false;
+		BYTE rbuf[65];
+		for (int i = 0 ; i < 64 ; ++i)
+		{
+			// Read a report, and check for a CONFIGURATION REPORT
+			// reply (00 88 ...).  We're interested in the number of
+			// outputs at bytes 2:3, and the bit flags at byte 11.
+			if (usbdev_read(hudev, rbuf, pident->input_rpt_len) > 0
+				&& (rbuf[0] == 0x00 && rbuf[1] == 0x88))
 			{
-				usbdev_release(device_tmp.hudev);
-				device_tmp.hudev = NULL;
+				// It's the configuration report.
+				//
+				// If byte 11 has bit 0x02 set, the installed firmware
+				// supports the SBX/PBX protocol extensions that we need
+				// to access ports beyond the first 32.
+				if ((rbuf[11] & 0x02) != 0)
+				{
+					// SBX/PBX are supported, so we can access all
+					// output ports.  Note that actual number of ports.
+					pident->supports_sbx_pbx = true;
+					pident->num_outputs = rbuf[2] | (rbuf[3] << 8);
+				}
+
+				// add the pinscape unit number to the name
+				char unitno[20];
+				_snprintf_s(
+					unitno, sizeof(unitno), _TRUNCATE,
+					" (Unit %d)", int(rbuf[4] + 1));
+				safe_strcat(
+					pident->device_name,
+					sizeof(pident->device_name),
+					unitno);
+				
+				// we can stop looking for a report now
+				answered = true;
+				break;
 			}
 		}
 	}
+	else if (strncmp(prodstr, "LWCloneU2", 9) == 0)
+	{
+		// It's an LWCloneU2 unit
+		LOG(".. LWCloneU2 identified\n");
+		pident->device_type = LWZ_DEVICE_TYPE_LWCLONEU2;
+
+		// LWCloneU2 doesn't need USB delays
+		pident->interval_min_us = 0;
+		pident->interval_max_us = 0;
+	}
+	else if (pident->device_type == LWZ_DEVICE_TYPE_LEDWIZ)
+	{
+		// A real LedWiz or an emulator we don't know.  The real one
+		// corrupts reports that come too fast and there is no way to
+		// see that from here, so only a device that doesn't call
+		// itself an LedWiz is allowed to learn a shorter interval.
+		char prodlower[USBDEV_MAX_STRING];
+		safe_strcpy(prodlower, sizeof(prodlower), prodstr);
+		for (char *p = prodlower ; *p != '\0' ; ++p)
+			*p = (char)tolower((unsigned char)*p);
+
+		bool const genuine = prodlower[0] == '\0' ||
+			strstr(prodlower, "led-wiz") != NULL ||
+			strstr(prodlower, "ledwiz") != NULL;
+
+		LOG(genuine ? ".. LedWiz identified\n" : ".. unknown LedWiz emulator, adaptive write pacing\n");
+
+		pident->interval_min_us = genuine ? LEDWIZ_WRITE_INTERVAL_US : CLONE_MIN_WRITE_INTERVAL_US;
+		pident->interval_max_us = MAX_WRITE_INTERVAL_US;
+	}
+
+	return answered;
+}
+
+// go through all available HID devices and look for the proper VID/PID;
+// once '*pquit' is set, the interfaces that are left aren't opened
+static lwz_scan_t * lwz_scan_devices(lwz_context_t *h, volatile LONG const *pquit)
+{
+	LOG("Scanning for attached devices\n");
+
+	lwz_scan_t * const pscan = (lwz_scan_t *)malloc(sizeof(lwz_scan_t));
+	if (pscan == NULL)
+		return NULL;
+
+	memset(pscan, 0x00, sizeof(*pscan));
+	pscan->pidcache = &h->idcache;
+	pscan->pquit = pquit;
+
+	{
+		AUTOLOCK(h->idcache.cs);
+		pscan->serial = ++h->idcache.serial;
+	}
+
+	usbdev_enumerate(h->hcache, lwz_probe_device, pscan);
+
+	// an abandoned scan didn't look at all of them
+	if (pquit != NULL && *pquit != 0)
+		return pscan;
+
+	// forget the devices that weren't seen, they have been unplugged
+	{
+		AUTOLOCK(h->idcache.cs);
+
+		lwz_idcache_t * const pc = &h->idcache;
+
+		for (int i = pc->count - 1; i >= 0; i--)
+		{
+			if ((int)(pscan->serial - pc->entries[i].seen) > 0)
+				pc->entries[i] = pc->entries[--pc->count];
+		}
+	}
+
+	return pscan;
+}
+
+static void lwz_scan_free(lwz_scan_t *pscan)
+{
+	free(pscan);
+}
+
+static bool lwz_ident_lookup(lwz_idcache_t *pc, unsigned int serial, usbdev_info_t const *pinfo, lwz_ident_t *pident)
+{
+	AUTOLOCK(pc->cs);
+
+	for (int i = 0; i < pc->count; i++)
+	{
+		lwz_ident_t * const pentry = &pc->entries[i];
+
+		if (strcmp(pentry->device_path, pinfo->path) == 0 &&
+			strcmp(pentry->container_id, pinfo->container_id) == 0)
+		{
+			if ((int)(serial - pentry->seen) > 0)
+				pentry->seen = serial;
+
+			*pident = *pentry;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void lwz_ident_store(lwz_idcache_t *pc, unsigned int serial, lwz_ident_t const *pident)
+{
+	AUTOLOCK(pc->cs);
+
+	// replace what we knew about the path; if the cache is full, make
+	// room by dropping the entry that was seen longest ago
+	int slot = -1;
+
+	for (int i = 0; i < pc->count; i++)
+	{
+		if (strcmp(pc->entries[i].device_path, pident->device_path) == 0)
+			slot = i;
+	}
+
+	if (slot < 0 && pc->count < LWZ_IDENT_CACHE)
+		slot = pc->count++;
+
+	if (slot < 0)
+	{
+		slot = 0;
+		for (int i = 1; i < pc->count; i++)
+		{
+			if ((int)(pc->entries[slot].seen - pc->entries[i].seen) > 0)
+				slot = i;
+		}
+	}
+
+	pc->entries[slot] = *pident;
+	pc->entries[slot].seen = serial;
+}
+
+static void lwz_ident_forget(lwz_idcache_t *pc, char const *devicepath)
+{
+	AUTOLOCK(pc->cs);
+
+	for (int i = pc->count - 1; i >= 0; i--)
+	{
+		if (strcmp(pc->entries[i].device_path, devicepath) == 0)
+			pc->entries[i] = pc->entries[--pc->count];
+	}
+}
+
+// add the devices of a scan to the device list; with g_cs held
+static void lwz_scan_commit(lwz_context_t *h, lwz_scan_t *pscan)
+{
+	LOG("Refreshing attached device list\n");
+
+	int num_new_devices = 0;
+	int new_devices[LWZ_MAX_DEVICES];
+
+	for (int k = 0; k < pscan->num_found; k++)
+	{
+		int const indx = pscan->order[k];
+		lwz_ident_t const * const pident = &pscan->found[indx];
+
+		LOG(".. attempting to add device for unit %d\n", indx + 1);
+
+		// If this slot contains a Pinscape virtual LedWiz interface,
+		// remove the virtual device so that we can use the slot for
+		// the real device.  Real devices always override virtual ones.
+		if (h->devices[indx].device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+		{
+			// remove the virtual interface and notify the user callback
+			LOG(".. this slot has a Pinscape virtual LedWiz; this real device overrides that\n");
+			h->devices[indx].device_type = LWZ_DEVICE_TYPE_NONE;
+			lwz_table_publish(h);
+			lwz_remove(h, indx);
+		}
+
+		if (h->devices[indx].hudev != NULL)
+		{
+			LOG(".. unit slot already in use; device not added\n");
+			continue;
+		}
+
+		// Open the device for good.  This fails if it has been unplugged
+		// again since the scan.
+		lwz_device_t dev;
+		memset(&dev, 0x00, sizeof(dev));
+
+		dev.hudev = usbdev_create(pident->device_path);
+		if (dev.hudev == NULL)
+		{
+			LOG(".. can't open the device; device not added\n");
+			continue;
+		}
+
+		usbdev_set_write_interval_range(dev.hudev, pident->interval_min_us, pident->interval_max_us);
+
+		dev.device_type = pident->device_type;
+		dev.input_rpt_len = pident->input_rpt_len;
+		dev.num_outputs = pident->num_outputs;
+		dev.supports_sbx_pbx = pident->supports_sbx_pbx;
+		safe_strcpy(dev.device_name, sizeof(dev.device_name), pident->device_name);
+		safe_strcpy(dev.device_path, sizeof(dev.device_path), pident->device_path);
+
+		// set up the output state, write queue and I/O thread for the device
+		dev.pstate = lwz_state_open(
+			dev.device_type == LWZ_DEVICE_TYPE_PINSCAPE && dev.supports_sbx_pbx);
+
+		#if defined(USE_SEPARATE_IO_THREAD)
+		if (dev.pstate != NULL)
+			dev.hqueue = queue_open(dev.pstate);
+
+		bool const ok = dev.hqueue != NULL;
+		#else
+		bool const ok = dev.pstate != NULL;
+		#endif
+
+		if (!ok)
+		{
+			LOG(".. can't create the I/O queue; device not added\n");
+			lwz_close_output(&dev, false, GetTickCount() + h->shutdown_timeout_ms);
+			usbdev_release(dev.hudev);
+			continue;
+		}
+
+		// the device list entry now owns the file handle (and state/queue)
+		memcpy(&h->devices[indx], &dev, sizeof(dev));
+
+		// add it to our list of new devices found on this search
+		new_devices[num_new_devices++] = indx;
 
-	// done with the HID device list
-	if (hDevInfo != NULL)
-		SetupDiDestroyDeviceInfoList(hDevInfo);
+		LOG(".. device added successfully, %d devices total\n", num_new_devices);
+	}
 
 	// Set up any needed Pinsape virtual LedWiz interfaces.  For each
 	// Pinscape unit with more than 32 outputs, we'll set up one virtual
@@ -1367,32 +2406,1152 @@ static void lwz_refreshlist_attached(lwz_context_t *h)
 		}
 	}
 
-	// add all of the newly found devices
+	// let the output calls see them, then add all of the newly found devices
+	if (num_new_devices > 0)
+		lwz_table_publish(h);
+
 	lwz_add(h, num_new_devices, new_devices);
 }
 
+// scan and add the devices right away, used by LWZ_SET_NOTIFY(_EX)
+static void lwz_refreshlist_attached(lwz_context_t *h)
+{
+	lwz_scan_t * const pscan = lwz_scan_devices(h, NULL);
+
+	if (pscan == NULL)
+	{
+		LOG("Out of memory, can't refresh the device list\n");
+		return;
+	}
+
+	lwz_scan_commit(h, pscan);
+	lwz_scan_free(pscan);
+}
+
+// Release all devices.  This has to be quick, the application may be on
+// its way out: the I/O threads drop what is queued and cancel the write
+// in progress, and all of them together get the shutdown timeout to finish.
 static void lwz_freelist(lwz_context_t *h)
 {
+	DWORD const tdeadline = GetTickCount() + h->shutdown_timeout_ms;
+
+	// This also gets the callers out that wait for room in a full queue,
+	// before we wait for them to leave the snapshot.
+	for (int i = 0; i < LWZ_MAX_DEVICES; i++)
+	{
+		if (h->devices[i].hudev != NULL)
+			lwz_stop_output(&h->devices[i], h->shutdown_all_off);
+	}
+
+	for (int i = 0; i < LWZ_MAX_DEVICES; i++)
+		h->devices[i].device_type = LWZ_DEVICE_TYPE_NONE;
+
+	lwz_table_publish(h);
+
 	for (int i = 0; i < LWZ_MAX_DEVICES; i++)
 	{
 		if (h->devices[i].hudev != NULL)
 		{
+			lwz_close_output(&h->devices[i], true, tdeadline);
 			usbdev_release(h->devices[i].hudev);
 			h->devices[i].hudev = NULL;
 		}
 	}
 }
 
-// simple fifo to move the WriteFile() calls to a seperate thread
+// output state model, see lwz_state_t
 
-typedef struct {
-	HUDEV hudev;
-	packet_type_t typ;
-	size_t ndata;
-	uint8_t data[32];
-} chunk_t;
+static lwz_state_t * lwz_state_open(bool use_pbx)
+{
+	lwz_state_t * const ps = (lwz_state_t *)malloc(sizeof(lwz_state_t));
+	if (ps == NULL)
+		return NULL;
+
+	memset(ps, 0x00, sizeof(*ps));
+
+	InitializeCriticalSection(&ps->cs);
+	ps->use_pbx = use_pbx;
+
+	#if !defined(USE_SEPARATE_IO_THREAD)
+	InitializeCriticalSection(&ps->cswrite);
+	#endif
+
+	return ps;
+}
+
+static void lwz_state_close(lwz_state_t *ps)
+{
+	if (ps == NULL)
+		return;
+
+	#if !defined(USE_SEPARATE_IO_THREAD)
+	DeleteCriticalSection(&ps->cswrite);
+	#endif
+
+	DeleteCriticalSection(&ps->cs);
+	free(ps);
+}
+
+// Count a change of the desired state and note when the write that will
+// carry it was scheduled.  Called with ps->cs held.
+static bool lwz_state_changed(lwz_state_t *ps)
+{
+	ps->enqueued += 1;
+
+	if (ps->pending)
+	{
+		ps->coalesced += 1;
+		return false;
+	}
+
+	ps->pending = true;
+	ps->tchange_us = usbdev_time_us();
+	return true;
+}
+
+// Does the brightness of a priority port of the group change?  Called with
+// ps->cs held.
+static bool lwz_state_hot_profiles(lwz_state_t *ps, int group, BYTE const *pprofiles)
+{
+	BYTE const * const ppriority = ps->priority[group];
+	BYTE const * const pcurrent = ps->desired[group].profiles;
+
+	for (int i = 0 ; i < 32 ; ++i)
+	{
+		if ((ppriority[i / 8] & (1u << (i % 8))) != 0 && pcurrent[i] != pprofiles[i])
+			return true;
+	}
+
+	return false;
+}
+
+// Update the switch state of a port group.  Returns true if the caller has
+// to schedule a write, i.e. the state changed and no write is pending yet.
+// On/off changes are always urgent, see lwz_state_write().
+static bool lwz_state_set_switches(lwz_state_t *ps, int group, BYTE const *pbanks, BYTE pulse_speed)
+{
+	if (group < 0 || group >= LWZ_MAX_PORT_GROUPS)
+		return false;
+
+	AUTOLOCK(ps->cs);
+
+	lwz_port_group_t * const pg = &ps->desired[group];
+	unsigned int const bit = LWZ_STATE_SWITCHES(group);
+
+	if ((ps->desired_mask & bit) != 0 &&
+		memcmp(pg->banks, pbanks, sizeof(pg->banks)) == 0 &&
+		pg->pulse_speed == pulse_speed)
+	{
+		return false;
+	}
+
+	memcpy(pg->banks, pbanks, sizeof(pg->banks));
+	pg->pulse_speed = pulse_speed;
+	ps->desired_mask |= bit;
+	ps->urgent = true;
+
+	return lwz_state_changed(ps);
+}
+
+// Update the brightness levels of a port group, same as above.  Only the
+// levels of the priority ports are urgent.
+static bool lwz_state_set_profiles(lwz_state_t *ps, int group, BYTE const *pprofiles)
+{
+	if (group < 0 || group >= LWZ_MAX_PORT_GROUPS)
+		return false;
+
+	AUTOLOCK(ps->cs);
+
+	lwz_port_group_t * const pg = &ps->desired[group];
+	unsigned int const bit = LWZ_STATE_PROFILES(group);
+
+	if ((ps->desired_mask & bit) != 0 &&
+		memcmp(pg->profiles, pprofiles, sizeof(pg->profiles)) == 0)
+	{
+		return false;
+	}
+
+	if (lwz_state_hot_profiles(ps, group, pprofiles))
+		ps->urgent = true;
+
+	memcpy(pg->profiles, pprofiles, sizeof(pg->profiles));
+	ps->desired_mask |= bit;
+
+	return lwz_state_changed(ps);
+}
+
+// Update a range of ports, counted from 0 on the physical device, across
+// the port groups.  A value of 0 switches a port off and leaves its
+// brightness as it is, any other value switches it on at that brightness.
+// A group that wasn't set before starts out with all ports off at full
+// brightness (48), like a LedWiz after power on, and only the ports in the
+// range are changed.  Same return value as above.
+static bool lwz_state_set_outputs(lwz_state_t *ps, int first, int count, BYTE const *pvalues)
+{
+	if (first < 0 || count <= 0 || first + count > LWZ_MAX_PORT_GROUPS * 32)
+		return false;
+
+	AUTOLOCK(ps->cs);
+
+	bool changed = false;
+
+	for (int i = 0 ; i < count ; ++i)
+	{
+		int const port = first + i;
+		lwz_port_group_t * const pg = &ps->desired[port / 32];
+		unsigned int const bits = LWZ_STATE_SWITCHES(port / 32) | LWZ_STATE_PROFILES(port / 32);
+
+		if ((ps->desired_mask & bits) != bits)
+		{
+			if ((ps->desired_mask & LWZ_STATE_SWITCHES(port / 32)) == 0)
+			{
+				memset(pg->banks, 0x00, sizeof(pg->banks));
+				pg->pulse_speed = 2;
+				ps->urgent = true;
+			}
+
+			if ((ps->desired_mask & LWZ_STATE_PROFILES(port / 32)) == 0)
+				memset(pg->profiles, 48, sizeof(pg->profiles));
+
+			ps->desired_mask |= bits;
+			changed = true;
+		}
+
+		BYTE * const pbank = &pg->banks[(port % 32) / 8];
+		BYTE const bit = (BYTE)(1u << (port % 8));
+
+		if (pvalues[i] == 0)
+		{
+			if ((*pbank & bit) != 0)
+			{
+				*pbank &= ~bit;
+				changed = true;
+				ps->urgent = true;
+			}
+		}
+		else if ((*pbank & bit) == 0 || pg->profiles[port % 32] != pvalues[i])
+		{
+			// switching on, or the level of a priority port
+			if ((*pbank & bit) == 0 || (ps->priority[port / 32][(port % 32) / 8] & bit) != 0)
+				ps->urgent = true;
+
+			*pbank |= bit;
+			pg->profiles[port % 32] = pvalues[i];
+			changed = true;
+		}
+	}
+
+	if (!changed)
+		return false;
+
+	return lwz_state_changed(ps);
+}
+
+// Merge the parts of frame 'psrc' that 'pdst' doesn't set into 'pdst'.
+static void lwz_frame_merge(lwz_frame_t *pdst, lwz_frame_t const *psrc)
+{
+	for (int group = 0 ; group < LWZ_MAX_PORT_GROUPS ; ++group)
+	{
+		unsigned int const switches = LWZ_STATE_SWITCHES(group) & psrc->mask & ~pdst->mask;
+		unsigned int const profiles = LWZ_STATE_PROFILES(group) & psrc->mask & ~pdst->mask;
+
+		if (switches != 0)
+		{
+			memcpy(pdst->groups[group].banks, psrc->groups[group].banks, sizeof(pdst->groups[group].banks));
+			pdst->groups[group].pulse_speed = psrc->groups[group].pulse_speed;
+		}
+
+		if (profiles != 0)
+			memcpy(pdst->groups[group].profiles, psrc->groups[group].profiles, sizeof(pdst->groups[group].profiles));
+
+		pdst->mask |= switches | profiles;
+	}
+}
+
+// Add the part of a timed frame for one port group.  The parts for the
+// other groups of the same frame (the virtual Pinscape units) go into the
+// same slot.  If all slots are taken the oldest frame is merged into the
+// next one, as if both had been due together.  Returns true if the caller
+// has to schedule a write, so that the I/O thread sees the new frame.
+static bool lwz_state_add_frame(lwz_state_t *ps, int64_t tpresent_us, int group, LWZUPDATE const *pupdate)
+{
+	if (group < 0 || group >= LWZ_MAX_PORT_GROUPS)
+		return false;
+
+	#if !defined(USE_SEPARATE_IO_THREAD)
+	// there is no thread that could wait for the time
+	tpresent_us = 0;
+	#endif
+
+	AUTOLOCK(ps->cs);
+
+	int pos = ps->nframes;
+	while (pos > 0 && ps->frames[pos - 1].tpresent_us > tpresent_us)
+		pos--;
+
+	lwz_frame_t *pf;
+
+	if (pos > 0 && ps->frames[pos - 1].tpresent_us == tpresent_us)
+	{
+		pf = &ps->frames[pos - 1];
+	}
+	else
+	{
+		if (ps->nframes == LWZ_FRAME_SLOTS)
+		{
+			lwz_frame_merge(&ps->frames[1], &ps->frames[0]);
+			memmove(&ps->frames[0], &ps->frames[1], (LWZ_FRAME_SLOTS - 1) * sizeof(lwz_frame_t));
+			ps->nframes -= 1;
+			ps->frames_dropped += 1;
+
+			if (pos > 0)
+				pos--;
+		}
+
+		memmove(&ps->frames[pos + 1], &ps->frames[pos], (ps->nframes - pos) * sizeof(lwz_frame_t));
+		ps->nframes += 1;
+
+		pf = &ps->frames[pos];
+		memset(pf, 0x00, sizeof(*pf));
+		pf->tpresent_us = tpresent_us;
+	}
+
+	lwz_port_group_t * const pg = &pf->groups[group];
+
+	if ((pupdate->flags & LWZ_UPDATE_PBA) != 0)
+	{
+		memcpy(pg->profiles, pupdate->brightness, sizeof(pg->profiles));
+		pf->mask |= LWZ_STATE_PROFILES(group);
+	}
+
+	if ((pupdate->flags & LWZ_UPDATE_SBA) != 0)
+	{
+		memcpy(pg->banks, pupdate->banks, sizeof(pg->banks));
+		pg->pulse_speed = pupdate->globalPulseSpeed;
+		pf->mask |= LWZ_STATE_SWITCHES(group);
+	}
+
+	ps->enqueued += 1;
+
+	// a write that is already scheduled will see it
+	if (ps->pending || ps->frame_wake)
+		return false;
+
+	ps->frame_wake = true;
+	return true;
+}
+
+// Merge the frames that are due by 'tlimit_us' into the desired state.  Of
+// several frames, only the last one is shown, the ones before it are
+// dropped.  Called with ps->cs held.
+static bool lwz_state_present(lwz_state_t *ps, int64_t tlimit_us, int64_t *ptshown_us)
+{
+	int n = 0;
+
+	for ( ; n < ps->nframes && ps->frames[n].tpresent_us <= tlimit_us ; ++n)
+	{
+		lwz_frame_t const * const pf = &ps->frames[n];
+
+		for (int group = 0 ; group < LWZ_MAX_PORT_GROUPS ; ++group)
+		{
+			lwz_port_group_t * const pg = &ps->desired[group];
+
+			if ((pf->mask & LWZ_STATE_SWITCHES(group)) != 0)
+			{
+				memcpy(pg->banks, pf->groups[group].banks, sizeof(pg->banks));
+				pg->pulse_speed = pf->groups[group].pulse_speed;
+			}
+
+			if ((pf->mask & LWZ_STATE_PROFILES(group)) != 0)
+				memcpy(pg->profiles, pf->groups[group].profiles, sizeof(pg->profiles));
+		}
+
+		ps->desired_mask |= pf->mask;
+	}
+
+	if (n == 0)
+		return false;
+
+	*ptshown_us = ps->frames[n - 1].tpresent_us;
+
+	ps->frames_shown += 1;
+	ps->frames_dropped += n - 1;
+	ps->nframes -= n;
+	memmove(&ps->frames[0], &ps->frames[n], ps->nframes * sizeof(lwz_frame_t));
+
+	return true;
+}
+
+// the frames that are still waiting, for the last write before the device is released
+static void lwz_state_present_all(lwz_state_t *ps)
+{
+	AUTOLOCK(ps->cs);
+
+	int64_t tshown_us;
+	if (ps->nframes > 0)
+		lwz_state_present(ps, ps->frames[ps->nframes - 1].tpresent_us, &tshown_us);
+}
+
+// How long the I/O thread can wait before it has to write the next frame,
+// in ms, or INFINITE if there is none.  The wait is rounded to the nearest
+// ms, a frame is due when it is less than half a ms away.
+static DWORD lwz_state_frame_wait(lwz_state_t *ps)
+{
+	AUTOLOCK(ps->cs);
+
+	if (ps->nframes == 0)
+		return INFINITE;
+
+	int64_t const dt = ps->frames[0].tpresent_us - ps->frame_lead_us - usbdev_time_us();
+
+	return dt < LWZ_FRAME_SLACK_US ? 0 : (DWORD)((dt + LWZ_FRAME_SLACK_US) / 1000);
+}
+
+// A write that showed a frame has completed.  How long it took is the
+// lead for the next frames, so that their writes complete on time.  A
+// single slow write (the thread wasn't scheduled, the bus was busy) only
+// moves it by a ms at most, so that it follows the typical write and the
+// frames after an outlier aren't sent early.
+#define LWZ_FRAME_LEAD_STEP_US  1000
+
+static void lwz_state_add_present(lwz_state_t *ps, int64_t tstart_us, int64_t tshown_us)
+{
+	int64_t const now_us = usbdev_time_us();
+
+	int64_t step = (now_us - tstart_us - ps->frame_lead_us) / 4;
+	if (step > LWZ_FRAME_LEAD_STEP_US)
+		step = LWZ_FRAME_LEAD_STEP_US;
+	if (step < -LWZ_FRAME_LEAD_STEP_US)
+		step = -LWZ_FRAME_LEAD_STEP_US;
+
+	ps->frame_lead_us += step;
+
+	AUTOLOCK(ps->cs);
+	usbdev_latency_add(ps->present_hist, now_us > tshown_us ? now_us - tshown_us : tshown_us - now_us);
+}
+
+// Forget what the device has, e.g. after a raw message that might have
+// changed the outputs.  The next write sends everything again.
+static void lwz_state_invalidate(lwz_state_t *ps)
+{
+	ps->sent_mask = 0;
+}
+
+// a raw message was queued, it counts like a state change
+static void lwz_state_count_raw(lwz_state_t *ps)
+{
+	AUTOLOCK(ps->cs);
+	ps->enqueued += 1;
+}
+
+// a write that was scheduled at 'tstart_us' has completed
+static void lwz_state_add_latency(lwz_state_t *ps, int64_t tstart_us)
+{
+	int64_t const now_us = usbdev_time_us();
+
+	AUTOLOCK(ps->cs);
+	usbdev_latency_add(ps->latency_hist, now_us - tstart_us);
+}
+
+// Called by the producers after each push, which may run on several
+// threads at once, so there is no lock on this path.
+static void lwz_state_queue_level(lwz_state_t *ps, unsigned int level)
+{
+	for (;;)
+	{
+		LONG const high = ps->queue_high_water;
+
+		if ((LONG)level <= high ||
+			InterlockedCompareExchange(&ps->queue_high_water, (LONG)level, high) == high)
+		{
+			break;
+		}
+	}
+}
+
+// Build a Pinscape PBX message from 6 bytes that lwz_pbx_pack() made of
+// the brightness levels of 8 ports:
+//
+// 68 pp ee ee ee ee ee ee
+//
+// 68 = command code
+// pp = port group: 0 for ports 1-8, 1 for 9-16, etc
+// ee = packed brightness values, 6 bits per port
+static void lwz_encode_pbx(BYTE *pdst, int port_group, BYTE const *ppacked)
+{
+	pdst[0] = 68;
+	pdst[1] = port_group;
+	memcpy(&pdst[2], ppacked, 6);
+}
+
+// the ports of a group as one bit each, port 1 in bit 0, like the banks of an SBA
+static uint32_t lwz_port_bits(BYTE const *pbanks)
+{
+	return (uint32_t)pbanks[0] | ((uint32_t)pbanks[1] << 8) | ((uint32_t)pbanks[2] << 16) | ((uint32_t)pbanks[3] << 24);
+}
+
+// The blocks of 8 ports (one bit per block) that the ports in 'ports' fall
+// into.  The PBA of a LedWiz always carries all four.
+static unsigned int lwz_port_blocks(lwz_state_t *ps, int group, uint32_t ports)
+{
+	if (group == 0 && !ps->use_pbx)
+		return ports != 0 ? 0xF : 0;
+
+	unsigned int blocks = 0;
+
+	for (int block = 0 ; block < 4 ; ++block)
+	{
+		if (((ports >> (block * 8)) & 0xFF) != 0)
+			blocks |= 1u << block;
+	}
+
+	return blocks;
+}
+
+// Has an urgent change come in since the write picked up the desired state?
+static bool lwz_state_preempted(lwz_state_t *ps)
+{
+	AUTOLOCK(ps->cs);
+	return ps->urgent;
+}
+
+// A PBA that failed half way (or was cut short) leaves the bank counter
+// of a LedWiz somewhere in the middle, and the next PBA would land on the
+// wrong ports.  An SBA resets it.  It only keeps the ports on that stay on,
+// the others come on after the PBA as usual.
+static void lwz_state_pba_resync(lwz_state_t *ps, HUDEV hudev, lwz_port_group_t const *pwant)
+{
+	lwz_port_group_t *psent = &ps->sent[0];
+
+	BYTE msg[8];
+	msg[0] = 64;
+	for (int i = 0 ; i < 4 ; ++i)
+		msg[1 + i] = psent->banks[i] & pwant->banks[i];
+	msg[5] = pwant->pulse_speed != 0 ? pwant->pulse_speed : 2;
+	msg[6] = 0;
+	msg[7] = 0;
+
+	if (usbdev_write(hudev, msg, 8) == 8)
+	{
+		memcpy(psent->banks, &msg[1], sizeof(psent->banks));
+		psent->pulse_speed = msg[5];
+		ps->pba_resync = false;
+	}
+}
+
+// Send the brightness levels of the blocks 'blocks' of a port group, as
+// the reports of a PBA or as one PBX per block.  'ppacked' is what
+// lwz_pbx_pack() made of the levels.  With 'ppreempted' (the fade lane)
+// it stops before the next report when an urgent change has come in.
+//
+// Pinscape units get PBX, also for ports 1-32.  The regular PBA is
+// stateful, as the ports being addressed are implied by the protocol
+// state.  PBX encodes the port address directly in the message, which
+// eliminates the possibility of the host and device getting out of sync.
+// It also lets us send only the blocks of 8 ports that actually changed.
+static bool lwz_state_send_profiles(lwz_state_t *ps, HUDEV hudev, int group, lwz_port_group_t const *pwant, BYTE const *ppacked, unsigned int blocks, bool *ppreempted)
+{
+	BYTE *psent = ps->sent[group].profiles;
+	bool const pba = group == 0 && !ps->use_pbx;
+	bool ok = true;
+
+	if (pba && blocks != 0 && ps->pba_resync)
+		lwz_state_pba_resync(ps, hudev, pwant);
+
+	for (int block = 0 ; block < 4 && ok ; ++block)
+	{
+		if ((blocks & (1u << block)) == 0)
+			continue;
+
+		if (ppreempted != NULL && lwz_state_preempted(ps))
+		{
+			if (pba && block > 0)
+				ps->pba_resync = true;
+
+			*ppreempted = true;
+			break;
+		}
+
+		BYTE msg[8];
+
+		if (pba)
+			memcpy(msg, &pwant->profiles[block * 8], 8);
+		else
+			lwz_encode_pbx(msg, group * 4 + block, &ppacked[block * 6]);
+
+		ok = usbdev_write(hudev, msg, 8) == 8;
+
+		if (ok)
+			memcpy(&psent[block * 8], &pwant->profiles[block * 8], 8);
+		else if (pba)
+			ps->pba_resync = true;
+	}
+
+	// with pipelined writes the failure may belong to an earlier report,
+	// so nothing that was sent is known for sure
+	if (!ok)
+		ps->sent_mask = 0;
+
+	return ok;
+}
+
+// Bring the device up to date with the desired state.  Called by the I/O
+// thread (or directly, without it) for each scheduled write.
+static void lwz_state_write(lwz_state_t *ps, HUDEV hudev)
+{
+	lwz_port_group_t desired[LWZ_MAX_PORT_GROUPS];
+	BYTE priority[LWZ_MAX_PORT_GROUPS][4];
+	unsigned int desired_mask;
+	int64_t tchange_us;
+	bool changed;
+
+	int64_t const tstart_us = usbdev_time_us();
+	int64_t tshown_us = 0;
+	bool shown;
+
+	{
+		AUTOLOCK(ps->cs);
+
+		// the frames whose writes have to start now, see LWZ_UPDATE_FRAME()
+		shown = lwz_state_present(ps, tstart_us + ps->frame_lead_us + LWZ_FRAME_SLACK_US, &tshown_us);
+
+		memcpy(desired, ps->desired, sizeof(desired));
+		memcpy(priority, ps->priority, sizeof(priority));
+		desired_mask = ps->desired_mask;
+		tchange_us = ps->tchange_us;
+		changed = ps->pending;
+
+		// anything that changes from now on needs another write
+		ps->pending = false;
+		ps->frame_wake = false;
+		ps->urgent = false;
+	}
+
+	// The write has two lanes.  The priority lane has the on/off changes,
+	// and the brightness of the priority ports (LWZ_SET_PRIORITY()); those
+	// are the solenoids and flashers, and they shouldn't wait behind a
+	// fade.  The fade lane has the brightness changes of all other ports
+	// and goes last.
+	//
+	// Within the priority lane the brightness levels go first, then the
+	// switch states.  SBA and PBA are orthogonal, so the final state is
+	// the combination of the last SBA plus the last PBA and isn't affected
+	// by their order.  But there is a subtle interaction that can be
+	// visible to users: an SBA that turns a port ON does so at the port's
+	// last brightness setting.  Some clients (e.g., DOF) therefore are
+	// careful to set the brightness for a port that's to be newly turned
+	// on *before* turning the switch on - i.e., they send a PBA before the
+	// SBA.  Since several calls may have been merged into this write, the
+	// level of a port that comes on is always part of the priority lane,
+	// which makes sure that it never comes on at a stale level.  The fade
+	// lane only has ports that stay on or off, so it can go after the SBA.
+	//
+	// An urgent change that comes in while the fades are being sent ends
+	// the write before the next report.  It has already scheduled the next
+	// one, which sends it first and then the fades that are left.  That
+	// write sends all of them, so that a steady stream of urgent changes
+	// can't hold the fades back for good.  A PBA that is cut short leaves
+	// the bank counter of a LedWiz in the middle; the SBA of the urgent
+	// change resets it, or lwz_state_pba_resync() does before the next PBA.
+
+	// The blocks of each group whose levels the device doesn't have yet,
+	// and which of them are urgent.  The PBX of each group is packed at
+	// once, that is as quick as packing a single block.
+	unsigned int stale[LWZ_MAX_PORT_GROUPS];
+	unsigned int urgent[LWZ_MAX_PORT_GROUPS];
+	BYTE packed[LWZ_MAX_PORT_GROUPS][4 * 6];
+
+	for (int group = 0 ; group < LWZ_MAX_PORT_GROUPS ; ++group)
+	{
+		stale[group] = 0;
+		urgent[group] = 0;
+
+		if ((desired_mask & LWZ_STATE_PROFILES(group)) == 0)
+			continue;
+
+		BYTE const *pwant = desired[group].profiles;
+		BYTE const *psent = ps->sent[group].profiles;
+		bool const valid = (ps->sent_mask & LWZ_STATE_PROFILES(group)) != 0;
+
+		uint32_t ports = 0;
+		for (int i = 0 ; i < 32 ; ++i)
+		{
+			if (!valid || pwant[i] != psent[i])
+				ports |= 1u << i;
+		}
+
+		// the ports that come on, and the priority ports
+		uint32_t hot = lwz_port_bits(priority[group]);
+
+		if ((desired_mask & LWZ_STATE_SWITCHES(group)) != 0)
+		{
+			uint32_t const was_on = (ps->sent_mask & LWZ_STATE_SWITCHES(group)) != 0 ? lwz_port_bits(ps->sent[group].banks) : 0;
+			hot |= lwz_port_bits(desired[group].banks) & ~was_on;
+		}
+
+		// A frame is shown all at once at its time, the switches go last.
+		if (shown)
+			hot = 0xFFFFFFFF;
+
+		stale[group] = lwz_port_blocks(ps, group, ports);
+		urgent[group] = lwz_port_blocks(ps, group, ports & hot);
+
+		if (group > 0 || ps->use_pbx)
+			lwz_pbx_pack(packed[group], pwant, 4);
+	}
+
+	// a failure anywhere means the device may not have any of it
+	bool failed = false;
+
+	// priority lane: brightness levels
+	for (int group = 0 ; group < LWZ_MAX_PORT_GROUPS ; ++group)
+	{
+		if (urgent[group] == 0)
+			continue;
+
+		if (lwz_state_send_profiles(ps, hudev, group, &desired[group], packed[group], urgent[group], NULL))
+			stale[group] &= ~urgent[group];
+		else
+			failed = true;
+	}
+
+	// priority lane: switch states
+	for (int group = 0 ; group < LWZ_MAX_PORT_GROUPS ; ++group)
+	{
+		unsigned int const bit = LWZ_STATE_SWITCHES(group);
+
+		if ((desired_mask & bit) == 0)
+			continue;
+
+		lwz_port_group_t const *pwant = &desired[group];
+		lwz_port_group_t *psent = &ps->sent[group];
+
+		if ((ps->sent_mask & bit) != 0 &&
+			memcmp(pwant->banks, psent->banks, sizeof(psent->banks)) == 0 &&
+			pwant->pulse_speed == psent->pulse_speed)
+		{
+			continue;
+		}
+
+		// Standard SBA message (command code 64) for the first 32 ports,
+		// Pinscape SBX (67) with the group of 32 ports for the others.
+		// The "port group" byte is unused in regular SBA messages and must
+		// be zero.
+		BYTE msg[8];
+		msg[0] = group > 0 ? 67 : 64;
+		msg[1] = pwant->banks[0];
+		msg[2] = pwant->banks[1];
+		msg[3] = pwant->banks[2];
+		msg[4] = pwant->banks[3];
+		msg[5] = pwant->pulse_speed;
+		msg[6] = group;
+		msg[7] = 0;
+
+		if (usbdev_write(hudev, msg, 8) == 8)
+		{
+			memcpy(psent->banks, pwant->banks, sizeof(psent->banks));
+			psent->pulse_speed = pwant->pulse_speed;
+			ps->sent_mask |= bit;
+
+			// it resets the bank counter of a LedWiz as well
+			if (group == 0)
+				ps->pba_resync = false;
+		}
+		else
+		{
+			ps->sent_mask = 0;
+			failed = true;
+		}
+	}
+
+	// fade lane
+	bool preempted = false;
+	bool * const ppreempted = ps->fades_cut ? NULL : &preempted;
+
+	for (int group = 0 ; group < LWZ_MAX_PORT_GROUPS && !preempted ; ++group)
+	{
+		unsigned int const bit = LWZ_STATE_PROFILES(group);
+
+		if ((desired_mask & bit) == 0)
+			continue;
+
+		if (!lwz_state_send_profiles(ps, hudev, group, &desired[group], packed[group], stale[group], ppreempted))
+			failed = true;
+
+		// the device has all levels of the group now
+		if (!failed && !preempted)
+			ps->sent_mask |= bit;
+	}
+
+	ps->fades_cut = preempted;
+
+	if (preempted)
+	{
+		// The next write covers the rest of this one, its latency counts
+		// from the change that this write was for.
+		AUTOLOCK(ps->cs);
+
+		ps->preempted += 1;
+
+		if (changed && tchange_us < ps->tchange_us)
+			ps->tchange_us = tchange_us;
+
+		return;
+	}
+
+	// a write for the frames only doesn't count, see LWZ_GET_STATS()
+	if (changed)
+		lwz_state_add_latency(ps, tchange_us);
+
+	// The frame is shown when its last report has reached the device,
+	// not when it was handed to the OS, so that the lead covers the
+	// transport latency as well.
+	if (shown)
+	{
+		usbdev_flush(hudev);
+		lwz_state_add_present(ps, tstart_us, tshown_us);
+	}
+}
+
+// Make "all outputs off" the desired state, for the last write before the
+// device is released.  That is the switches of the first 32 ports, and of
+// the other port groups the client has used.  Brightness levels that
+// weren't sent yet don't matter any more.
+static void lwz_state_all_off(lwz_state_t *ps)
+{
+	AUTOLOCK(ps->cs);
+
+	unsigned int mask = 0;
+
+	for (int group = 0 ; group < LWZ_MAX_PORT_GROUPS ; ++group)
+	{
+		unsigned int const used = LWZ_STATE_SWITCHES(group) | LWZ_STATE_PROFILES(group);
+
+		if (group > 0 && (ps->desired_mask & used) == 0)
+			continue;
+
+		lwz_port_group_t * const pg = &ps->desired[group];
+
+		memset(pg->banks, 0x00, sizeof(pg->banks));
+
+		// keep the pulse speed, unless the client has never set one
+		if (pg->pulse_speed == 0)
+			pg->pulse_speed = 2;
+
+		mask |= LWZ_STATE_SWITCHES(group);
+	}
+
+	ps->desired_mask = mask;
+
+	// and nothing comes on again
+	ps->nframes = 0;
+}
+
+static lwz_state_t * lwz_get_state(lwz_context_t *h, int indx)
+{
+	if (indx < 0 ||
+	    indx >= LWZ_MAX_DEVICES ||
+	    h->devices[indx].hudev == NULL)
+	{
+		return NULL;
+	}
+
+	return h->devices[indx].pstate;
+}
+
+// have the desired state of a device written to it
+static void lwz_state_schedule(lwz_route_t const *pr)
+{
+	#if defined(USE_SEPARATE_IO_THREAD)
+
+	// The queue item carries no data; the I/O thread writes whatever the
+	// state is by the time it gets there.  Further updates until then are
+	// merged into it by lwz_state_set_xxx().
+	queue_push(pr->hqueue, pr->hudev, PACKET_TYPE_STATE, NULL, 0);
+
+	#else
+
+	// several threads may call in at once
+	AUTOLOCK(pr->pstate->cswrite);
+
+	lwz_state_write(pr->pstate, pr->hudev);
+
+	#endif
+}
+
+// Background reader for the input reports of a device.  The reader
+// thread is the only producer, and the API functions (under g_cs) are
+// the only consumer, so the ring needs no lock: the producer owns the
+// slot at 'wpos' until it advances 'wpos', the consumer the one at
+// 'rpos' until it advances 'rpos'.  If a callback is set the reports
+// go there instead.
+
+#define LWZ_INPUT_QUEUE_LENGTH  32      // power of 2
+#define LWZ_INPUT_POLL_MS       100     // how long the reader blocks before it checks for quit
+
+typedef struct {
+	DWORD ndata;
+	BYTE data[64];
+} lwz_input_report_t;
+
+struct lwz_input_s {
+	HUDEV hudev;            // own reference
+	LWZHANDLE hlwz;
+	UINT report_len;
+
+	HANDLE hthread;
+	HANDLE hqevent;         // set when the thread routine returns, see queue_close()
+	HANDLE hrevent;         // set when a report is added
+	volatile LONG quit;
+
+	volatile LONG wpos;
+	volatile LONG rpos;
+	lwz_input_report_t ring[LWZ_INPUT_QUEUE_LENGTH];
+
+	CRITICAL_SECTION cscb;  // held while the callback runs
+	LWZINPUTPROC callback;
+	void *puser;
+};
+
+static DWORD WINAPI InputThreadProc(LPVOID lpParameter)
+{
+	lwz_input_t * const pi = (lwz_input_t*)lpParameter;
+
+	while (pi->quit == 0)
+	{
+		BYTE buffer[64];
+
+		DWORD const t0 = GetTickCount();
+		size_t const n = usbdev_read_timeout(pi->hudev, buffer, pi->report_len, LWZ_INPUT_POLL_MS);
+
+		if (n == 0)
+		{
+			// a read that fails right away (device gone) shouldn't spin
+			if (GetTickCount() - t0 < LWZ_INPUT_POLL_MS / 2)
+				Sleep(LWZ_INPUT_POLL_MS / 10);
+
+			continue;
+		}
+
+		{
+			AUTOLOCK(pi->cscb);
+
+			if (pi->callback != NULL)
+			{
+				pi->callback(pi->puser, pi->hlwz, buffer, (uint32_t)n);
+				continue;
+			}
+		}
+
+		LONG const wpos = pi->wpos;
+
+		// drop the report if the client doesn't keep up
+		if (wpos - pi->rpos >= LWZ_INPUT_QUEUE_LENGTH)
+			continue;
+
+		lwz_input_report_t * const pr = &pi->ring[wpos & (LWZ_INPUT_QUEUE_LENGTH - 1)];
+		memcpy(pr->data, buffer, n);
+		pr->ndata = (DWORD)n;
+
+		// publish the slot
+		MemoryBarrier();
+		pi->wpos = wpos + 1;
+
+		SetEvent(pi->hrevent);
+	}
+
+	SetEvent(pi->hqevent);
+
+	return 0;
+}
+
+static lwz_input_t * lwz_input_open(HUDEV hudev, LWZHANDLE hlwz, UINT report_len)
+{
+	if (report_len == 0)
+		return NULL;
+
+	lwz_input_t * const pi = (lwz_input_t *)malloc(sizeof(lwz_input_t));
+
+	if (pi == NULL)
+		return NULL;
+
+	memset(pi, 0x00, sizeof(*pi));
+
+	pi->hlwz = hlwz;
+	pi->report_len = report_len < sizeof(pi->ring[0].data) ? report_len : sizeof(pi->ring[0].data);
+
+	InitializeCriticalSection(&pi->cscb);
+
+	pi->hqevent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	pi->hrevent = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	if (pi->hqevent == NULL || pi->hrevent == NULL)
+	{
+		lwz_input_close(pi, false);
+		return NULL;
+	}
+
+	usbdev_addref(hudev);
+	pi->hudev = hudev;
+
+	pi->hthread = CreateThread(NULL, 0, InputThreadProc, (void*)pi, 0, NULL);
+
+	if (pi->hthread == NULL)
+	{
+		lwz_input_close(pi, false);
+		return NULL;
+	}
+
+	return pi;
+}
+
+static void lwz_input_close(lwz_input_t *pi, bool unload)
+{
+	if (pi == NULL)
+		return;
+
+	if (pi->hthread != NULL)
+	{
+		InterlockedExchange(&pi->quit, 1);
+
+		// like queue_close(), don't wait for the thread itself
+		// within the DLL unload
+		WaitForSingleObject(unload ? pi->hqevent : pi->hthread, INFINITE);
+		CloseHandle(pi->hthread);
+		pi->hthread = NULL;
+	}
+
+	if (pi->hudev != NULL)
+	{
+		usbdev_release(pi->hudev);
+		pi->hudev = NULL;
+	}
+
+	if (pi->hqevent != NULL)
+		CloseHandle(pi->hqevent);
+
+	if (pi->hrevent != NULL)
+		CloseHandle(pi->hrevent);
+
+	DeleteCriticalSection(&pi->cscb);
+
+	free(pi);
+}
+
+// take the oldest report, waiting up to the timeout for one
+static size_t lwz_input_pop(lwz_input_t *pi, BYTE *pdata, size_t ndata, DWORD timeout_ms)
+{
+	DWORD const t0 = GetTickCount();
+
+	for (;;)
+	{
+		LONG const rpos = pi->rpos;
+
+		if (pi->wpos != rpos)
+		{
+			// the slot was published before 'wpos' moved
+			MemoryBarrier();
+
+			lwz_input_report_t const * const pr = &pi->ring[rpos & (LWZ_INPUT_QUEUE_LENGTH - 1)];
+
+			if (ndata > pr->ndata)
+				ndata = pr->ndata;
+
+			memcpy(pdata, pr->data, ndata);
+
+			MemoryBarrier();
+			pi->rpos = rpos + 1;
+
+			return ndata;
+		}
+
+		DWORD const elapsed = GetTickCount() - t0;
+
+		if (elapsed >= timeout_ms ||
+			WaitForSingleObject(pi->hrevent, timeout_ms - elapsed) != WAIT_OBJECT_0)
+		{
+			return 0;
+		}
+	}
+}
+
+static void lwz_input_set_callback(lwz_input_t *pi, LWZINPUTPROC proc, void *puser)
+{
+	// waits for a callback that is running right now
+	AUTOLOCK(pi->cscb);
+
+	pi->callback = proc;
+	pi->puser = puser;
+}
+
+static lwz_input_t * lwz_get_input(lwz_context_t *h, int indx, bool start)
+{
+	HUDEV const hudev = lwz_get_hdev(h, indx);
+
+	if (hudev == NULL)
+		return NULL;
+
+	lwz_device_t * const dev = &h->devices[indx];
+
+	if (dev->pinput == NULL && start)
+		dev->pinput = lwz_input_open(hudev, indx + 1, dev->input_rpt_len);
+
+	return dev->pinput;
+}
+
+// simple fifo to move the WriteFile() calls to a seperate thread
+
+typedef struct {
+	HUDEV hudev;
+	packet_type_t typ;
+	int64_t tpush_us;   // usbdev_time_us() when a raw message was queued, for the statistics
+	size_t ndata;
+	uint8_t data[32];
+} chunk_t;
+
+#define QUEUE_LENGTH   64   // the maximum bandwidth of the device is around 2 kByte/s so a length of 64 corresponds to one second
+
+#if defined(USE_LOCKFREE_QUEUE)
+
+// Bounded multi-producer/single-consumer ring, after D. Vyukov's bounded
+// queue.  Each cell carries a sequence number: it is 'pos' while the cell is
+// free for the producer that claims write position 'pos', 'pos + 1' once the
+// data is published, and 'pos + QUEUE_LENGTH' after the consumer took it.
+// Producers claim write positions with a compare-and-swap on 'wpos'; only
+// the I/O thread moves 'rpos'.  Nothing takes a lock or enters the kernel
+// on the caller's thread, unless the I/O thread is parked on an empty queue
+// ('rparked') and has to be woken up, or the queue is full.
+//
+// The positions are free running and only compared by difference, so they
+// may wrap around.
+
+typedef struct {
+	volatile LONG seq;
+	chunk_t chunk;
+} cell_t;
+
+typedef struct {
+	volatile LONG wpos;
+	volatile LONG rpos;
+	volatile LONG state;
+	volatile LONG rparked;   // I/O thread waits (or is about to) on hwevent
+	volatile LONG wparked;   // number of producers waiting for space on hrevent
+	volatile LONG eblocked;  // queue_wait_empty() waits on heevent
+	HANDLE hthread;
+	HANDLE hrevent;
+	HANDLE hwevent;
+	HANDLE heevent;
+	HANDLE hqevent;
+	lwz_state_t *pstate;
+	bool stopped;            // see queue_stop()
+	HUDEV hfinal;
+	volatile LONG finished;  // see queue_close()
+	cell_t buf[QUEUE_LENGTH];
+} queue_t;
+
+#define QUEUE_DIFF(a, b)  ((LONG)((unsigned long)(a) - (unsigned long)(b)))
 
-#define QUEUE_LENGTH   64   // the maximum bandwidth of the device is around 2 kByte/s so a length of 64 corresponds to one second
+#else
 
 typedef struct {
 	int rpos;
@@ -1408,29 +3567,99 @@ typedef struct {
 	bool rblocked;
 	bool wblocked;
 	bool eblocked;
+	lwz_state_t *pstate;
+	bool stopped;            // see queue_stop()
+	HUDEV hfinal;
+	volatile LONG finished;  // see queue_close()
 	chunk_t buf[QUEUE_LENGTH];
 } queue_t;
 
+#endif
+
+static void queue_abort(queue_t *h);
+static void queue_drain(queue_t *h);
+static void queue_free(queue_t *h);
+
 
 static DWORD WINAPI QueueThreadProc(LPVOID lpParameter)
 {
 	queue_t * const h = (queue_t*)lpParameter;
 
+	// the device written last, it is kept until the thread quits
+	HUDEV hlast = NULL;
+
 	for (;;)
 	{
 		uint8_t buffer[64];
 
 		HUDEV hudev = NULL;
-		size_t ndata = queue_shift(h, &hudev, &buffer[0], sizeof(buffer));
+		packet_type_t typ = PACKET_TYPE_RAW;
+		int64_t tpush_us = 0;
+		size_t ndata = queue_shift(h, &hudev, &typ, &tpush_us, &buffer[0], sizeof(buffer), lwz_state_frame_wait(h->pstate));
+
+		// the next timed frame is due, it goes to the device
+		// that the frame was scheduled for, see LWZ_UPDATE_FRAME()
+		if (typ == PACKET_TYPE_NONE)
+		{
+			if (hlast != NULL) {
+				lwz_state_write(h->pstate, hlast);
+			}
+
+			continue;
+		}
 
 		// exit thread if required
 
-		if (ndata == 0 || hudev == NULL) {
+		if (hudev == NULL) {
 			break;
 		}
 
-		usbdev_write(hudev, &buffer[0], ndata);
-		usbdev_release(hudev);
+		if (typ == PACKET_TYPE_STATE)
+		{
+			lwz_state_write(h->pstate, hudev);
+		}
+		else
+		{
+			usbdev_write(hudev, &buffer[0], ndata);
+
+			// a raw message may have changed the outputs behind our back
+			lwz_state_invalidate(h->pstate);
+			lwz_state_add_latency(h->pstate, tpush_us);
+		}
+
+		if (hlast != NULL) {
+			usbdev_release(hlast);
+		}
+
+		hlast = hudev;
+	}
+
+	// Windows cancels the overlapped writes of a thread when it exits,
+	// so wait for the pipelined writes to go out first
+	if (hlast != NULL)
+	{
+		usbdev_flush(hlast);
+		usbdev_release(hlast);
+	}
+
+	// the last write, see queue_stop()
+	if (h->hfinal != NULL)
+	{
+		usbdev_cancel_writes(h->hfinal, false);
+		lwz_state_present_all(h->pstate);
+		lwz_state_write(h->pstate, h->hfinal);
+		usbdev_flush(h->hfinal);
+		usbdev_release(h->hfinal);
+		h->hfinal = NULL;
+	}
+
+	// queue_close() has given up waiting for us, the queue and the
+	// output state are ours to free
+	if (InterlockedExchange(&h->finished, 1) == 2)
+	{
+		lwz_state_close(h->pstate);
+		queue_free(h);
+		return 0;
 	}
 
 	SetEvent(h->hqevent);
@@ -1438,37 +3667,91 @@ static DWORD WINAPI QueueThreadProc(LPVOID lpParameter)
 	return 0;
 }
 
-static void queue_close(HQUEUE hqueue, bool unload)
+// Have the I/O thread quit after the chunk it is working on, and cancel
+// the write in progress on 'hudev'.  The chunks still queued are dropped,
+// and callers waiting for room in the queue return.  With 'final_write'
+// the thread brings 'hudev' up to date with the output state one last
+// time before it quits, so that the client's final frame isn't lost with
+// the ones before it.  Doesn't wait, see queue_close().
+static void queue_stop(HQUEUE hqueue, HUDEV hudev, bool final_write)
 {
 	queue_t * const h = (queue_t*)hqueue;
 
-	if (h == NULL) {
+	if (h == NULL || h->stopped) {
 		return;
 	}
 
+	h->stopped = true;
+
+	if (final_write && hudev != NULL)
+	{
+		usbdev_addref(hudev);
+		h->hfinal = hudev;
+	}
+
+	// cancel first: once woken up, the thread clears this again for the
+	// final write, and a cancel after that would drop the final write
+	if (hudev != NULL) {
+		usbdev_cancel_writes(hudev, true);
+	}
+
+	queue_abort(h);
+}
+
+// Wait for the I/O thread to quit, up to the deadline (a GetTickCount()
+// value), and free the queue.  A thread that is still stuck in a write by
+// then is left alone; it frees the queue and the output state itself once
+// the write returns, and the result is false.  The library stays loaded
+// for it, see lwz_pin_module().
+static bool queue_close(HQUEUE hqueue, bool unload, DWORD tdeadline)
+{
+	queue_t * const h = (queue_t*)hqueue;
+
+	if (h == NULL) {
+		return true;
+	}
+
 	if (h->hthread)
 	{
-		// Add a magic "quit" item to the queue, identified by null device
-		// and data pointers.  The thread quits when it reads this item.
-		queue_push(h, NULL, PACKET_TYPE_RAW, NULL, 0);
+		queue_stop(h, NULL, false);
 
-		if (unload)
-		{
-			// we can *not* wait for the thread itself
-			// if we are closed within the DLL unload.
-			// this would result in a deadlock
-			// instead we sync with the 'hqevent' that is set at the end of the thread routine
+		// we can *not* wait for the thread itself
+		// if we are closed within the DLL unload.
+		// this would result in a deadlock
+		// instead we sync with the 'hqevent' that is set at the end of the thread routine
+		HANDLE const hwait = unload ? h->hqevent : h->hthread;
 
-			WaitForSingleObject(h->hqevent, INFINITE);
-			CloseHandle(h->hthread);
-			h->hthread = NULL;
-		}
-		else
+		LONG const remaining = (LONG)(tdeadline - GetTickCount());
+
+		if (WaitForSingleObject(hwait, remaining > 0 ? (DWORD)remaining : 0) != WAIT_OBJECT_0)
 		{
-			WaitForSingleObject(h->hthread, INFINITE);
-			CloseHandle(h->hthread);
-			h->hthread = NULL;
+			if (InterlockedExchange(&h->finished, 2) == 0)
+			{
+				CloseHandle(h->hthread);
+				return false;
+			}
+
+			// it got there in the meantime
+			WaitForSingleObject(hwait, INFINITE);
 		}
+
+		CloseHandle(h->hthread);
+		h->hthread = NULL;
+	}
+
+	queue_free(h);
+
+	return true;
+}
+
+static void queue_free(queue_t *h)
+{
+	queue_drain(h);
+
+	if (h->hfinal != NULL)
+	{
+		usbdev_release(h->hfinal);
+		h->hfinal = NULL;
 	}
 
 	if (h->hrevent)
@@ -1483,18 +3766,26 @@ static void queue_close(HQUEUE hqueue, bool unload)
 		h->hwevent = NULL;
 	}
 
+	if (h->heevent)
+	{
+		CloseHandle(h->heevent);
+		h->heevent = NULL;
+	}
+
 	if (h->hqevent)
 	{
 		CloseHandle(h->hqevent);
 		h->hqevent = NULL;
 	}
 
+	#if !defined(USE_LOCKFREE_QUEUE)
 	DeleteCriticalSection(&h->cs);
+	#endif
 
 	free(h);
 }
 
-static HQUEUE queue_open(void)
+static HQUEUE queue_open(lwz_state_t *pstate)
 {
 	queue_t * const h = (queue_t*)malloc(sizeof(queue_t));
 
@@ -1504,7 +3795,15 @@ static HQUEUE queue_open(void)
 
 	memset(h, 0x00, sizeof(queue_t));
 
+	h->pstate = pstate;
+
+	#if defined(USE_LOCKFREE_QUEUE)
+	for (int i = 0; i < QUEUE_LENGTH; i++) {
+		h->buf[i].seq = i;
+	}
+	#else
 	InitializeCriticalSection(&h->cs);
+	#endif
 
 	h->hrevent = CreateEvent(NULL, FALSE, FALSE, NULL);
 	h->hwevent = CreateEvent(NULL, FALSE, FALSE, NULL);
@@ -1525,13 +3824,286 @@ static HQUEUE queue_open(void)
 		goto Failed;
 	}
 
+	// the thread may outlive an unload, see queue_close()
+	lwz_pin_module();
+
 	return h;
 
 Failed:
-	queue_close(h, false);
+	queue_close(h, false, GetTickCount());
 	return NULL;
 }
 
+#if defined(USE_LOCKFREE_QUEUE)
+
+// see queue_stop()
+static void queue_abort(queue_t *h)
+{
+	InterlockedExchange(&h->state, 1);
+
+	// wake up everybody who waits: the I/O thread, queue_wait_empty(), and
+	// the producers, which pass it on to each other (see queue_push())
+	SetEvent(h->hwevent);
+	SetEvent(h->heevent);
+	SetEvent(h->hrevent);
+}
+
+// release the devices of the chunks that were never written
+static void queue_drain(queue_t *h)
+{
+	for (;;)
+	{
+		unsigned long const pos = (unsigned long)h->rpos;
+		cell_t * const cell = &h->buf[pos % QUEUE_LENGTH];
+
+		if (QUEUE_DIFF(cell->seq, pos + 1) != 0) {
+			break;
+		}
+
+		if (cell->chunk.hudev != NULL)
+		{
+			usbdev_release(cell->chunk.hudev);
+			cell->chunk.hudev = NULL;
+		}
+
+		h->rpos = (LONG)(pos + 1);
+		cell->seq = (LONG)(pos + QUEUE_LENGTH);
+	}
+}
+
+static void queue_wait_empty(HQUEUE hqueue)
+{
+	queue_t * const h = (queue_t*)hqueue;
+
+	for (;;)
+	{
+		if (h->state != 0) {
+			return;
+		}
+
+		InterlockedExchange(&h->eblocked, 1);
+
+		// empty, and the I/O thread is done with the last chunk
+		if (h->rparked != 0 && h->rpos == h->wpos)
+		{
+			h->eblocked = 0;
+			return;
+		}
+
+		WaitForSingleObject(h->heevent, INFINITE);
+	}
+}
+
+static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t const *pdata, size_t ndata)
+{
+	queue_t * const h = (queue_t*)hqueue;
+
+	if (typ == PACKET_TYPE_STATE)
+	{
+		// no data, see lwz_state_schedule()
+
+		pdata = NULL;
+		ndata = 0;
+	}
+	else if (pdata == NULL || ndata == 0 || ndata > sizeof(h->buf[0].chunk.data)) 
+	{
+		// push empty chunk to signal shutdown
+
+		pdata = NULL;
+		ndata = 0;
+		hudev = NULL;
+	}
+
+	if (h->state != 0) {
+		return 0;
+	}
+
+	// claim a free cell
+
+	unsigned long pos;
+	cell_t *cell;
+
+	for (;;)
+	{
+		pos = (unsigned long)h->wpos;
+		cell = &h->buf[pos % QUEUE_LENGTH];
+		MemoryBarrier();
+
+		LONG const diff = QUEUE_DIFF(cell->seq, pos);
+
+		if (diff == 0)
+		{
+			if (InterlockedCompareExchange(&h->wpos, (LONG)(pos + 1), (LONG)pos) == (LONG)pos) {
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			// the queue is full, wait until the consumer reads something
+
+			InterlockedIncrement(&h->wparked);
+
+			if (QUEUE_DIFF(cell->seq, pos) < 0 && h->state == 0) {
+				WaitForSingleObject(h->hrevent, INFINITE);
+			}
+
+			InterlockedDecrement(&h->wparked);
+
+			if (h->state != 0)
+			{
+				SetEvent(h->hrevent);
+				return 0;
+			}
+		}
+	}
+
+	// fill and publish it
+
+	if (hudev != NULL) {
+		usbdev_addref(hudev);
+	}
+
+	cell->chunk.hudev = hudev;
+	cell->chunk.ndata = ndata;
+	cell->chunk.typ = typ;
+	cell->chunk.tpush_us = typ == PACKET_TYPE_RAW ? usbdev_time_us() : 0;
+
+	if (pdata != NULL) {
+		memcpy(&cell->chunk.data[0], pdata, ndata);
+	}
+
+	MemoryBarrier();
+	cell->seq = (LONG)(pos + 1);
+
+	lwz_state_queue_level(h->pstate, (unsigned int)QUEUE_DIFF(pos + 1, h->rpos));
+
+	// wake up the I/O thread, but only if it's actually waiting
+
+	MemoryBarrier();
+	if (h->rparked != 0 && InterlockedExchange(&h->rparked, 0) != 0) {
+		SetEvent(h->hwevent);
+	}
+
+	return ndata;
+}
+
+static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, packet_type_t *ptyp, int64_t *ptpush_us, uint8_t *pbuffer, size_t nsize, DWORD timeout_ms)
+{
+	queue_t * const h = (queue_t*)hqueue;
+
+	if (phudev == NULL || ptyp == NULL || ptpush_us == NULL || pbuffer == NULL || nsize == 0 || nsize < sizeof(h->buf[0].chunk.data)) {
+		return 0;
+	}
+
+	for (;;)
+	{
+		if (h->state != 0) {
+			return 0;
+		}
+
+		unsigned long const pos = (unsigned long)h->rpos;
+		cell_t * const cell = &h->buf[pos % QUEUE_LENGTH];
+
+		if (QUEUE_DIFF(cell->seq, pos + 1) == 0)
+		{
+			MemoryBarrier();
+
+			if (h->rparked != 0) {
+				h->rparked = 0;
+			}
+
+			*phudev = cell->chunk.hudev;
+			*ptyp = cell->chunk.typ;
+			*ptpush_us = cell->chunk.tpush_us;
+			cell->chunk.hudev = NULL;
+
+			size_t const nread = cell->chunk.ndata;
+
+			if (nread > 0) {
+				memcpy(pbuffer, &cell->chunk.data[0], nread);
+			}
+
+			h->rpos = (LONG)(pos + 1);
+
+			MemoryBarrier();
+			cell->seq = (LONG)(pos + QUEUE_LENGTH);
+
+			if (*phudev == NULL) {
+				h->state = 1;
+			}
+
+			// if a writer is blocked (because the queue was full), signal that there is now some free space
+
+			MemoryBarrier();
+			if (h->wparked > 0) {
+				SetEvent(h->hrevent);
+			}
+
+			return nread;
+		}
+
+		// The queue is empty.  Announce that we are going to sleep, then
+		// check again, so that a producer that published in between
+		// either sees the flag or we see its data.
+
+		InterlockedExchange(&h->rparked, 1);
+
+		if (QUEUE_DIFF(cell->seq, pos + 1) == 0) {
+			continue;
+		}
+
+		if (h->eblocked != 0 && InterlockedExchange(&h->eblocked, 0) != 0) {
+			SetEvent(h->heevent);
+		}
+
+		// A producer that takes the flag after the timeout sets the event
+		// for nothing, the next wait then just goes round once more.
+		if (WaitForSingleObject(h->hwevent, timeout_ms) != WAIT_OBJECT_0)
+		{
+			h->rparked = 0;
+			*phudev = NULL;
+			*ptyp = PACKET_TYPE_NONE;
+			return 0;
+		}
+	}
+}
+
+#else
+
+// see queue_stop()
+static void queue_abort(queue_t *h)
+{
+	{
+		AUTOLOCK(h->cs);
+		h->state = 1;
+	}
+
+	// the producers pass the wake-up on to each other, see queue_push()
+	SetEvent(h->hwevent);
+	SetEvent(h->heevent);
+	SetEvent(h->hrevent);
+}
+
+// release the devices of the chunks that were never written
+static void queue_drain(queue_t *h)
+{
+	AUTOLOCK(h->cs);
+
+	while (h->level > 0)
+	{
+		chunk_t * const pc = &h->buf[h->rpos];
+
+		if (pc->hudev != NULL)
+		{
+			usbdev_release(pc->hudev);
+			pc->hudev = NULL;
+		}
+
+		h->rpos = (h->rpos + 1) % QUEUE_LENGTH;
+		h->level -= 1;
+	}
+}
+
 static void queue_wait_empty(HQUEUE hqueue)
 {
 	queue_t * const h = (queue_t*)hqueue;
@@ -1562,7 +4134,14 @@ static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t
 {
 	queue_t * const h = (queue_t*)hqueue;
 
-	if (pdata == NULL || ndata == 0 || ndata > sizeof(h->buf[0].data)) 
+	if (typ == PACKET_TYPE_STATE)
+	{
+		// no data, see lwz_state_schedule()
+
+		pdata = NULL;
+		ndata = 0;
+	}
+	else if (pdata == NULL || ndata == 0 || ndata > sizeof(h->buf[0].data)) 
 	{
 		// push empty chunk to signal shutdown
 
@@ -1581,95 +4160,16 @@ static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t
 		{
 			AUTOLOCK(h->cs);
 
-			if (h->state != 0) {
+			// stopped, also let the next producer that waits know
+			if (h->state != 0)
+			{
+				SetEvent(h->hrevent);
 				return 0;
 			}
 
 			int const nfree = QUEUE_LENGTH - h->level;
-			bool combined = false;
-
-			// If this is a PBA message, overwrite any PBA message already in
-			// the queue with the new message rather than adding the new one
-			// as a separate message.  A PBA overwrites all brightness levels,
-			// so a newer message always supersedes a previous one.  If there's
-			// one in the queue, it means that we haven't even tried sending
-			// the last one to the device yet, so commands are coming faster
-			// than the device can accept them.  It's better to apply the
-			// latest update in this case than to apply all of the intermediate
-			// updates getting here.  This makes fades less smooth, but it's
-			// much better to have the real-time device state match the client
-			// state so that effects aren't delayed from what's going on in the
-			// game.
-			if (typ == PACKET_TYPE_PBA)
-			{
-				for (int i = 0, pos = h->rpos ; i < h->level ;
-					 ++i, pos = (pos + 1) % QUEUE_LENGTH)
-				{
-					chunk_t *chunk = &h->buf[pos];
-					if (chunk->hudev == hudev)
-					{
-						if (chunk->typ == PACKET_TYPE_PBA)
-						{
-							memcpy(chunk->data, pdata, ndata);
-							combined = true;
-							break;
-						}
-					}
-				}
-			}
-
-			// If this is an SBA message, we can overwrite the last SBA in
-			// the queue, but only if there's no PBA following it in the queue.
-			// As with PBA, an SBA message sets all outputs, so each SBA message
-			// effectively wipes out all traces of past SBA messages.  Further,
-			// SBA and PBA messages are orthogonal, so the final state is always
-			// the combination of the last SBA plus the last PBA so far, and isn't
-			// affected by the order of execution of the final SBA and PBA.
-			//
-			// However, SBA and PBA have a subtle interaction that can be visible
-			// to users.  An SBA that turns a port ON does so at the port's last
-			// brightness setting.  Some clients (e.g., DOF) therefore are careful
-			// to set the brightness for a port that's to be newly turned on
-			// *before* turning the switch on - i.e., they send a PBA before
-			// the SBA.  But the client might also have already sent an earlier
-			// SBA that we haven't processed yet.  To handle this case correctly,
-			// we need to make sure that we only overwrite an SBA if there are
-			// no PBA messages later in the queue.
-			if (typ == PACKET_TYPE_SBA)
-			{
-				// search for the last queued SBA not followed by a PBA
-				int last_sba_pos = -1;
-				for (int i = 0, pos = h->rpos ; i < h->level ;
-					 ++i, pos = (pos + 1) % QUEUE_LENGTH)
-				{
-					// If this is an SBA, note it as the last one so far.  If
-					// it's a PBA, forget any previous SBA, since we don't want
-					// to overwrite an SBA followed by a PBA.
-					chunk_t *chunk = &h->buf[pos];
-					if (chunk->hudev == hudev)
-					{
-						if (chunk->typ == PACKET_TYPE_SBA)
-							last_sba_pos = pos;
-						if (chunk->typ == PACKET_TYPE_PBA)
-							last_sba_pos = -1;
-					}
-				}
-
-				// if we found a suitable queued SBA, replace it
-				if (last_sba_pos >= 0)
-				{
-					chunk_t *chunk = &h->buf[last_sba_pos];
-					memcpy(chunk->data, pdata, ndata);
-					combined = true;
-				}
-			}
 
-			if (combined)
-			{
-				// we combined this message with a prior message, so
-				// there's no need to write it separately - we're done
-			}
-			else if (nfree <= 0)
+			if (nfree <= 0)
 			{
 				h->wblocked = true;
 				do_wait = true;
@@ -1685,6 +4185,7 @@ static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t
 				pc->hudev = hudev;
 				pc->ndata = ndata;
 				pc->typ = typ;
+				pc->tpush_us = typ == PACKET_TYPE_RAW ? usbdev_time_us() : 0;
 
 				if (pdata != NULL) {
 					memcpy(&pc->data[0], pdata, ndata);
@@ -1693,6 +4194,8 @@ static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t
 				h->wpos = (h->wpos + 1) % QUEUE_LENGTH;
 				h->level += 1;
 
+				lwz_state_queue_level(h->pstate, h->level);
+
 				h->wblocked = false;
 				do_unblock = h->rblocked;
 			}
@@ -1714,11 +4217,11 @@ static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t
 	}
 }
 
-static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, uint8_t *pbuffer, size_t nsize)
+static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, packet_type_t *ptyp, int64_t *ptpush_us, uint8_t *pbuffer, size_t nsize, DWORD timeout_ms)
 {
 	queue_t * const h = (queue_t*)hqueue;
 
-	if (phudev == NULL || pbuffer == NULL || nsize == 0 || nsize < sizeof(h->buf[0].data)) {
+	if (phudev == NULL || ptyp == NULL || ptpush_us == NULL || pbuffer == NULL || nsize == 0 || nsize < sizeof(h->buf[0].data)) {
 		return 0;
 	}
 
@@ -1751,13 +4254,16 @@ static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, uint8_t *pbuffer, size_t
 				chunk_t * const pc = &h->buf[h->rpos];
 
 				*phudev = pc->hudev;
+				*ptyp = pc->typ;
+				*ptpush_us = pc->tpush_us;
 				pc->hudev = NULL;
 
 				if (pc->ndata > 0) 
 				{
 					memcpy(pbuffer, &pc->data[0], pc->ndata);
 				}
-				else 
+
+				if (*phudev == NULL) 
 				{
 					h->state = 1; 
 				}
@@ -1785,6 +4291,15 @@ static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, uint8_t *pbuffer, size_t
 
 		// if we are here, the queue is empty and we have to wait until the producer writes something
 
-		WaitForSingleObject(h->hwevent, INFINITE);
+		if (WaitForSingleObject(h->hwevent, timeout_ms) != WAIT_OBJECT_0)
+		{
+			AUTOLOCK(h->cs);
+			h->rblocked = false;
+			*phudev = NULL;
+			*ptyp = PACKET_TYPE_NONE;
+			return 0;
+		}
 	}
 }
+
+#endif
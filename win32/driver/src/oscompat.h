@@ -0,0 +1,105 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef OSCOMPAT_H__INCLUDED
+#define OSCOMPAT_H__INCLUDED
+
+// The queueing and device logic of the library is written against the small
+// subset of the Win32 API below (critical sections, auto/manual reset events,
+// threads, tick counts).  On Windows this is just <windows.h>; on other systems
+// oscompat_posix.cpp provides the same calls on top of pthreads, so that
+// ledwiz.cpp and usbdev.cpp can be compiled unchanged for libledwiz.so.
+
+#if defined(_WIN32)
+
+#include <windows.h>
+#include <crtdbg.h>
+
+#else
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+
+#ifndef LWZ_COMPAT_BASETYPES
+#define LWZ_COMPAT_BASETYPES
+typedef void * HWND;
+typedef int BOOL;
+typedef uint32_t DWORD;
+#endif
+
+typedef unsigned char BYTE;
+typedef unsigned char BOOLEAN;
+typedef unsigned short USHORT;
+typedef unsigned int UINT;
+typedef long LONG;
+typedef void * LPVOID;
+typedef void * PVOID;
+typedef void * HANDLE;
+typedef void * HINSTANCE;
+
+#define TRUE  1
+#define FALSE 0
+
+#define WINAPI
+#define INFINITE        0xFFFFFFFF
+#define WAIT_OBJECT_0   0
+#define WAIT_TIMEOUT    258
+
+#define _ASSERT(x)
+#define _TRUNCATE       ((size_t)-1)
+#define _snprintf_s(buf, size, count, ...)  snprintf(buf, size, __VA_ARGS__)
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+void InitializeCriticalSection(CRITICAL_SECTION *pcs);
+void DeleteCriticalSection(CRITICAL_SECTION *pcs);
+void EnterCriticalSection(CRITICAL_SECTION *pcs);
+BOOL TryEnterCriticalSection(CRITICAL_SECTION *pcs);
+void LeaveCriticalSection(CRITICAL_SECTION *pcs);
+
+HANDLE CreateEvent(void *psa, BOOL bManualReset, BOOL bInitialState, char const *pname);
+BOOL SetEvent(HANDLE hevent);
+BOOL ResetEvent(HANDLE hevent);
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID lpParameter);
+HANDLE CreateThread(void *psa, size_t stacksize, LPTHREAD_START_ROUTINE proc, LPVOID param, DWORD flags, DWORD *pthreadid);
+
+DWORD WaitForSingleObject(HANDLE h, DWORD timeout_ms);
+BOOL CloseHandle(HANDLE h);
+
+LONG InterlockedIncrement(LONG volatile *p);
+LONG InterlockedDecrement(LONG volatile *p);
+LONG InterlockedExchange(LONG volatile *p, LONG value);
+LONG InterlockedCompareExchange(LONG volatile *p, LONG exchange, LONG comparand);
+PVOID InterlockedExchangePointer(PVOID volatile *p, PVOID value);
+
+#define MemoryBarrier()     __sync_synchronize()
+#define YieldProcessor()    sched_yield()
+
+typedef struct {
+	int64_t QuadPart;
+} LARGE_INTEGER;
+
+DWORD GetTickCount(void);
+BOOL QueryPerformanceCounter(LARGE_INTEGER *pcount);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *pfreq);
+void Sleep(DWORD ms);
+
+#endif
+
+#endif
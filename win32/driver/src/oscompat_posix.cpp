@@ -0,0 +1,303 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#if !defined(_WIN32)
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "oscompat.h"
+
+
+// Events and threads share one handle type, so that WaitForSingleObject()
+// and CloseHandle() work on both the way they do on Windows.  A thread
+// handle is a manual reset event that is signaled when the thread routine
+// returns.  It is reference counted because the thread itself still
+// touches the handle after the owner may have closed it.
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool manual_reset;
+	bool signaled;
+	LONG refcount;
+
+	// thread handles only
+	bool is_thread;
+	pthread_t thread;
+	LPTHREAD_START_ROUTINE proc;
+	LPVOID param;
+} compat_handle_t;
+
+
+void InitializeCriticalSection(CRITICAL_SECTION *pcs)
+{
+	// Win32 critical sections are recursive; the API relies on that
+	// when a notification callback calls back into the library
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(pcs, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void DeleteCriticalSection(CRITICAL_SECTION *pcs)
+{
+	pthread_mutex_destroy(pcs);
+}
+
+void EnterCriticalSection(CRITICAL_SECTION *pcs)
+{
+	pthread_mutex_lock(pcs);
+}
+
+BOOL TryEnterCriticalSection(CRITICAL_SECTION *pcs)
+{
+	return pthread_mutex_trylock(pcs) == 0 ? TRUE : FALSE;
+}
+
+void LeaveCriticalSection(CRITICAL_SECTION *pcs)
+{
+	pthread_mutex_unlock(pcs);
+}
+
+static compat_handle_t * handle_alloc(bool manual_reset, bool initial_state)
+{
+	compat_handle_t * const h = (compat_handle_t*)malloc(sizeof(compat_handle_t));
+
+	if (h == NULL)
+		return NULL;
+
+	memset(h, 0x00, sizeof(*h));
+
+	// use the monotonic clock for timed waits, like GetTickCount()
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&h->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_mutex_init(&h->mutex, NULL);
+
+	h->manual_reset = manual_reset;
+	h->signaled = initial_state;
+	h->refcount = 1;
+
+	return h;
+}
+
+static void handle_release(compat_handle_t *h)
+{
+	if (InterlockedDecrement(&h->refcount) <= 0)
+	{
+		pthread_cond_destroy(&h->cond);
+		pthread_mutex_destroy(&h->mutex);
+		free(h);
+	}
+}
+
+HANDLE CreateEvent(void *psa, BOOL bManualReset, BOOL bInitialState, char const *pname)
+{
+	return handle_alloc(bManualReset != FALSE, bInitialState != FALSE);
+}
+
+BOOL SetEvent(HANDLE hevent)
+{
+	compat_handle_t * const h = (compat_handle_t*)hevent;
+
+	if (h == NULL)
+		return FALSE;
+
+	pthread_mutex_lock(&h->mutex);
+	h->signaled = true;
+	if (h->manual_reset)
+		pthread_cond_broadcast(&h->cond);
+	else
+		pthread_cond_signal(&h->cond);
+	pthread_mutex_unlock(&h->mutex);
+
+	return TRUE;
+}
+
+BOOL ResetEvent(HANDLE hevent)
+{
+	compat_handle_t * const h = (compat_handle_t*)hevent;
+
+	if (h == NULL)
+		return FALSE;
+
+	pthread_mutex_lock(&h->mutex);
+	h->signaled = false;
+	pthread_mutex_unlock(&h->mutex);
+
+	return TRUE;
+}
+
+DWORD WaitForSingleObject(HANDLE hobject, DWORD timeout_ms)
+{
+	compat_handle_t * const h = (compat_handle_t*)hobject;
+
+	if (h == NULL)
+		return WAIT_TIMEOUT;
+
+	struct timespec deadline;
+	if (timeout_ms != INFINITE)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	DWORD result = WAIT_OBJECT_0;
+
+	pthread_mutex_lock(&h->mutex);
+
+	while (!h->signaled)
+	{
+		if (timeout_ms == INFINITE)
+		{
+			pthread_cond_wait(&h->cond, &h->mutex);
+		}
+		else if (pthread_cond_timedwait(&h->cond, &h->mutex, &deadline) == ETIMEDOUT)
+		{
+			result = h->signaled ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+			break;
+		}
+	}
+
+	if (result == WAIT_OBJECT_0 && !h->manual_reset)
+		h->signaled = false;
+
+	pthread_mutex_unlock(&h->mutex);
+
+	return result;
+}
+
+static void * thread_trampoline(void *param)
+{
+	compat_handle_t * const h = (compat_handle_t*)param;
+
+	h->proc(h->param);
+
+	SetEvent(h);
+	handle_release(h);
+
+	return NULL;
+}
+
+HANDLE CreateThread(void *psa, size_t stacksize, LPTHREAD_START_ROUTINE proc, LPVOID param, DWORD flags, DWORD *pthreadid)
+{
+	compat_handle_t * const h = handle_alloc(true, false);
+
+	if (h == NULL)
+		return NULL;
+
+	h->is_thread = true;
+	h->proc = proc;
+	h->param = param;
+	h->refcount = 2; // one for the caller, one for the thread
+
+	if (pthread_create(&h->thread, NULL, thread_trampoline, h) != 0)
+	{
+		h->refcount = 1;
+		handle_release(h);
+		return NULL;
+	}
+
+	// nobody joins, waiting is done on the handle like on Windows
+	pthread_detach(h->thread);
+
+	return h;
+}
+
+BOOL CloseHandle(HANDLE hobject)
+{
+	compat_handle_t * const h = (compat_handle_t*)hobject;
+
+	if (h == NULL)
+		return FALSE;
+
+	handle_release(h);
+
+	return TRUE;
+}
+
+LONG InterlockedIncrement(LONG volatile *p)
+{
+	return __sync_add_and_fetch(p, 1);
+}
+
+LONG InterlockedDecrement(LONG volatile *p)
+{
+	return __sync_sub_and_fetch(p, 1);
+}
+
+LONG InterlockedExchange(LONG volatile *p, LONG value)
+{
+	return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+LONG InterlockedCompareExchange(LONG volatile *p, LONG exchange, LONG comparand)
+{
+	return __sync_val_compare_and_swap(p, comparand, exchange);
+}
+
+PVOID InterlockedExchangePointer(PVOID volatile *p, PVOID value)
+{
+	return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+DWORD GetTickCount(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (DWORD)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// the performance counter counts nanoseconds of the monotonic clock
+BOOL QueryPerformanceCounter(LARGE_INTEGER *pcount)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pcount->QuadPart = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *pfreq)
+{
+	pfreq->QuadPart = 1000000000;
+	return TRUE;
+}
+
+void Sleep(DWORD ms)
+{
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef PBXPACK_H__INCLUDED
+#define PBXPACK_H__INCLUDED
+
+// Packing of LedWiz brightness levels into the payload of Pinscape PBX
+// messages: 8 ports in 6 bytes, 6 bits per port.  The LedWiz flash codes
+// have to be translated to fit: 129->60, 130->61, 131->62, 132->63.
+//
+// lwz_pbx_pack() does 16 ports at a time with SSE2 or NEON where the
+// compiler has it and falls back to lwz_pbx_pack_scalar() otherwise.  Both
+// are here, and not in ledwiz.cpp, so that lwzbench can check that they
+// give the same result and time them.
+
+#if defined(_MSC_VER) && (_MSC_VER < 1600) // stdint.h is available starting with VisualStudio 2010
+typedef unsigned char uint8_t;
+typedef unsigned int uint32_t;
+#else
+#include <stdint.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PBXPACK_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#define PBXPACK_NEON
+#include <arm_neon.h>
+#endif
+
+
+// Pack 'nblocks' blocks of 8 brightness levels into 'nblocks' * 6 bytes.
+static inline void lwz_pbx_pack_scalar(uint8_t *pdst, uint8_t const *psrc, int nblocks)
+{
+	for (int block = 0 ; block < nblocks ; ++block, psrc += 8, pdst += 6)
+	{
+		uint8_t tmp[8];
+		for (int i = 0 ; i < 8 ; ++i)
+			tmp[i] = (psrc[i] >= 129 ? psrc[i] - 129 + 60 : psrc[i]) & 0x3F;
+
+		// pack the first four brightness values into tmp1, the next four into tmp2
+		unsigned int tmp1 = tmp[0] | (tmp[1]<<6) | (tmp[2]<<12) | (tmp[3]<<18);
+		unsigned int tmp2 = tmp[4] | (tmp[5]<<6) | (tmp[6]<<12) | (tmp[7]<<18);
+
+		pdst[0] = tmp1 & 0xFF;
+		pdst[1] = (tmp1 >> 8) & 0xFF;
+		pdst[2] = (tmp1 >> 16) & 0xFF;
+		pdst[3] = tmp2 & 0xFF;
+		pdst[4] = (tmp2 >> 8) & 0xFF;
+		pdst[5] = (tmp2 >> 16) & 0xFF;
+	}
+}
+
+// Same as above.  Each 32 bit lane of the vector ends up with the 24 bits
+// of four ports: the bytes are merged in pairs into 12 bits per 16 bit
+// lane, and those pairs into 24 bits.  Neither SSE2 nor NEON has a cheap
+// way to drop the top byte of each lane, so that is left to the stores.
+static inline void lwz_pbx_pack(uint8_t *pdst, uint8_t const *psrc, int nblocks)
+{
+	#if defined(PBXPACK_SSE2) || defined(PBXPACK_NEON)
+
+	for ( ; nblocks >= 2 ; nblocks -= 2, psrc += 16, pdst += 12)
+	{
+		uint32_t lanes[4];
+
+		#if defined(PBXPACK_SSE2)
+
+		__m128i v = _mm_loadu_si128((__m128i const *)psrc);
+
+		// there is no unsigned compare, v >= 129 is max(v, 129) == v
+		__m128i const flash = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8((char)129)), v);
+		v = _mm_sub_epi8(v, _mm_and_si128(flash, _mm_set1_epi8(129 - 60)));
+		v = _mm_and_si128(v, _mm_set1_epi8(0x3F));
+
+		v = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi16(0x003F)), _mm_and_si128(_mm_srli_epi16(v, 2), _mm_set1_epi16(0x0FC0)));
+		v = _mm_or_si128(_mm_and_si128(v, _mm_set1_epi32(0x000FFF)), _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi32(0xFFF000)));
+
+		_mm_storeu_si128((__m128i *)lanes, v);
+
+		#else
+
+		uint8x16_t v8 = vld1q_u8(psrc);
+
+		uint8x16_t const flash = vcgeq_u8(v8, vdupq_n_u8(129));
+		v8 = vsubq_u8(v8, vandq_u8(flash, vdupq_n_u8(129 - 60)));
+		v8 = vandq_u8(v8, vdupq_n_u8(0x3F));
+
+		uint16x8_t v16 = vreinterpretq_u16_u8(v8);
+		v16 = vorrq_u16(vandq_u16(v16, vdupq_n_u16(0x003F)), vandq_u16(vshrq_n_u16(v16, 2), vdupq_n_u16(0x0FC0)));
+
+		uint32x4_t v32 = vreinterpretq_u32_u16(v16);
+		v32 = vorrq_u32(vandq_u32(v32, vdupq_n_u32(0x000FFF)), vandq_u32(vshrq_n_u32(v32, 4), vdupq_n_u32(0xFFF000)));
+
+		vst1q_u32(lanes, v32);
+
+		#endif
+
+		for (int i = 0 ; i < 4 ; ++i)
+		{
+			pdst[i * 3 + 0] = lanes[i] & 0xFF;
+			pdst[i * 3 + 1] = (lanes[i] >> 8) & 0xFF;
+			pdst[i * 3 + 2] = (lanes[i] >> 16) & 0xFF;
+		}
+	}
+
+	#endif
+
+	lwz_pbx_pack_scalar(pdst, psrc, nblocks);
+}
+
+#endif
@@ -16,9 +16,21 @@
  *   59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
-#include <crtdbg.h>
-#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <time.h>
+#include <errno.h>
+#endif
+
+#include "oscompat.h"
 #include "usbdev.h"
+#include "usbdev_transport.h"
+
+#if defined(_WIN32)
+#include <mmsystem.h>
+#endif
 
 
 static void usbdev_close_internal(HUDEV hudev);
@@ -30,6 +42,16 @@ static void usbdev_close_internal(HUDEV hudev);
 // minimum interval between consecutive writes for a real LedWiz unit, in milliseconds
 #define LEDWIZ_MIN_WRITE_INTERVAL_MS    5
 
+// keep several writes in flight for devices that don't need pacing
+#define USE_PIPELINED_WRITES
+
+// adaptive pacing (see usbdev_set_write_interval_range()): the interval is
+// doubled after a failed write, and lowered by a quarter after this many
+// clean writes in a row
+#define PACING_CLEAN_WRITES             128
+#define PACING_MIN_STEP_US              250
+#define PACING_STALL_FACTOR             4      // a write that takes this much longer than average isn't clean
+
 
 struct CAutoLockCS  // helper class to lock a critical section, and unlock it automatically
 {
@@ -44,9 +66,9 @@ struct CAutoLockCS  // helper class to lock a critical section, and unlock it au
 
 typedef struct {
 	CRITICAL_SECTION cslock;
-	HANDLE hrevent;
-	HANDLE hwevent;
-	HANDLE hdev;
+	CRITICAL_SECTION csread;	// reads have their own lock, so that waiting for input doesn't hold up writes
+	usbdev_transport_t const *ptransport;
+	HUIO hio;
 	LONG refcount;
 
 	// The firmware in real LedWiz units seems to have a serious bug
@@ -85,12 +107,373 @@ typedef struct {
 	// For a real LedWiz, the timing should be 5 to 10 ms.  For 
 	// an emulator, it can be 0 ms.
 
-	DWORD last_write_ticks;				// system tick count (milliseconds) at time of last write operation
-	unsigned int min_write_interval;	// minimum delay time between consecutive writes
+	// The tick count and Sleep() have a granularity of 10-16 ms on most
+	// systems, which turns the 5 ms of a LedWiz into 15 ms.  The interval
+	// is measured with the performance counter instead, and the wait is
+	// done with a high resolution timer (see usbdev_wait_until()).
+
+	int64_t last_write_us;				// performance counter (microseconds) at time of last write operation
+	unsigned int write_interval_us;		// minimum delay time between consecutive writes, in microseconds
+
+	// Devices we don't know anything about get a range instead of a fixed
+	// interval, and the interval is learned from how the writes go: it
+	// backs off when a write fails, and creeps down towards the lower
+	// bound while the writes succeed and take about the usual time.
+	unsigned int interval_min_us;		// bounds for the adaptive interval, equal for a fixed one
+	unsigned int interval_max_us;
+	unsigned int nclean_writes;			// successful writes since the last change
+	unsigned int write_latency_us;		// running average of the write completion time
+
+	usbdev_stats_t stats;				// see usbdev_get_stats()
+
+	#if defined(_WIN32)
+	HANDLE htimer;						// waitable timer for the pacing
+	bool htimer_hires;					// it is a high resolution timer
+	bool period_set;					// timeBeginPeriod(1) is in effect for the pacing, see usbdev_wait_until()
+	#endif
+
+	// Devices without a minimum interval don't have to wait for one report
+	// to complete before the next one is sent.  With the transport's
+	// write_async() up to USBDEV_MAX_PENDING_WRITES are kept in flight, so
+	// the rate depends on the host controller rather than on the round
+	// trip of each write.
+	bool writes_pending;				// write_async() was used since the last flush
+
+	volatile LONG cancelled;			// see usbdev_cancel_writes()
 } usbdev_context_t;
 
+static bool usbdev_flush_internal(usbdev_context_t *h);
+
+
+int64_t usbdev_time_us(void)
+{
+	static LARGE_INTEGER freq = { 0 };
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+
+	return (int64_t)(t.QuadPart / freq.QuadPart) * 1000000 +
+		(int64_t)(t.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
+
+void usbdev_latency_add(unsigned int *phist, int64_t latency_us)
+{
+	uint64_t const v = latency_us > 0 ? (uint64_t)latency_us : 0;
+
+	int i;
+
+	if (v < 8)
+	{
+		i = (int)v;
+	}
+	else
+	{
+		// the top 4 bits of the value give the bucket
+		int msb = 3;
+		while ((v >> (msb + 1)) != 0)
+			msb++;
+
+		int const shift = msb - 3;
+		i = (shift + 1) * 8 + (int)(v >> shift) - 8;
+	}
+
+	if (i >= USBDEV_LATENCY_BUCKETS)
+		i = USBDEV_LATENCY_BUCKETS - 1;
+
+	phist[i] += 1;
+}
+
+// block until the performance counter reaches the given time
+static void usbdev_wait_until(usbdev_context_t *h, int64_t t_us)
+{
+	#if defined(_WIN32)
+
+	// Without a high resolution timer the waits have the resolution of
+	// the system timer, 15.6 ms by default.  It is set to 1 ms while the
+	// device is paced, until it is released.
+	if (!h->htimer_hires && !h->period_set)
+		h->period_set = timeBeginPeriod(1) == TIMERR_NOERROR;
+
+	// the timer may fire a bit early, so check against the counter
+	for (;;)
+	{
+		int64_t const dt = t_us - usbdev_time_us();
+
+		if (dt <= 0)
+			break;
+
+		if (h->htimer == NULL)
+		{
+			Sleep((DWORD)((dt + 999) / 1000));
+			continue;
+		}
+
+		LARGE_INTEGER due;
+		due.QuadPart = -dt * 10; // relative, in 100 ns units
+
+		if (!SetWaitableTimer(h->htimer, &due, 0, NULL, NULL, FALSE))
+		{
+			Sleep((DWORD)((dt + 999) / 1000));
+			continue;
+		}
+
+		WaitForSingleObject(h->htimer, INFINITE);
+	}
+
+	#else
+
+	// the performance counter is CLOCK_MONOTONIC (see oscompat_posix.cpp)
+	struct timespec ts;
+	ts.tv_sec = (time_t)(t_us / 1000000);
+	ts.tv_nsec = (long)(t_us % 1000000) * 1000L;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+
+	#endif
+}
+
+
+// the transport for the platform we are running on, or the simulated
+// devices if LWZ_SIMULATE is set (see usbdev_sim.cpp)
+static usbdev_transport_t const * usbdev_transport(void)
+{
+	static usbdev_transport_t const *ptransport = NULL;
+
+	if (ptransport == NULL)
+	{
+		char const *spec = getenv("LWZ_SIMULATE");
+
+		if (spec != NULL && *spec != '\0')
+			ptransport = &usbdev_transport_sim;
+		else
+		#if defined(_WIN32)
+			ptransport = &usbdev_transport_win32;
+		#else
+			ptransport = &usbdev_transport_hidraw;
+		#endif
+	}
+
+	return ptransport;
+}
+
+// enumeration cache, see usbdev_cache_create()
+
+typedef struct {
+	usbdev_info_t info;
+	unsigned int seen;                  // serial of the last enumeration that listed it
+} usbdev_cache_entry_t;
+
+typedef struct {
+	CRITICAL_SECTION cs;                // only held for lookups and updates, never for I/O
+	unsigned int serial;
+	int count;
+	int size;
+	usbdev_cache_entry_t *pentries;
+} usbdev_cache_t;
+
+typedef struct {
+	usbdev_cache_t *pcache;
+	unsigned int serial;
+	usbdev_enum_proc proc;
+	void *puser;
+} usbdev_enum_t;
+
+HUCACHE usbdev_cache_create(void)
+{
+	usbdev_cache_t * const h = (usbdev_cache_t*)malloc(sizeof(usbdev_cache_t));
+
+	if (h == NULL)
+		return NULL;
+
+	memset(h, 0x00, sizeof(*h));
+	InitializeCriticalSection(&h->cs);
+
+	return h;
+}
+
+void usbdev_cache_free(HUCACHE hcache)
+{
+	usbdev_cache_t * const h = (usbdev_cache_t*)hcache;
+
+	if (h == NULL)
+		return;
+
+	DeleteCriticalSection(&h->cs);
+	free(h->pentries);
+	free(h);
+}
+
+// with the cache lock held
+static void usbdev_cache_remove(usbdev_cache_t *h, int i)
+{
+	h->pentries[i] = h->pentries[h->count - 1];
+	h->count--;
+}
+
+void usbdev_cache_forget(HUCACHE hcache, char const *devicepath)
+{
+	usbdev_cache_t * const h = (usbdev_cache_t*)hcache;
+
+	if (h == NULL)
+		return;
+
+	AUTOLOCK(h->cs);
+
+	for (int i = h->count - 1; i >= 0; i--)
+	{
+		if (strcmp(h->pentries[i].info.path, devicepath) == 0)
+			usbdev_cache_remove(h, i);
+	}
+}
+
+static bool usbdev_cache_lookup(usbdev_cache_t *h, unsigned int serial, usbdev_info_t *pinfo)
+{
+	AUTOLOCK(h->cs);
+
+	for (int i = 0; i < h->count; i++)
+	{
+		usbdev_cache_entry_t * const pentry = &h->pentries[i];
+
+		if (strcmp(pentry->info.path, pinfo->path) == 0 &&
+			strcmp(pentry->info.container_id, pinfo->container_id) == 0)
+		{
+			if ((int)(serial - pentry->seen) > 0)
+				pentry->seen = serial;
+
+			*pinfo = pentry->info;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void usbdev_cache_store(usbdev_cache_t *h, unsigned int serial, usbdev_info_t const *pinfo)
+{
+	AUTOLOCK(h->cs);
+
+	// replace what is known about the path, another interface at it is
+	// gone; a concurrent enumeration may have listed it later than us
+	for (int i = h->count - 1; i >= 0; i--)
+	{
+		if (strcmp(h->pentries[i].info.path, pinfo->path) == 0)
+		{
+			if ((int)(h->pentries[i].seen - serial) > 0)
+				serial = h->pentries[i].seen;
+
+			usbdev_cache_remove(h, i);
+		}
+	}
+
+	if (h->count == h->size)
+	{
+		int const size = h->size > 0 ? h->size * 2 : 32;
+		usbdev_cache_entry_t * const pentries = (usbdev_cache_entry_t*)realloc(h->pentries, size * sizeof(usbdev_cache_entry_t));
+
+		if (pentries == NULL)
+			return;
+
+		h->pentries = pentries;
+		h->size = size;
+	}
+
+	h->pentries[h->count].info = *pinfo;
+	h->pentries[h->count].seen = serial;
+	h->count++;
+}
+
+static void usbdev_enum_list_proc(void *puser, char const *devicepath, char const *container_id)
+{
+	usbdev_enum_t * const pe = (usbdev_enum_t*)puser;
+
+	if (strlen(devicepath) >= USBDEV_MAX_PATH)
+		return;
+
+	usbdev_info_t info;
+	memset(&info, 0x00, sizeof(info));
+	strcpy(info.path, devicepath);
+	strncpy(info.container_id, container_id, sizeof(info.container_id) - 1);
+
+	if (pe->pcache == NULL || !usbdev_cache_lookup(pe->pcache, pe->serial, &info))
+	{
+		if (!usbdev_transport()->query(&info))
+			return;
+
+		// Interfaces that can't be opened are not remembered; on Linux
+		// the permissions of a new node may not be set up yet.
+		if (pe->pcache != NULL)
+			usbdev_cache_store(pe->pcache, pe->serial, &info);
+	}
+
+	pe->proc(pe->puser, &info);
+}
+
+void usbdev_enumerate(HUCACHE hcache, usbdev_enum_proc proc, void *puser)
+{
+	usbdev_enum_t e;
+	e.pcache = (usbdev_cache_t*)hcache;
+	e.serial = 0;
+	e.proc = proc;
+	e.puser = puser;
+
+	if (e.pcache != NULL)
+	{
+		AUTOLOCK(e.pcache->cs);
+		e.serial = ++e.pcache->serial;
+	}
+
+	usbdev_transport()->enumerate(usbdev_enum_list_proc, &e);
+
+	// drop what wasn't listed, it has been unplugged
+	if (e.pcache != NULL)
+	{
+		AUTOLOCK(e.pcache->cs);
+
+		for (int i = e.pcache->count - 1; i >= 0; i--)
+		{
+			if ((int)(e.serial - e.pcache->pentries[i].seen) > 0)
+				usbdev_cache_remove(e.pcache, i);
+		}
+	}
+}
+
+bool usbdev_exists(char const *devicepath)
+{
+	usbdev_transport_t const * const ptransport = usbdev_transport();
+
+	HUIO hio = ptransport->open(devicepath);
+
+	if (hio == NULL)
+		return false;
+
+	ptransport->close(hio);
+
+	return true;
+}
+
+void * usbdev_hotplug_start(usbdev_hotplug_proc proc, void *puser)
+{
+	usbdev_transport_t const * const ptransport = usbdev_transport();
+
+	if (ptransport->hotplug_start == NULL)
+		return NULL;
+
+	return ptransport->hotplug_start(proc, puser);
+}
 
-HUDEV usbdev_create(LPCSTR devicepath)
+void usbdev_hotplug_stop(void *hmonitor)
+{
+	usbdev_transport_t const * const ptransport = usbdev_transport();
+
+	if (hmonitor != NULL && ptransport->hotplug_stop != NULL)
+		ptransport->hotplug_stop(hmonitor);
+}
+
+HUDEV usbdev_create(char const *devicepath)
 {
 	// create context
 
@@ -100,55 +483,220 @@ HUDEV usbdev_create(LPCSTR devicepath)
 		return NULL;
 
 	memset(h, 0x00, sizeof(*h));
-	h->hdev = INVALID_HANDLE_VALUE;
 
 	// presume this is a real LedWiz, so set the minimum write interval
-	h->min_write_interval = LEDWIZ_MIN_WRITE_INTERVAL_MS;
-	h->last_write_ticks = GetTickCount();
+	h->write_interval_us = LEDWIZ_MIN_WRITE_INTERVAL_MS * 1000;
+	h->interval_min_us = h->write_interval_us;
+	h->interval_max_us = h->write_interval_us;
+	h->last_write_us = usbdev_time_us();
 
 	InitializeCriticalSection(&h->cslock);
+	InitializeCriticalSection(&h->csread);
 
-	h->hrevent = CreateEvent(NULL, TRUE, FALSE, NULL);
-	h->hwevent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	#if defined(_WIN32)
+	// high resolution timers need Windows 10 1803, older systems get a
+	// regular one (and the system timer at 1 ms, see usbdev_wait_until())
+	#if !defined(CREATE_WAITABLE_TIMER_HIGH_RESOLUTION)
+	#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION  0x00000002
+	#endif
 
-	if (h->hrevent == NULL ||
-		h->hwevent == NULL)
-	{
-		goto Failed;
-	}
+	// CreateWaitableTimerExW() is Vista and later, it is looked up so
+	// that the DLL still loads on XP
+	typedef HANDLE (WINAPI *create_timer_ex_t)(LPSECURITY_ATTRIBUTES, LPCWSTR, DWORD, DWORD);
+
+	create_timer_ex_t const create_timer_ex = (create_timer_ex_t)GetProcAddress(
+		GetModuleHandleA("kernel32.dll"), "CreateWaitableTimerExW");
+
+	if (create_timer_ex != NULL)
+		h->htimer = create_timer_ex(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+	h->htimer_hires = h->htimer != NULL;
+
+	if (h->htimer == NULL)
+		h->htimer = CreateWaitableTimer(NULL, TRUE, NULL);
+	#endif
 
 	// open device
 
-	HANDLE hdev  = CreateFileA(
-		devicepath,
-		GENERIC_READ | GENERIC_WRITE,
-		FILE_SHARE_READ | FILE_SHARE_WRITE,
-		NULL,
-		OPEN_EXISTING,
-		FILE_FLAG_OVERLAPPED,
-		NULL);
+	h->ptransport = usbdev_transport();
+	h->hio = h->ptransport->open(devicepath);
 
-	if (hdev != INVALID_HANDLE_VALUE)
+	if (h->hio != NULL)
 	{
-		h->hdev = hdev;
 		h->refcount = 1;
 		return h;
 	}
 
-	Failed:
 	usbdev_close_internal(h);
 	return NULL;
 }
 
+// change the interval, pacing starts after what is in flight
+static void usbdev_set_interval_internal(usbdev_context_t *h, unsigned int interval_us)
+{
+	if (interval_us > 0 && h->write_interval_us == 0)
+		usbdev_flush_internal(h);
+
+	h->write_interval_us = interval_us;
+	h->nclean_writes = 0;
+}
+
 void usbdev_set_min_write_interval(HUDEV hudev, unsigned int interval_ms)
+{
+	usbdev_set_write_interval_range(hudev, interval_ms * 1000, interval_ms * 1000);
+}
+
+void usbdev_set_write_interval_range(HUDEV hudev, unsigned int min_us, unsigned int max_us)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+	if (h != NULL)
+	{
+		AUTOLOCK(h->cslock);
+
+		h->interval_min_us = min_us;
+		h->interval_max_us = max_us > min_us ? max_us : min_us;
+
+		// start from the current interval, within the new bounds
+		unsigned int interval_us = h->write_interval_us;
+		if (interval_us < h->interval_min_us)
+			interval_us = h->interval_min_us;
+		if (interval_us > h->interval_max_us)
+			interval_us = h->interval_max_us;
+
+		usbdev_set_interval_internal(h, interval_us);
+	}
+}
+
+void usbdev_get_stats(HUDEV hudev, usbdev_stats_t *pstats, bool reset)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+
+	memset(pstats, 0x00, sizeof(*pstats));
+
+	if (h != NULL)
+	{
+		AUTOLOCK(h->cslock);
+
+		// the pipelined writes are counted as they complete, wait for
+		// the ones still in flight
+		if (h->hio != NULL)
+			usbdev_flush_internal(h);
+
+		*pstats = h->stats;
+
+		if (reset)
+			memset(&h->stats, 0x00, sizeof(h->stats));
+	}
+}
+
+void usbdev_get_write_timing(HUDEV hudev, unsigned int *pinterval_us, unsigned int *platency_us)
 {
 	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+
+	*pinterval_us = 0;
+	*platency_us = 0;
+
 	if (h != NULL)
 	{
-		h->min_write_interval = interval_ms;
+		AUTOLOCK(h->cslock);
+
+		*pinterval_us = h->write_interval_us;
+		*platency_us = h->write_latency_us;
 	}
 }
 
+// Learn from the outcome of a write.  The latency is the time the
+// write took to complete, or -1 if it isn't known (pipelined writes).
+static void usbdev_adapt_interval(usbdev_context_t *h, bool ok, int64_t latency_us)
+{
+	bool stalled = false;
+
+	if (ok && latency_us >= 0)
+	{
+		if (h->write_latency_us > 0 &&
+			latency_us > (int64_t)h->write_latency_us * PACING_STALL_FACTOR + 1000)
+		{
+			stalled = true;
+		}
+
+		h->write_latency_us = h->write_latency_us == 0 ?
+			(unsigned int)latency_us :
+			(unsigned int)(h->write_latency_us + (latency_us - (int64_t)h->write_latency_us) / 8);
+	}
+
+	if (h->interval_min_us == h->interval_max_us)
+		return;
+
+	if (!ok)
+	{
+		// back off quickly
+		unsigned int interval_us = h->write_interval_us * 2;
+		if (interval_us < PACING_MIN_STEP_US * 4)
+			interval_us = PACING_MIN_STEP_US * 4;
+		if (interval_us > h->interval_max_us)
+			interval_us = h->interval_max_us;
+
+		usbdev_set_interval_internal(h, interval_us);
+	}
+	else if (stalled)
+	{
+		// the device may be struggling, or we were just not scheduled
+		// in time; either way don't go faster yet
+		h->nclean_writes = 0;
+	}
+	else if (++h->nclean_writes >= PACING_CLEAN_WRITES && h->write_interval_us > h->interval_min_us)
+	{
+		// and come down slowly
+		unsigned int step_us = h->write_interval_us / 4;
+		if (step_us < PACING_MIN_STEP_US)
+			step_us = PACING_MIN_STEP_US;
+
+		unsigned int interval_us = h->write_interval_us > h->interval_min_us + step_us ?
+			h->write_interval_us - step_us : h->interval_min_us;
+
+		usbdev_set_interval_internal(h, interval_us);
+	}
+}
+
+// A pipelined write has completed, see write_async().  The transport
+// calls this from within usbdev_write() or a flush, with the lock held.
+static void usbdev_write_done(void *puser, int64_t latency_us, bool ok, bool timed_out)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)puser;
+
+	usbdev_latency_add(h->stats.write_hist, latency_us);
+
+	if (ok)
+		h->stats.written += 1;
+	else
+		h->stats.failed += 1;
+
+	if (timed_out)
+		h->stats.timed_out += 1;
+}
+
+static bool usbdev_flush_internal(usbdev_context_t *h)
+{
+	if (!h->writes_pending)
+		return true;
+
+	h->writes_pending = false;
+
+	return h->ptransport->write_flush(h->hio, USB_WRITE_TIMEOUT_MS, usbdev_write_done, h);
+}
+
+bool usbdev_flush(HUDEV hudev)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+
+	if (h == NULL)
+		return false;
+
+	AUTOLOCK(h->cslock);
+
+	return usbdev_flush_internal(h);
+}
+
 static void usbdev_close_internal(HUDEV hudev)
 {
 	usbdev_context_t * const h = (usbdev_context_t*)hudev;
@@ -156,24 +704,28 @@ static void usbdev_close_internal(HUDEV hudev)
 	if (h == NULL)
 		return;
 
-	if (h->hrevent)
+	if (h->hio != NULL)
 	{
-		CloseHandle(h->hrevent);
-		h->hrevent = NULL;
+		usbdev_flush_internal(h);
+		h->ptransport->close(h->hio);
+		h->hio = NULL;
 	}
 
-	if (h->hwevent)
+	#if defined(_WIN32)
+	if (h->htimer != NULL)
 	{
-		CloseHandle(h->hwevent);
-		h->hwevent = NULL;
+		CloseHandle(h->htimer);
+		h->htimer = NULL;
 	}
 
-	if (h->hdev != INVALID_HANDLE_VALUE)
+	if (h->period_set)
 	{
-		CloseHandle(h->hdev);
-		h->hdev = INVALID_HANDLE_VALUE;
+		timeEndPeriod(1);
+		h->period_set = false;
 	}
+	#endif
 
+	DeleteCriticalSection(&h->csread);
 	DeleteCriticalSection(&h->cslock);
 
 	free(h);
@@ -204,22 +756,17 @@ void usbdev_addref(HUDEV hudev)
 	}
 }
 
-HANDLE usbdev_handle(HUDEV hudev)
+size_t usbdev_read(HUDEV hudev, void *psrc, size_t ndata)
 {
-	usbdev_context_t * const h = (usbdev_context_t*)hudev;
-
-	if (h == NULL)
-		return INVALID_HANDLE_VALUE;
-
-	return h->hdev;
+	return usbdev_read_timeout(hudev, psrc, ndata, USB_READ_TIMEOUT_MS);
 }
 
-size_t usbdev_read(HUDEV hudev, void *psrc, size_t ndata)
+size_t usbdev_read_timeout(HUDEV hudev, void *psrc, size_t ndata, unsigned int timeout_ms)
 {
 	usbdev_context_t * const h = (usbdev_context_t*)hudev;
 
 	if (h == NULL)
-		return NULL;
+		return 0;
 
 	BYTE * pdata = (BYTE*)psrc;
 
@@ -229,49 +776,13 @@ size_t usbdev_read(HUDEV hudev, void *psrc, size_t ndata)
 	if (ndata > 64)
 		ndata = 64;
 
-	AUTOLOCK(h->cslock);
+	AUTOLOCK(h->csread);
 
-	int res = 0;
 	BYTE buffer[65];
-	DWORD nread = 0;
-	BOOL bres = FALSE;
-
-	OVERLAPPED ol = {};
-	ol.hEvent = h->hrevent;
 
-	bres = ReadFile(h->hdev, buffer, ndata + 1, NULL, &ol);
-
-	if (bres != TRUE)
-	{
-		DWORD dwerror = GetLastError();
-
-		if (dwerror == ERROR_IO_PENDING)
-		{
-			if (WaitForSingleObject(h->hrevent, USB_READ_TIMEOUT_MS) != WAIT_OBJECT_0)
-			{
-				CancelIo(h->hdev);
-			}
+	size_t nread = h->ptransport->read(h->hio, buffer, ndata + 1, timeout_ms);
 
-			bres = TRUE;
-		}
-	}
-
-	if (bres == TRUE)
-	{
-		bres = GetOverlappedResult(
-			h->hdev,
-			&ol,
-			&nread,
-			TRUE);
-	}
-
-	if (bres != TRUE)
-	{
-		DWORD dwerror = GetLastError();
-		_ASSERT(0);
-	}
-
-	if (nread <= 1 || bres != TRUE)
+	if (nread <= 1)
 		return 0;
 
 	nread -= 1; // skip report id
@@ -291,7 +802,7 @@ size_t usbdev_read(HUDEV hudev, void *psrc, size_t ndata)
 void usbdev_clear_input(HUDEV hudev, size_t input_rpt_len)
 {
 	usbdev_context_t * const h = (usbdev_context_t*)hudev;
-	AUTOLOCK(h->cslock);
+	AUTOLOCK(h->csread);
 	for (int i = 0 ; i < 64 ; ++i)
 	{
 		// make sure the requested length is within range
@@ -299,31 +810,10 @@ void usbdev_clear_input(HUDEV hudev, size_t input_rpt_len)
 		if (input_rpt_len > sizeof(buffer))
 			input_rpt_len = sizeof(buffer);
 
-		// start a non-blocking read
-		OVERLAPPED ol = {};
-		ol.hEvent = h->hrevent;
-		if (ReadFile(h->hdev, buffer, input_rpt_len, NULL, &ol))
-		{
-			// success - get the result to complete the I/O, then keep
-			// going, since the point is to clear buffered input
-			DWORD nread;
-			GetOverlappedResult(h->hdev, &ol, &nread, TRUE);
-		}
-		else
-		{
-			// The read failed.  If the result is "pending", it means that
-			// the read was successfully initiated but that there's nothing
-			// available to satisfy the read immediately, hence the buffer
-			// is empty.  That's what we're after, so failure == success in
-			// this case.  Cancel the pending read, since we didn't actually
-			// want the data, we just wanted to know that there were no data.
-			DWORD dwerror = GetLastError();
-			if (dwerror == ERROR_IO_PENDING)
-				CancelIo(h->hdev);
-
-			// stop looping - consider the buffer emptied
+		// a zero timeout read only returns buffered reports, so
+		// stop as soon as there is nothing left
+		if (h->ptransport->read(h->hio, buffer, input_rpt_len, 0) == 0)
 			break;
-		}
 	}
 }
 
@@ -332,7 +822,7 @@ size_t usbdev_write(HUDEV hudev, void const *pdst, size_t ndata)
 	usbdev_context_t * const h = (usbdev_context_t*)hudev;
 
 	if (h == NULL)
-		return NULL;
+		return 0;
 
 	BYTE const * pdata = (BYTE const *)pdst;
 
@@ -344,7 +834,12 @@ size_t usbdev_write(HUDEV hudev, void const *pdst, size_t ndata)
 
 	AUTOLOCK(h->cslock);
 
-	int res = 0;
+	// A message isn't cut between its reports, that would leave the PBA
+	// bank counter of a LedWiz out of step.  Only the transport's cancel
+	// can do that, and the layer above has to resync after a failure.
+	if (h->cancelled != 0)
+		return 0;
+
 	DWORD nbyteswritten = 0;
 
 	BYTE buf[9]; 
@@ -360,50 +855,54 @@ size_t usbdev_write(HUDEV hudev, void const *pdst, size_t ndata)
 		pdata += ncopy;
 		ndata -= ncopy;
 
-		DWORD nwritten = 0;
-		DWORD const nwrite = 9;
+		size_t const nwrite = 9;
+		size_t nwritten = 0;
 
-		OVERLAPPED ol = {};
-		ol.hEvent = h->hwevent;
+		#if defined(USE_PIPELINED_WRITES)
+		if (h->write_interval_us == 0 && h->ptransport->write_async != NULL)
+		{
+			// queue the report, only waits if too many are in flight; the
+			// reports are counted as they complete, see usbdev_write_done()
+			nwritten = h->ptransport->write_async(h->hio, buf, nwrite, USB_WRITE_TIMEOUT_MS, usbdev_write_done, h);
+			h->writes_pending = true;
 
-		// make sure we space out writes by the minimum interval
-		DWORD now = GetTickCount();
-		DWORD dt = now - h->last_write_ticks;
-		if (dt < h->min_write_interval)
-			Sleep(h->min_write_interval - dt);
+			if (nwritten != nwrite)
+				h->stats.failed += 1;
 
-		// write the bytes
-		BOOL bres = WriteFile(h->hdev, buf, nwrite, NULL, &ol);
-		if (!bres)
-		{
-			DWORD dwerror = GetLastError();
-			if (dwerror == ERROR_IO_PENDING)
-			{
-				bres = TRUE;
-				if (WaitForSingleObject(h->hwevent, USB_WRITE_TIMEOUT_MS) != WAIT_OBJECT_0)
-				{
-					bres = FALSE;
-					CancelIo(h->hdev);
-				}
-			}
+			if (h->cancelled == 0)
+				usbdev_adapt_interval(h, nwritten == nwrite, -1);
 		}
+		else
+		#endif
+		{
+			// make sure we space out writes by the minimum interval
+			if (h->write_interval_us > 0)
+				usbdev_wait_until(h, h->last_write_us + h->write_interval_us);
 
-		// if the write completed, get the result
-		if (bres)
-			bres = GetOverlappedResult(h->hdev,	&ol, &nwritten, TRUE);
+			// write the bytes
+			int64_t const tstart = usbdev_time_us();
+			nwritten = h->ptransport->write(h->hio, buf, nwrite, USB_WRITE_TIMEOUT_MS);
 
-		// update the last write time
-		h->last_write_ticks = GetTickCount();
+			// update the last write time
+			h->last_write_us = usbdev_time_us();
 
-		// note any failure in debug builds
-		if (!bres)
-		{
-			DWORD dwerror = GetLastError();
-			_ASSERT(0);
+			// a cancelled write says nothing about the device
+			if (h->cancelled == 0)
+				usbdev_adapt_interval(h, nwritten == nwrite, h->last_write_us - tstart);
+
+			usbdev_latency_add(h->stats.write_hist, h->last_write_us - tstart);
+
+			if (nwritten == nwrite)
+				h->stats.written += 1;
+			else
+				h->stats.failed += 1;
+
+			if (nwritten != nwrite && h->last_write_us - tstart >= USB_WRITE_TIMEOUT_MS * 1000)
+				h->stats.timed_out += 1;
 		}
 
 		// if the write failed, or didn't send the expected number of bytes, stop
-		if (nwritten != nwrite || !bres)
+		if (nwritten != nwrite)
 			break;
 
 		// success - count the bytes written and continue with anything still pending
@@ -413,3 +912,21 @@ size_t usbdev_write(HUDEV hudev, void const *pdst, size_t ndata)
 	return nbyteswritten;
 }
 
+// Shutdown: the I/O thread of the device may be blocked in a write that
+// takes the whole timeout (the device was pulled, or a queue of paced
+// writes is in front).  The write in flight is cancelled if the transport
+// can do that, and the ones that follow fail right away instead of going
+// out, until this is called again with 'cancel' false.  This doesn't take
+// the device lock, that is held by the writer.
+void usbdev_cancel_writes(HUDEV hudev, bool cancel)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+
+	if (h == NULL)
+		return;
+
+	InterlockedExchange(&h->cancelled, cancel ? 1 : 0);
+
+	if (cancel && h->ptransport->cancel != NULL)
+		h->ptransport->cancel(h->hio);
+}
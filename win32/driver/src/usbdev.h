@@ -18,16 +18,93 @@
 #define USBDEV_H__INCLUDED
 
 
+#include <stddef.h>
+
+#if defined(_MSC_VER) && (_MSC_VER < 1600) // stdint.h is available starting with VisualStudio 2010
+typedef signed char int8_t;
+typedef unsigned char uint8_t;
+typedef short int16_t;
+typedef unsigned short uint16_t;
+typedef int int32_t;
+typedef unsigned int uint32_t;
+typedef __int64 int64_t;
+typedef unsigned __int64 uint64_t;
+#else
+#include <stdint.h>
+#endif
+
+#define USBDEV_MAX_PATH     256
+#define USBDEV_MAX_STRING   128
+#define USBDEV_MAX_ID       64
+
+// Description of a HID interface, as reported by usbdev_enumerate().
+// The report lengths are the payload sizes, i.e. they do not include
+// the report id prefix byte that Windows adds to every report.
+typedef struct {
+	char path[USBDEV_MAX_PATH];            // pass to usbdev_create()
+	char container_id[USBDEV_MAX_ID];      // the physical device, may be empty (see the transports)
+	unsigned short vendor_id;
+	unsigned short product_id;
+	unsigned short usage_page;             // usage of the top level collection
+	unsigned short usage;
+	unsigned int input_report_len;
+	unsigned int output_report_len;
+	char manufacturer[USBDEV_MAX_STRING];  // USB string descriptors, may be empty
+	char product[USBDEV_MAX_STRING];
+} usbdev_info_t;
+
+typedef void (*usbdev_enum_proc)(void *puser, usbdev_info_t const *pinfo);
+typedef void (*usbdev_hotplug_proc)(void *puser, bool attached);
+
 typedef void * HUDEV;
+typedef void * HUCACHE;
 
-HUDEV usbdev_create(LPCSTR devicepath);
+// Latency histogram with 8 buckets per power of two, in microseconds:
+// bucket i < 8 counts the value i, bucket i >= 8 the values from
+// (8 + i % 8) << (i / 8 - 1) up to (9 + i % 8) << (i / 8 - 1).  The last
+// bucket also takes everything above, from 15.7 s on.
+#define USBDEV_LATENCY_BUCKETS  176
+
+typedef struct {
+	unsigned int written;             // output reports written
+	unsigned int failed;              // output reports that failed
+	unsigned int timed_out;           // of those, the ones that took the whole write timeout
+	unsigned int write_hist[USBDEV_LATENCY_BUCKETS];  // time per report until its write completed
+} usbdev_stats_t;
+
+// The descriptions of the interfaces that were seen before can be kept in
+// a cache, keyed by path and container id, so that a rescan only has to
+// open the new ones.  Entries are dropped when an enumeration doesn't see
+// the interface any more, or with usbdev_cache_forget().
+HUCACHE usbdev_cache_create(void);
+void usbdev_cache_free(HUCACHE hcache);
+void usbdev_cache_forget(HUCACHE hcache, char const *devicepath);
+
+void usbdev_enumerate(HUCACHE hcache, usbdev_enum_proc proc, void *puser);  // hcache may be NULL
+bool usbdev_exists(char const *devicepath);
+HUDEV usbdev_create(char const *devicepath);
 void usbdev_addref(HUDEV hudev);
 void usbdev_release(HUDEV hudev);
 size_t usbdev_read(HUDEV hudev, void *pdata, size_t ndata);
+size_t usbdev_read_timeout(HUDEV hudev, void *pdata, size_t ndata, unsigned int timeout_ms);
 void usbdev_clear_input(HUDEV hudev, size_t input_report_len);
 size_t usbdev_write(HUDEV hudev, void const *pdata, size_t ndata);
-HANDLE usbdev_handle(HUDEV hudev);
+void usbdev_cancel_writes(HUDEV hudev, bool cancel);  // fail the writes until called with false, from any thread
+bool usbdev_flush(HUDEV hudev);  // wait for pipelined writes to complete
 void usbdev_set_min_write_interval(HUDEV hudev, unsigned int interval_ms);
+void usbdev_set_write_interval_range(HUDEV hudev, unsigned int min_us, unsigned int max_us);  // learn the interval within these bounds
+void usbdev_get_write_timing(HUDEV hudev, unsigned int *pinterval_us, unsigned int *platency_us);
+void usbdev_get_stats(HUDEV hudev, usbdev_stats_t *pstats, bool reset);
+
+// helpers for the statistics, also used by the layer above
+int64_t usbdev_time_us(void);
+void usbdev_latency_add(unsigned int *phist, int64_t latency_us);
+
+// Hot plug monitoring for platforms without window messages (Linux).  Returns
+// NULL if the transport does not support it, the callback is invoked from a
+// background thread.
+void * usbdev_hotplug_start(usbdev_hotplug_proc proc, void *puser);
+void usbdev_hotplug_stop(void *hmonitor);
 
 
 
@@ -0,0 +1,532 @@
+/*
+ *   LWCloneU2 Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// Linux transport using the hidraw driver.  Devices are found through sysfs
+// (/sys/class/hidraw), the report layout comes from the raw report descriptor,
+// and hot plug events are taken from the kernel uevent netlink socket, so no
+// libudev is needed.  The user needs read/write access to /dev/hidraw*, which
+// is usually granted with a udev rule for the LedWiz vendor ids.
+
+#if defined(__linux__)
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/hidraw.h>
+#include <linux/netlink.h>
+
+#include "usbdev_transport.h"
+
+
+// time to wait after the last hidraw uevent before reporting the change,
+// this gives udev the chance to create the device node and apply permissions
+// and collects the events of devices with several interfaces into one
+#define HOTPLUG_SETTLE_MS   500
+
+
+typedef struct {
+	int fd;
+	bool numbered;   // device uses report ids, so the id byte is on the wire
+} hidraw_io_t;
+
+typedef struct {
+	unsigned short usage_page;
+	unsigned short usage;
+	unsigned int input_report_len;
+	unsigned int output_report_len;
+	bool numbered;
+} hidraw_desc_t;
+
+
+// Walk the report descriptor and collect what Windows returns in HIDP_CAPS:
+// the usage of the first top level collection and the size of the largest
+// input and output report.
+static void hidraw_parse_descriptor(unsigned char const *pdesc, size_t ndesc, hidraw_desc_t *pinfo)
+{
+	memset(pinfo, 0x00, sizeof(*pinfo));
+
+	struct {
+		unsigned int usage_page;
+		unsigned int report_size;
+		unsigned int report_count;
+		unsigned int report_id;
+	} global = {}, stack[4];
+
+	int nstack = 0;
+	int depth = 0;
+	bool have_usage = false;
+	bool have_collection = false;
+	unsigned int usage = 0;
+
+	unsigned int input_bits[256] = {};
+	unsigned int output_bits[256] = {};
+
+	size_t pos = 0;
+	while (pos < ndesc)
+	{
+		unsigned char const prefix = pdesc[pos++];
+
+		// long items carry nothing we need
+		if (prefix == 0xFE)
+		{
+			if (pos >= ndesc)
+				break;
+			pos += 2 + pdesc[pos];
+			continue;
+		}
+
+		size_t const nbytes = (prefix & 0x03) == 3 ? 4 : (prefix & 0x03);
+		if (pos + nbytes > ndesc)
+			break;
+
+		unsigned int value = 0;
+		for (size_t i = 0; i < nbytes; i++)
+			value |= (unsigned int)pdesc[pos + i] << (8 * i);
+		pos += nbytes;
+
+		switch (prefix & 0xFC)
+		{
+		// main items
+		case 0x80: // input
+			input_bits[global.report_id & 0xFF] += global.report_size * global.report_count;
+			break;
+		case 0x90: // output
+			output_bits[global.report_id & 0xFF] += global.report_size * global.report_count;
+			break;
+		case 0xA0: // collection
+			if (depth == 0 && !have_collection)
+			{
+				have_collection = true;
+				pinfo->usage_page = usage >> 16;
+				pinfo->usage = usage & 0xFFFF;
+			}
+			depth += 1;
+			break;
+		case 0xC0: // end collection
+			depth -= 1;
+			break;
+
+		// global items
+		case 0x04: global.usage_page = value; break;
+		case 0x74: global.report_size = value; break;
+		case 0x94: global.report_count = value; break;
+		case 0x84: global.report_id = value; pinfo->numbered = true; break;
+		case 0xA4: if (nstack < 4) stack[nstack++] = global; break;
+		case 0xB4: if (nstack > 0) global = stack[--nstack]; break;
+
+		// local items, only the first usage before a collection matters
+		case 0x08:
+			if (!have_usage)
+			{
+				usage = (nbytes == 4) ? value : (global.usage_page << 16) | (value & 0xFFFF);
+				have_usage = true;
+			}
+			break;
+		}
+
+		// local items only apply up to the next main item
+		if ((prefix & 0x0C) == 0x00)
+			have_usage = false;
+	}
+
+	for (int i = 0; i < 256; i++)
+	{
+		if ((input_bits[i] + 7) / 8 > pinfo->input_report_len)
+			pinfo->input_report_len = (input_bits[i] + 7) / 8;
+
+		if ((output_bits[i] + 7) / 8 > pinfo->output_report_len)
+			pinfo->output_report_len = (output_bits[i] + 7) / 8;
+	}
+}
+
+static bool hidraw_get_descriptor(int fd, hidraw_desc_t *pinfo)
+{
+	int ndesc = 0;
+	struct hidraw_report_descriptor desc;
+
+	if (ioctl(fd, HIDIOCGRDESCSIZE, &ndesc) < 0 || ndesc <= 0)
+		return false;
+
+	desc.size = ndesc;
+	if (ioctl(fd, HIDIOCGRDESC, &desc) < 0)
+		return false;
+
+	hidraw_parse_descriptor(desc.value, desc.size, pinfo);
+
+	return true;
+}
+
+// read a single line sysfs attribute
+static void hidraw_read_sysfs(char const *path, char *pbuffer, size_t nsize)
+{
+	pbuffer[0] = '\0';
+
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+
+	if (fgets(pbuffer, nsize, fp) == NULL)
+		pbuffer[0] = '\0';
+
+	fclose(fp);
+
+	size_t n = strlen(pbuffer);
+	while (n > 0 && (pbuffer[n - 1] == '\n' || pbuffer[n - 1] == '\r'))
+		pbuffer[--n] = '\0';
+}
+
+static void hidraw_close(HUIO hio)
+{
+	hidraw_io_t * const h = (hidraw_io_t*)hio;
+
+	if (h == NULL)
+		return;
+
+	if (h->fd >= 0)
+		close(h->fd);
+
+	free(h);
+}
+
+static HUIO hidraw_open(char const *devicepath)
+{
+	int fd = open(devicepath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+	if (fd < 0)
+		return NULL;
+
+	hidraw_desc_t desc;
+	if (!hidraw_get_descriptor(fd, &desc))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	hidraw_io_t * const h = (hidraw_io_t*)malloc(sizeof(hidraw_io_t));
+
+	if (h == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	h->fd = fd;
+	h->numbered = desc.numbered;
+
+	return h;
+}
+
+static size_t hidraw_read(HUIO hio, void *pbuffer, size_t nsize, unsigned int timeout_ms)
+{
+	hidraw_io_t * const h = (hidraw_io_t*)hio;
+	unsigned char * const pdata = (unsigned char*)pbuffer;
+
+	if (nsize < 1)
+		return 0;
+
+	struct pollfd pfd = {};
+	pfd.fd = h->fd;
+	pfd.events = POLLIN;
+
+	if (poll(&pfd, 1, (int)timeout_ms) <= 0 || (pfd.revents & POLLIN) == 0)
+		return 0;
+
+	// unnumbered reports come without the id byte, add it
+	ssize_t nread;
+	if (h->numbered)
+	{
+		nread = read(h->fd, pdata, nsize);
+	}
+	else
+	{
+		pdata[0] = 0;
+		nread = read(h->fd, pdata + 1, nsize - 1);
+		if (nread >= 0)
+			nread += 1;
+	}
+
+	return nread > 0 ? (size_t)nread : 0;
+}
+
+static size_t hidraw_write(HUIO hio, void const *pbuffer, size_t nsize, unsigned int timeout_ms)
+{
+	hidraw_io_t * const h = (hidraw_io_t*)hio;
+
+	// hidraw expects the report id in the first byte, 0 for unnumbered
+	// reports, which is exactly the Windows layout
+
+	struct pollfd pfd = {};
+	pfd.fd = h->fd;
+	pfd.events = POLLOUT;
+
+	if (poll(&pfd, 1, (int)timeout_ms) <= 0 || (pfd.revents & POLLOUT) == 0)
+		return 0;
+
+	ssize_t nwritten = write(h->fd, pbuffer, nsize);
+
+	return nwritten > 0 ? (size_t)nwritten : 0;
+}
+
+// The container id is the name of the HID device in sysfs, like
+// 0003:FAFA:00F0.0007.  The number at the end counts up with every
+// device that is plugged in, so a hidraw node that is reused for
+// another device gets another id.
+static void hidraw_enumerate(usbdev_list_proc proc, void *puser)
+{
+	DIR *dir = opendir("/sys/class/hidraw");
+
+	if (dir == NULL)
+		return;
+
+	for (;;)
+	{
+		struct dirent *pent = readdir(dir);
+
+		if (pent == NULL)
+			break;
+
+		if (strncmp(pent->d_name, "hidraw", 6) != 0)
+			continue;
+
+		// a name that doesn't fit can't be a hidraw node we could open
+		char devicepath[USBDEV_MAX_PATH];
+		int const npath = snprintf(devicepath, sizeof(devicepath), "/dev/%s", pent->d_name);
+
+		if (npath < 0 || npath >= (int)sizeof(devicepath))
+			continue;
+
+		char path[512];
+		char link[512];
+		snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device", pent->d_name);
+
+		ssize_t const nlink = readlink(path, link, sizeof(link) - 1);
+		link[nlink > 0 ? nlink : 0] = '\0';
+
+		char const * const pslash = strrchr(link, '/');
+
+		proc(puser, devicepath, pslash != NULL ? pslash + 1 : link);
+	}
+
+	closedir(dir);
+}
+
+static bool hidraw_query(usbdev_info_t *pinfo)
+{
+	// the node is opened anyway for the descriptor, so take the ids from there too
+	int fd = open(pinfo->path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	struct hidraw_devinfo devinfo = {};
+	hidraw_desc_t desc;
+	bool ok = ioctl(fd, HIDIOCGRAWINFO, &devinfo) >= 0 && hidraw_get_descriptor(fd, &desc);
+
+	close(fd);
+
+	if (!ok)
+		return false;
+
+	pinfo->vendor_id = (unsigned short)devinfo.vendor;
+	pinfo->product_id = (unsigned short)devinfo.product;
+	pinfo->usage_page = desc.usage_page;
+	pinfo->usage = desc.usage;
+	pinfo->input_report_len = desc.input_report_len;
+	pinfo->output_report_len = desc.output_report_len;
+
+	// The string descriptors are attributes of the USB device, which is the
+	// parent of the interface that the HID device hangs off.
+	char const *pname = strrchr(pinfo->path, '/');
+	pname = pname != NULL ? pname + 1 : pinfo->path;
+
+	char path[512];
+	snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/../../manufacturer", pname);
+	hidraw_read_sysfs(path, pinfo->manufacturer, sizeof(pinfo->manufacturer));
+	snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/../../product", pname);
+	hidraw_read_sysfs(path, pinfo->product, sizeof(pinfo->product));
+
+	return true;
+}
+
+
+// hot plug monitor
+
+typedef struct {
+	int sock;
+	int wakepipe[2];
+	pthread_t thread;
+	usbdev_hotplug_proc proc;
+	void *puser;
+} hidraw_monitor_t;
+
+static void * hidraw_monitor_thread(void *param)
+{
+	hidraw_monitor_t * const h = (hidraw_monitor_t*)param;
+
+	bool pending = false;
+	bool attached = false;
+
+	for (;;)
+	{
+		struct pollfd pfd[2] = {};
+		pfd[0].fd = h->sock;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = h->wakepipe[0];
+		pfd[1].events = POLLIN;
+
+		int res = poll(pfd, 2, pending ? HOTPLUG_SETTLE_MS : -1);
+
+		if (res < 0 && errno != EINTR)
+			break;
+
+		if (pfd[1].revents != 0)
+			break;
+
+		if (res == 0 && pending)
+		{
+			// things have settled down, report the change
+			pending = false;
+			h->proc(h->puser, attached);
+			continue;
+		}
+
+		if ((pfd[0].revents & POLLIN) == 0)
+			continue;
+
+		// A kernel uevent is "action@devpath" followed by KEY=value
+		// strings, all null separated.  We only care about hidraw nodes.
+		char buf[4096];
+		ssize_t n = recv(h->sock, buf, sizeof(buf) - 1, 0);
+
+		if (n <= 0)
+			continue;
+
+		buf[n] = '\0';
+
+		bool is_hidraw = false;
+		for (char *p = buf; p < buf + n; p += strlen(p) + 1)
+		{
+			if (strcmp(p, "SUBSYSTEM=hidraw") == 0)
+				is_hidraw = true;
+		}
+
+		if (!is_hidraw)
+			continue;
+
+		if (strncmp(buf, "add@", 4) == 0)
+		{
+			// an arrival wins over a removal in the same burst, the
+			// removal is then picked up on the next re-open check
+			attached = true;
+			pending = true;
+		}
+		else if (strncmp(buf, "remove@", 7) == 0)
+		{
+			if (!pending)
+				attached = false;
+			pending = true;
+		}
+	}
+
+	return NULL;
+}
+
+static void hidraw_hotplug_stop(void *hmonitor)
+{
+	hidraw_monitor_t * const h = (hidraw_monitor_t*)hmonitor;
+
+	if (h == NULL)
+		return;
+
+	if (h->thread != 0)
+	{
+		char c = 0;
+		if (write(h->wakepipe[1], &c, 1) == 1)
+			pthread_join(h->thread, NULL);
+	}
+
+	if (h->sock >= 0)
+		close(h->sock);
+
+	if (h->wakepipe[0] >= 0)
+		close(h->wakepipe[0]);
+
+	if (h->wakepipe[1] >= 0)
+		close(h->wakepipe[1]);
+
+	free(h);
+}
+
+static void * hidraw_hotplug_start(usbdev_hotplug_proc proc, void *puser)
+{
+	hidraw_monitor_t * const h = (hidraw_monitor_t*)malloc(sizeof(hidraw_monitor_t));
+
+	if (h == NULL)
+		return NULL;
+
+	memset(h, 0x00, sizeof(*h));
+	h->sock = -1;
+	h->wakepipe[0] = -1;
+	h->wakepipe[1] = -1;
+	h->proc = proc;
+	h->puser = puser;
+
+	struct sockaddr_nl addr = {};
+	addr.nl_family = AF_NETLINK;
+	addr.nl_pid = 0;
+	addr.nl_groups = 1; // kernel uevents
+
+	h->sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+
+	if (h->sock < 0 ||
+		bind(h->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		pipe(h->wakepipe) < 0 ||
+		pthread_create(&h->thread, NULL, hidraw_monitor_thread, h) != 0)
+	{
+		h->thread = 0;
+		hidraw_hotplug_stop(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+
+usbdev_transport_t const usbdev_transport_hidraw = {
+	"hidraw",
+	hidraw_enumerate,
+	hidraw_query,
+	hidraw_open,
+	hidraw_close,
+	hidraw_read,
+	hidraw_write,
+	NULL,  // usbhid sends each report synchronously, nothing to pipeline
+	NULL,
+	NULL,  // a write() can't be interrupted, but fails at once on a pulled device
+	hidraw_hotplug_start,
+	hidraw_hotplug_stop
+};
+
+#endif
@@ -0,0 +1,895 @@
+/*
+ *   LWCloneU2 Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// Simulated devices, so that the queueing, coalescing and pacing code can
+// be exercised and timed without any hardware.  The transport is used
+// instead of the real one when LWZ_SIMULATE is set in the environment:
+//
+//   LWZ_SIMULATE=type[:unit[:outputs[:latency_us]]],...
+//
+//     type        ledwiz, lwcloneu2, pinscape, zb, or clone (an emulator the
+//                 library doesn't know, without the LedWiz bug)
+//     unit        LedWiz unit number 1..16 (default: position in the list)
+//     outputs     number of outputs, only used for pinscape (default 32)
+//     latency_us  time each output report write takes (default LWZ_SIM_LATENCY_US);
+//                 beyond the write timeout of 500 ms the writes time out, like
+//                 on a device that hangs or was pulled
+//
+//   LWZ_SIM_LATENCY_US   default write latency, in microseconds (default 1000,
+//                        i.e. one report per USB frame)
+//   LWZ_SIM_INTERVAL_US  with pipelined writes, the time between two reports
+//                        on the bus (default 250); the latency is then only
+//                        paid once for a burst of reports
+//   LWZ_SIM_INPUT_US     a Pinscape sends a joystick input report this often
+//                        (default 8000, 0 = only the replies to queries)
+//   LWZ_SIM_BUG_US       a real LedWiz corrupts a report if the next one arrives
+//                        within this time (default 4000)
+//   LWZ_SIM_ENUM_US      time it takes to open and query a HID interface
+//                        during the enumeration, like on Windows (default 0)
+//   LWZ_SIM_OTHER_HID    number of other HID interfaces in the system, like
+//                        keyboard encoders, which are not LedWiz devices
+//                        (default 0)
+//   LWZ_SIM_HOTPLUG_MS   the hot plug monitor reports an arrival this often, as
+//                        if some other HID device was plugged in (default 0,
+//                        no monitor)
+//   LWZ_SIM_LOG          file to record the decoded output state to, one line
+//                        per report: time in us (on the clock of LWZ_GET_TIME),
+//                        unit, report, on/off bits, the brightness/profile of
+//                        every port, and the running count of reports and
+//                        corrupted reports
+//
+// The models decode what the real firmware does: SBA and the PBA bank
+// counter for all types, the Pinscape 65 4 configuration query and SBX/PBX,
+// and for a real LedWiz the overwrite bug described in usbdev.cpp.  Each
+// Pinscape also shows up with its keyboard interface, which the DLL has to
+// skip.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#if !defined(_WIN32)
+#include <time.h>
+#include <errno.h>
+#endif
+
+#include "oscompat.h"
+#include "usbdev_transport.h"
+
+
+#define SIM_MAX_DEVICES     16
+#define SIM_MAX_OUTPUTS     128
+#define SIM_INPUT_QUEUE     8
+#define SIM_INPUT_LEN       14    // Pinscape joystick report size
+
+enum sim_type_t
+{
+	SIM_LEDWIZ,
+	SIM_LWCLONEU2,
+	SIM_PINSCAPE,
+	SIM_ZB,
+	SIM_CLONE
+};
+
+typedef struct {
+	CRITICAL_SECTION cs;
+	HANDLE hinput;              // signaled when an input report is queued
+
+	sim_type_t type;
+	int unit;                   // 1..16
+	int num_outputs;
+	unsigned int latency_us;
+
+	// decoded output state
+	bool on[SIM_MAX_OUTPUTS];
+	uint8_t profile[SIM_MAX_OUTPUTS];
+	uint8_t pulse_speed;
+	int pba_bank;
+
+	// real LedWiz overwrite bug
+	int64_t last_write_us;
+	uint8_t last_report[8];
+	int last_bank;              // bank the last report went to, -1 for SBA
+	unsigned long ncorrupted;
+
+	unsigned long nwrites;
+
+	// input reports for the host
+	uint8_t input[SIM_INPUT_QUEUE][SIM_INPUT_LEN];
+	int input_rpos;
+	int input_level;
+	int64_t next_input_us;      // time of the next joystick report
+	unsigned long ninputs;
+} sim_device_t;
+
+typedef struct {
+	sim_device_t *pdev;
+	bool keyboard;              // the Pinscape keyboard interface
+
+	// pipelined writes, the time each one in flight is done
+	int64_t wdone_us[USBDEV_MAX_PENDING_WRITES];
+	int64_t wqueued_us[USBDEV_MAX_PENDING_WRITES];
+	bool wbusy[USBDEV_MAX_PENDING_WRITES];  // not reported to the caller yet
+	int wnext;
+	int64_t wlast_us;
+
+	HANDLE hcancel;             // ends a wait for a write, see sim_cancel()
+} sim_io_t;
+
+static struct {
+	bool initialized;
+	int ndevices;
+	sim_device_t devices[SIM_MAX_DEVICES];
+	unsigned int bug_us;
+	unsigned int interval_us;
+	unsigned int input_us;
+	unsigned int enum_us;
+	unsigned int other_hid;
+	unsigned int hotplug_ms;
+	FILE *plog;
+	CRITICAL_SECTION cslog;
+	LARGE_INTEGER t0;
+	LARGE_INTEGER freq;
+	int64_t t0_us;              // t0 on the clock of usbdev_time_us(), for the log
+} g_sim;
+
+
+static int64_t sim_time_us(void)
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return (t.QuadPart - g_sim.t0.QuadPart) * 1000000 / g_sim.freq.QuadPart;
+}
+
+static void sim_sleep_us(unsigned int us)
+{
+	if (us == 0)
+		return;
+
+	// A real transfer blocks without using the CPU, which matters as soon
+	// as several devices are written from their own threads.
+
+	#if defined(_WIN32)
+
+	// Sleep() is only good for milliseconds, spin for the rest
+	int64_t const tend = sim_time_us() + us;
+
+	if (us >= 2000)
+		Sleep((us - 1000) / 1000);
+
+	while (sim_time_us() < tend)
+		;
+
+	#else
+
+	struct timespec ts;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (long)(us % 1000000) * 1000L;
+
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+
+	#endif
+}
+
+static unsigned int sim_getenv_uint(char const *name, unsigned int defval)
+{
+	char const *s = getenv(name);
+	return (s != NULL && *s != '\0') ? (unsigned int)strtoul(s, NULL, 10) : defval;
+}
+
+static void sim_init(void)
+{
+	if (g_sim.initialized)
+		return;
+
+	g_sim.initialized = true;
+
+	QueryPerformanceFrequency(&g_sim.freq);
+	QueryPerformanceCounter(&g_sim.t0);
+	InitializeCriticalSection(&g_sim.cslog);
+
+	g_sim.t0_us = (g_sim.t0.QuadPart / g_sim.freq.QuadPart) * 1000000 +
+		(g_sim.t0.QuadPart % g_sim.freq.QuadPart) * 1000000 / g_sim.freq.QuadPart;
+
+	g_sim.bug_us = sim_getenv_uint("LWZ_SIM_BUG_US", 4000);
+	g_sim.interval_us = sim_getenv_uint("LWZ_SIM_INTERVAL_US", 250);
+	g_sim.input_us = sim_getenv_uint("LWZ_SIM_INPUT_US", 8000);
+	g_sim.enum_us = sim_getenv_uint("LWZ_SIM_ENUM_US", 0);
+	g_sim.other_hid = sim_getenv_uint("LWZ_SIM_OTHER_HID", 0);
+	g_sim.hotplug_ms = sim_getenv_uint("LWZ_SIM_HOTPLUG_MS", 0);
+	unsigned int const latency_us = sim_getenv_uint("LWZ_SIM_LATENCY_US", 1000);
+
+	char const *logname = getenv("LWZ_SIM_LOG");
+	if (logname != NULL && *logname != '\0')
+		g_sim.plog = fopen(logname, "w");
+
+	char const *spec = getenv("LWZ_SIMULATE");
+	if (spec == NULL)
+		return;
+
+	while (*spec != '\0' && g_sim.ndevices < SIM_MAX_DEVICES)
+	{
+		// split off the next comma separated entry
+		char entry[64];
+		size_t n = strcspn(spec, ",");
+		if (n >= sizeof(entry))
+			n = sizeof(entry) - 1;
+		memcpy(entry, spec, n);
+		entry[n] = '\0';
+		spec += strcspn(spec, ",");
+		if (*spec == ',')
+			spec++;
+
+		char *fields[4] = { entry, NULL, NULL, NULL };
+		for (int i = 1; i < 4; i++)
+		{
+			char *p = fields[i-1] != NULL ? strchr(fields[i-1], ':') : NULL;
+			if (p != NULL)
+			{
+				*p = '\0';
+				fields[i] = p + 1;
+			}
+		}
+
+		sim_device_t * const pdev = &g_sim.devices[g_sim.ndevices];
+		memset(pdev, 0x00, sizeof(*pdev));
+
+		if (strcmp(fields[0], "ledwiz") == 0)
+			pdev->type = SIM_LEDWIZ;
+		else if (strcmp(fields[0], "lwcloneu2") == 0)
+			pdev->type = SIM_LWCLONEU2;
+		else if (strcmp(fields[0], "pinscape") == 0)
+			pdev->type = SIM_PINSCAPE;
+		else if (strcmp(fields[0], "zb") == 0)
+			pdev->type = SIM_ZB;
+		else if (strcmp(fields[0], "clone") == 0)
+			pdev->type = SIM_CLONE;
+		else
+			continue;
+
+		pdev->unit = fields[1] != NULL ? atoi(fields[1]) : g_sim.ndevices + 1;
+		pdev->num_outputs = 32;
+		pdev->latency_us = fields[3] != NULL ? (unsigned int)strtoul(fields[3], NULL, 10) : latency_us;
+		pdev->last_bank = -1;
+
+		if (pdev->type == SIM_PINSCAPE && fields[2] != NULL)
+			pdev->num_outputs = atoi(fields[2]);
+
+		if (pdev->unit < 1 || pdev->unit > 16 ||
+			pdev->num_outputs < 1 || pdev->num_outputs > SIM_MAX_OUTPUTS)
+		{
+			continue;
+		}
+
+		// the LedWiz power on state: all off, brightness 48
+		memset(pdev->profile, 48, sizeof(pdev->profile));
+		pdev->pulse_speed = 2;
+
+		InitializeCriticalSection(&pdev->cs);
+		pdev->hinput = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+		g_sim.ndevices += 1;
+	}
+}
+
+// write one line with the complete output state of the device to the log
+static void sim_log_state(sim_device_t *pdev, uint8_t const *preport, bool corrupted, int64_t t_us)
+{
+	if (g_sim.plog == NULL)
+		return;
+
+	char on[SIM_MAX_OUTPUTS / 4 + 1];
+	char profile[SIM_MAX_OUTPUTS * 2 + 1];
+
+	int const ngroups = (pdev->num_outputs + 3) / 4;
+	for (int i = 0; i < ngroups; i++)
+	{
+		int nibble = 0;
+		for (int k = 0; k < 4; k++)
+		{
+			if (pdev->on[i * 4 + k])
+				nibble |= 1 << k;
+		}
+		on[i] = "0123456789abcdef"[nibble];
+	}
+	on[ngroups] = '\0';
+
+	for (int i = 0; i < pdev->num_outputs; i++)
+		sprintf(&profile[i * 2], "%02x", pdev->profile[i]);
+
+	EnterCriticalSection(&g_sim.cslog);
+	fprintf(g_sim.plog, "%lld %d %02x%02x%02x%02x%02x%02x%02x%02x on=%s pr=%s n=%lu bad=%lu%s\n",
+		(long long)(g_sim.t0_us + t_us), pdev->unit,
+		preport[0], preport[1], preport[2], preport[3],
+		preport[4], preport[5], preport[6], preport[7],
+		on, profile, pdev->nwrites, pdev->ncorrupted,
+		corrupted ? " corrupted" : "");
+	fflush(g_sim.plog);
+	LeaveCriticalSection(&g_sim.cslog);
+}
+
+static void sim_queue_input(sim_device_t *pdev, uint8_t const *preport)
+{
+	if (pdev->input_level >= SIM_INPUT_QUEUE)
+		return;
+
+	int const wpos = (pdev->input_rpos + pdev->input_level) % SIM_INPUT_QUEUE;
+	memcpy(pdev->input[wpos], preport, SIM_INPUT_LEN);
+	pdev->input_level += 1;
+
+	SetEvent(pdev->hinput);
+}
+
+static void sim_set_state(sim_device_t *pdev, int first_port, uint8_t const *pbanks, uint8_t speed)
+{
+	for (int k = 0; k < 32 && first_port + k < pdev->num_outputs; k++)
+		pdev->on[first_port + k] = (pbanks[k / 8] >> (k % 8)) & 0x01;
+
+	pdev->pulse_speed = speed;
+}
+
+static void sim_set_profile(sim_device_t *pdev, int bank, uint8_t const *pvalues)
+{
+	for (int k = 0; k < 8 && bank * 8 + k < pdev->num_outputs; k++)
+		pdev->profile[bank * 8 + k] = pvalues[k];
+}
+
+// Decode an 8 byte output report the way the device firmware does.  Returns
+// the PBA bank the report was applied to, or -1 if it wasn't a PBA report.
+static int sim_decode(sim_device_t *pdev, uint8_t const *p)
+{
+	if (p[0] == 64)
+	{
+		// SBA: on/off state of ports 1-32, resets the PBA bank counter
+		sim_set_state(pdev, 0, &p[1], p[5]);
+		pdev->pba_bank = 0;
+		return -1;
+	}
+
+	if (pdev->type == SIM_PINSCAPE)
+	{
+		if (p[0] == 65)
+		{
+			// special request, 65 4 = query configuration
+			if (p[1] == 4)
+			{
+				uint8_t rpt[SIM_INPUT_LEN] = { 0x00, 0x88 };
+				rpt[2] = pdev->num_outputs & 0xFF;
+				rpt[3] = (pdev->num_outputs >> 8) & 0xFF;
+				rpt[4] = pdev->unit - 1;
+				rpt[11] = 0x02; // SBX/PBX supported
+				sim_queue_input(pdev, rpt);
+			}
+			return -1;
+		}
+
+		if (p[0] == 67)
+		{
+			// SBX: like SBA, for the group of 32 ports in byte 6
+			sim_set_state(pdev, p[6] * 32, &p[1], p[5]);
+			return -1;
+		}
+
+		if (p[0] == 68)
+		{
+			// PBX: eight 6 bit values for the group of 8 ports in byte 1
+			unsigned int const tmp1 = p[2] | (p[3] << 8) | (p[4] << 16);
+			unsigned int const tmp2 = p[5] | (p[6] << 8) | (p[7] << 16);
+			uint8_t values[8];
+			for (int k = 0; k < 4; k++)
+			{
+				values[k] = (tmp1 >> (6 * k)) & 0x3F;
+				values[k + 4] = (tmp2 >> (6 * k)) & 0x3F;
+			}
+			for (int k = 0; k < 8; k++)
+			{
+				if (values[k] >= 60)
+					values[k] = values[k] - 60 + 129;
+			}
+			sim_set_profile(pdev, p[1], values);
+			return -1;
+		}
+
+		if (p[0] > 64 && p[0] < 129)
+			return -1; // other Pinscape commands, not modelled
+	}
+
+	// PBA: next bank of 8 brightness values
+	int const bank = pdev->pba_bank;
+	if (bank < 4)
+		sim_set_profile(pdev, bank, p);
+	pdev->pba_bank = (bank + 1) & 0x03;
+	return bank;
+}
+
+// Paths are sim:N for simulated device N, sim:N:kbd for the keyboard
+// interface of a Pinscape, and sim:hid:N for the other HID interfaces.
+// All interfaces of a device share the container id.
+static void sim_enumerate(usbdev_list_proc proc, void *puser)
+{
+	sim_init();
+
+	char path[32];
+	char container_id[32];
+
+	for (int i = 0; i < g_sim.ndevices; i++)
+	{
+		sprintf(path, "sim:%d", i);
+		sprintf(container_id, "sim-%d", i);
+		proc(puser, path, container_id);
+
+		if (g_sim.devices[i].type == SIM_PINSCAPE)
+		{
+			sprintf(path, "sim:%d:kbd", i);
+			proc(puser, path, container_id);
+		}
+	}
+
+	for (unsigned int i = 0; i < g_sim.other_hid; i++)
+	{
+		sprintf(path, "sim:hid:%u", i);
+		sprintf(container_id, "sim-hid-%u", i);
+		proc(puser, path, container_id);
+	}
+}
+
+static bool sim_query(usbdev_info_t *pinfo)
+{
+	sim_init();
+
+	if (strncmp(pinfo->path, "sim:", 4) != 0)
+		return false;
+
+	// opening and querying the interface
+	sim_sleep_us(g_sim.enum_us);
+
+	if (strncmp(pinfo->path, "sim:hid:", 8) == 0)
+	{
+		// a keyboard encoder, say
+		pinfo->vendor_id = 0xD209;
+		pinfo->product_id = 0x0301;
+		pinfo->usage_page = 0x01;
+		pinfo->usage = 0x06;
+		pinfo->input_report_len = 8;
+		pinfo->output_report_len = 1;
+		strcpy(pinfo->manufacturer, "Ultimarc");
+		strcpy(pinfo->product, "I-PAC");
+		return true;
+	}
+
+	char *pend = NULL;
+	int const indx = (int)strtol(pinfo->path + 4, &pend, 10);
+
+	if (pend == pinfo->path + 4 || indx < 0 || indx >= g_sim.ndevices)
+		return false;
+
+	sim_device_t * const pdev = &g_sim.devices[indx];
+
+	pinfo->vendor_id = pdev->type == SIM_ZB ? 0x20A0 : 0xFAFA;
+	pinfo->product_id = 0x00F0 + pdev->unit - 1;
+	pinfo->usage_page = 0xFF00;
+	pinfo->usage = 0x01;
+	pinfo->output_report_len = 8;
+	pinfo->input_report_len = pdev->type == SIM_PINSCAPE ? SIM_INPUT_LEN : 8;
+
+	switch (pdev->type)
+	{
+	case SIM_LEDWIZ:
+		strcpy(pinfo->manufacturer, "GGG");
+		strcpy(pinfo->product, "LED-WIZ");
+		break;
+	case SIM_LWCLONEU2:
+		strcpy(pinfo->manufacturer, "LWCloneU2");
+		strcpy(pinfo->product, "LWCloneU2");
+		break;
+	case SIM_PINSCAPE:
+		strcpy(pinfo->manufacturer, "mjr");
+		strcpy(pinfo->product, "Pinscape Controller");
+		pinfo->usage_page = 0x01;
+		pinfo->usage = 0x04;
+		break;
+	case SIM_ZB:
+		strcpy(pinfo->manufacturer, "Zebsboards.com");
+		strcpy(pinfo->product, "ZB Output Control");
+		break;
+	case SIM_CLONE:
+		strcpy(pinfo->manufacturer, "Generic");
+		strcpy(pinfo->product, "USB Output Controller");
+		break;
+	}
+
+	if (strcmp(pend, ":kbd") == 0)
+	{
+		// the keyboard interface of the same device
+		pinfo->usage_page = 0x01;
+		pinfo->usage = 0x06;
+		pinfo->input_report_len = 8;
+		pinfo->output_report_len = 1;
+	}
+
+	return true;
+}
+
+static HUIO sim_open(char const *devicepath)
+{
+	sim_init();
+
+	if (strncmp(devicepath, "sim:", 4) != 0)
+		return NULL;
+
+	char *pend = NULL;
+	int const indx = (int)strtol(devicepath + 4, &pend, 10);
+
+	if (pend == devicepath + 4 || indx < 0 || indx >= g_sim.ndevices)
+		return NULL;
+
+	sim_io_t * const h = (sim_io_t*)malloc(sizeof(sim_io_t));
+
+	if (h == NULL)
+		return NULL;
+
+	memset(h, 0x00, sizeof(*h));
+
+	h->pdev = &g_sim.devices[indx];
+	h->keyboard = strcmp(pend, ":kbd") == 0;
+	h->hcancel = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (h->hcancel == NULL)
+	{
+		free(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+static void sim_close(HUIO hio)
+{
+	sim_io_t * const h = (sim_io_t*)hio;
+
+	CloseHandle(h->hcancel);
+	free(h);
+}
+
+// Wait for a write to go out, up to the timeout.  False if it was
+// cancelled or took longer, then only the timeout (or less) has passed.
+static bool sim_wait_write(sim_io_t *h, int64_t us, unsigned int timeout_ms)
+{
+	bool const timed_out = us > (int64_t)timeout_ms * 1000;
+
+	if (timed_out)
+		us = (int64_t)timeout_ms * 1000;
+
+	if (us <= 0)
+		return !timed_out;
+
+	// too short to be worth cancelling
+	if (us < 2000)
+	{
+		sim_sleep_us((unsigned int)us);
+		return !timed_out;
+	}
+
+	return WaitForSingleObject(h->hcancel, (DWORD)((us + 999) / 1000)) != WAIT_OBJECT_0 && !timed_out;
+}
+
+static size_t sim_read(HUIO hio, void *pbuffer, size_t nsize, unsigned int timeout_ms)
+{
+	sim_io_t * const h = (sim_io_t*)hio;
+	sim_device_t * const pdev = h->pdev;
+	uint8_t * const pdata = (uint8_t*)pbuffer;
+
+	if (h->keyboard || nsize < 1)
+		return 0;
+
+	int64_t const tend = sim_time_us() + (int64_t)timeout_ms * 1000;
+
+	for (;;)
+	{
+		int64_t const now = sim_time_us();
+		int64_t twait = tend - now;
+
+		{
+			EnterCriticalSection(&pdev->cs);
+
+			// a Pinscape sends joystick reports all the time, with a
+			// running count in place of the accelerometer data
+			if (pdev->type == SIM_PINSCAPE && g_sim.input_us > 0)
+			{
+				if (now >= pdev->next_input_us)
+				{
+					uint8_t rpt[SIM_INPUT_LEN] = { 0x01, 0x00 };
+					rpt[2] = (uint8_t)(pdev->ninputs & 0xFF);
+					rpt[3] = (uint8_t)((pdev->ninputs >> 8) & 0xFF);
+					pdev->ninputs += 1;
+
+					sim_queue_input(pdev, rpt);
+
+					// don't catch up after nobody was reading
+					if (now - pdev->next_input_us > (int64_t)g_sim.input_us)
+						pdev->next_input_us = now;
+					pdev->next_input_us += g_sim.input_us;
+				}
+
+				if (pdev->next_input_us - now < twait)
+					twait = pdev->next_input_us - now;
+			}
+
+			if (pdev->input_level > 0)
+			{
+				// report id, then the report
+				size_t n = nsize - 1;
+				if (n > SIM_INPUT_LEN)
+					n = SIM_INPUT_LEN;
+
+				pdata[0] = 0;
+				memcpy(&pdata[1], pdev->input[pdev->input_rpos], n);
+
+				pdev->input_rpos = (pdev->input_rpos + 1) % SIM_INPUT_QUEUE;
+				pdev->input_level -= 1;
+
+				LeaveCriticalSection(&pdev->cs);
+				return n + 1;
+			}
+
+			LeaveCriticalSection(&pdev->cs);
+		}
+
+		if (now >= tend)
+			return 0;
+
+		WaitForSingleObject(pdev->hinput, (DWORD)((twait + 999) / 1000));
+	}
+}
+
+// the device receives a report at the given time
+static void sim_deliver(sim_device_t *pdev, uint8_t const *preport, int64_t now)
+{
+	EnterCriticalSection(&pdev->cs);
+
+	bool corrupted = false;
+
+	// A real LedWiz is still decoding the previous report if the new one
+	// arrives too early, and the new report overwrites the part that it
+	// hasn't read yet.  Replay the previous report with the tail of the new
+	// one, on the same bank, to get the garbage the device ends up with.
+	if (pdev->type == SIM_LEDWIZ && pdev->nwrites > 0 && now - pdev->last_write_us < (int64_t)g_sim.bug_us)
+	{
+		int ndecoded = (int)((now - pdev->last_write_us) * 8 / g_sim.bug_us);
+		if (ndecoded < 1)
+			ndecoded = 1;
+
+		uint8_t garbled[8];
+		memcpy(garbled, pdev->last_report, ndecoded);
+		memcpy(&garbled[ndecoded], &preport[ndecoded], 8 - ndecoded);
+
+		if (pdev->last_bank < 0)
+			sim_set_state(pdev, 0, &garbled[1], garbled[5]);
+		else
+			sim_set_profile(pdev, pdev->last_bank, garbled);
+
+		pdev->ncorrupted += 1;
+		corrupted = true;
+	}
+
+	pdev->last_bank = sim_decode(pdev, preport);
+	memcpy(pdev->last_report, preport, 8);
+	pdev->last_write_us = now;
+	pdev->nwrites += 1;
+
+	sim_log_state(pdev, preport, corrupted, now);
+
+	LeaveCriticalSection(&pdev->cs);
+}
+
+static size_t sim_write(HUIO hio, void const *pbuffer, size_t nsize, unsigned int timeout_ms)
+{
+	sim_io_t * const h = (sim_io_t*)hio;
+	uint8_t const * const pdata = (uint8_t const*)pbuffer;
+
+	if (h->keyboard || nsize != 9)
+		return 0;
+
+	ResetEvent(h->hcancel);
+
+	// the report takes this long to go out
+	if (!sim_wait_write(h, h->pdev->latency_us, timeout_ms))
+		return 0;
+
+	sim_deliver(h->pdev, &pdata[1], sim_time_us());
+
+	return nsize;
+}
+
+// report the pipelined writes that are done by 'now' to the caller, oldest
+// first; with 'failed' the others as well, they count as cancelled
+static void sim_write_done(sim_io_t *h, int64_t now, bool failed, bool timed_out,
+	usbdev_write_done_proc done, void *puser)
+{
+	for (int k = 0; k < USBDEV_MAX_PENDING_WRITES; k++)
+	{
+		int const i = (h->wnext + k) % USBDEV_MAX_PENDING_WRITES;
+
+		if (!h->wbusy[i])
+			continue;
+
+		bool const ok = h->wdone_us[i] <= now;
+
+		if (!ok && !failed)
+			continue;
+
+		h->wbusy[i] = false;
+
+		if (done != NULL)
+			done(puser, (ok ? h->wdone_us[i] : now) - h->wqueued_us[i], ok, !ok && timed_out);
+	}
+}
+
+static size_t sim_write_async(HUIO hio, void const *pbuffer, size_t nsize, unsigned int timeout_ms,
+	usbdev_write_done_proc done, void *puser)
+{
+	sim_io_t * const h = (sim_io_t*)hio;
+	uint8_t const * const pdata = (uint8_t const*)pbuffer;
+
+	if (h->keyboard || nsize != 9)
+		return 0;
+
+	ResetEvent(h->hcancel);
+
+	// all slots in flight, wait for the oldest one
+	int64_t now = sim_time_us();
+	int64_t const tfree = h->wdone_us[h->wnext];
+
+	if (tfree > now)
+	{
+		if (!sim_wait_write(h, tfree - now, timeout_ms))
+			return 0;
+
+		now = sim_time_us();
+	}
+
+	// the oldest is done after the wait, even if the clock is a bit behind
+	sim_write_done(h, now > tfree ? now : tfree, false, false, done, puser);
+
+	// The report is done after the latency, but not before the one
+	// in front of it has left the bus.  It is decoded right away and
+	// logged with the time it arrives.
+	int64_t tdone = now + h->pdev->latency_us;
+	if (tdone < h->wlast_us + g_sim.interval_us)
+		tdone = h->wlast_us + g_sim.interval_us;
+
+	h->wdone_us[h->wnext] = tdone;
+	h->wqueued_us[h->wnext] = now;
+	h->wbusy[h->wnext] = true;
+	h->wnext = (h->wnext + 1) % USBDEV_MAX_PENDING_WRITES;
+	h->wlast_us = tdone;
+
+	sim_deliver(h->pdev, &pdata[1], tdone);
+
+	return nsize;
+}
+
+static bool sim_write_flush(HUIO hio, unsigned int timeout_ms, usbdev_write_done_proc done, void *puser)
+{
+	sim_io_t * const h = (sim_io_t*)hio;
+
+	ResetEvent(h->hcancel);
+
+	int64_t const remaining_us = h->wlast_us - sim_time_us();
+	bool const ok = sim_wait_write(h, remaining_us, timeout_ms);
+
+	int64_t const now = sim_time_us();
+
+	sim_write_done(h, ok && now < h->wlast_us ? h->wlast_us : now, !ok,
+		remaining_us > (int64_t)timeout_ms * 1000, done, puser);
+
+	return ok;
+}
+
+static void sim_cancel(HUIO hio)
+{
+	sim_io_t * const h = (sim_io_t*)hio;
+
+	SetEvent(h->hcancel);
+}
+
+
+// hot plug monitor, reports an arrival every LWZ_SIM_HOTPLUG_MS
+
+typedef struct {
+	HANDLE hthread;
+	HANDLE hstop;
+	usbdev_hotplug_proc proc;
+	void *puser;
+} sim_monitor_t;
+
+static DWORD WINAPI sim_monitor_thread(LPVOID param)
+{
+	sim_monitor_t * const h = (sim_monitor_t*)param;
+
+	while (WaitForSingleObject(h->hstop, g_sim.hotplug_ms) == WAIT_TIMEOUT)
+		h->proc(h->puser, true);
+
+	return 0;
+}
+
+static void sim_hotplug_stop(void *hmonitor)
+{
+	sim_monitor_t * const h = (sim_monitor_t*)hmonitor;
+
+	if (h == NULL)
+		return;
+
+	if (h->hthread != NULL)
+	{
+		SetEvent(h->hstop);
+		WaitForSingleObject(h->hthread, INFINITE);
+		CloseHandle(h->hthread);
+	}
+
+	if (h->hstop != NULL)
+		CloseHandle(h->hstop);
+
+	free(h);
+}
+
+static void * sim_hotplug_start(usbdev_hotplug_proc proc, void *puser)
+{
+	sim_init();
+
+	if (g_sim.hotplug_ms == 0)
+		return NULL;
+
+	sim_monitor_t * const h = (sim_monitor_t*)malloc(sizeof(sim_monitor_t));
+
+	if (h == NULL)
+		return NULL;
+
+	memset(h, 0x00, sizeof(*h));
+	h->proc = proc;
+	h->puser = puser;
+	h->hstop = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (h->hstop != NULL)
+		h->hthread = CreateThread(NULL, 0, sim_monitor_thread, h, 0, NULL);
+
+	if (h->hthread == NULL)
+	{
+		sim_hotplug_stop(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+
+usbdev_transport_t const usbdev_transport_sim = {
+	"sim",
+	sim_enumerate,
+	sim_query,
+	sim_open,
+	sim_close,
+	sim_read,
+	sim_write,
+	sim_write_async,
+	sim_write_flush,
+	sim_cancel,
+	sim_hotplug_start,
+	sim_hotplug_stop
+};
@@ -0,0 +1,100 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef USBDEV_TRANSPORT_H__INCLUDED
+#define USBDEV_TRANSPORT_H__INCLUDED
+
+#include "usbdev.h"
+
+
+// A transport is the OS specific part of usbdev: finding HID interfaces and
+// moving single reports.  Reference counting, locking, pacing and splitting
+// writes into 8 byte reports live in usbdev.cpp and are shared by all of them.
+//
+// Reports are always passed in the Windows layout, i.e. with a leading report
+// id byte that is 0 for devices without numbered reports.  Backends for
+// systems that omit the byte for such devices have to add/strip it.
+
+typedef void * HUIO;
+
+typedef void (*usbdev_list_proc)(void *puser, char const *devicepath, char const *container_id);
+
+// maximum number of output reports a transport keeps in flight with write_async()
+#define USBDEV_MAX_PENDING_WRITES  4
+
+// A report queued with write_async() has completed: the time from the
+// write_async() call until it was seen done, whether it went out, and if
+// not, whether it was cancelled because it took the whole timeout.
+typedef void (*usbdev_write_done_proc)(void *puser, int64_t latency_us, bool ok, bool timed_out);
+
+typedef struct {
+	char const *name;
+
+	// List the HID interfaces that are present, with the path and the
+	// container id only; this must not open them, that is what takes time.
+	void (*enumerate)(usbdev_list_proc proc, void *puser);
+
+	// Fill in the rest of the description of one interface (pinfo->path
+	// and container_id are set).  False if it can't be opened.
+	bool (*query)(usbdev_info_t *pinfo);
+
+	HUIO (*open)(char const *devicepath);
+	void (*close)(HUIO hio);
+
+	// Read one input report.  Returns the number of bytes including the
+	// report id, or 0 on timeout or error.  A timeout of 0 only returns
+	// what is already buffered.
+	size_t (*read)(HUIO hio, void *pbuffer, size_t nsize, unsigned int timeout_ms);
+
+	// Write one output report.  Returns the number of bytes written
+	// including the report id, or 0 on timeout or error.
+	size_t (*write)(HUIO hio, void const *pbuffer, size_t nsize, unsigned int timeout_ms);
+
+	// optional, pipelined writes.  Queue one output report and return
+	// without waiting for it to go out, unless USBDEV_MAX_PENDING_WRITES
+	// are already in flight; then wait up to the timeout for the oldest.
+	// Returns the number of bytes queued, or 0 if that failed or a write
+	// queued earlier has failed since the last call.  'done' is invoked
+	// for each of the earlier writes that is found to be complete.
+	size_t (*write_async)(HUIO hio, void const *pbuffer, size_t nsize, unsigned int timeout_ms,
+		usbdev_write_done_proc done, void *puser);
+
+	// wait until all queued writes are done, false if one failed or timed
+	// out; 'done' is invoked for each of them, oldest first
+	bool (*write_flush)(HUIO hio, unsigned int timeout_ms, usbdev_write_done_proc done, void *puser);
+
+	// optional, make the writes in flight return now (and fail).  Called
+	// from another thread while one of the above is blocked.
+	void (*cancel)(HUIO hio);
+
+	// optional, NULL if device arrival/removal is signaled some other way
+	void * (*hotplug_start)(usbdev_hotplug_proc proc, void *puser);
+	void (*hotplug_stop)(void *hmonitor);
+} usbdev_transport_t;
+
+
+extern usbdev_transport_t const usbdev_transport_sim;
+
+#if defined(_WIN32)
+extern usbdev_transport_t const usbdev_transport_win32;
+#endif
+
+#if defined(__linux__)
+extern usbdev_transport_t const usbdev_transport_hidraw;
+#endif
+
+
+#endif
@@ -0,0 +1,492 @@
+/*
+ *   LWCloneU2 Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#if defined(_WIN32)
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <crtdbg.h>
+#include <windows.h>
+#include <Setupapi.h>
+
+extern "C" {
+#include <Hidsdi.h>
+}
+
+#include "usbdev_transport.h"
+
+
+static const GUID HIDguid = { 0x4d1e55b2, 0xf16f, 0x11Cf, { 0x88, 0xcb, 0x00, 0x11, 0x11, 0x00, 0x00, 0x30 } };
+
+
+// one pipelined write, see win32_write_async()
+typedef struct {
+	OVERLAPPED ol;
+	BYTE buf[65];
+	bool busy;
+	int64_t tqueued_us;  // usbdev_time_us() at win32_write_async()
+} win32_write_slot_t;
+
+typedef struct {
+	HANDLE hdev;
+	HANDLE hrevent;
+	HANDLE hwevent;
+	OVERLAPPED wol;     // of win32_write(), so that win32_cancel() can find it
+
+	win32_write_slot_t wslots[USBDEV_MAX_PENDING_WRITES];
+	int wslot_next;
+	bool wfailed;
+} win32_io_t;
+
+
+// wait for a pipelined write to complete, cancel it if it takes too long
+static void win32_complete_slot(win32_io_t *h, win32_write_slot_t *pslot, unsigned int timeout_ms,
+	usbdev_write_done_proc done, void *puser)
+{
+	if (!pslot->busy)
+		return;
+
+	bool timed_out = false;
+
+	if (WaitForSingleObject(pslot->ol.hEvent, timeout_ms) != WAIT_OBJECT_0)
+	{
+		CancelIo(h->hdev);
+		timed_out = true;
+	}
+
+	DWORD nwritten = 0;
+	bool const ok = GetOverlappedResult(h->hdev, &pslot->ol, &nwritten, TRUE) != FALSE;
+
+	if (!ok)
+		h->wfailed = true;
+
+	pslot->busy = false;
+
+	if (done != NULL)
+		done(puser, usbdev_time_us() - pslot->tqueued_us, ok, timed_out && !ok);
+}
+
+
+static void win32_close(HUIO hio)
+{
+	win32_io_t * const h = (win32_io_t*)hio;
+
+	if (h == NULL)
+		return;
+
+	if (h->hrevent)
+	{
+		CloseHandle(h->hrevent);
+		h->hrevent = NULL;
+	}
+
+	if (h->hwevent)
+	{
+		CloseHandle(h->hwevent);
+		h->hwevent = NULL;
+	}
+
+	// the buffers must stay valid until the writes are done
+	for (int i = 0; i < USBDEV_MAX_PENDING_WRITES; i++)
+	{
+		win32_write_slot_t * const pslot = &h->wslots[i];
+
+		if (pslot->busy && h->hdev != INVALID_HANDLE_VALUE)
+			win32_complete_slot(h, pslot, 0, NULL, NULL);
+
+		if (pslot->ol.hEvent)
+		{
+			CloseHandle(pslot->ol.hEvent);
+			pslot->ol.hEvent = NULL;
+		}
+	}
+
+	if (h->hdev != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(h->hdev);
+		h->hdev = INVALID_HANDLE_VALUE;
+	}
+
+	free(h);
+}
+
+static HUIO win32_open(char const *devicepath)
+{
+	win32_io_t * const h = (win32_io_t*)malloc(sizeof(win32_io_t));
+
+	if (h == NULL)
+		return NULL;
+
+	memset(h, 0x00, sizeof(*h));
+
+	h->hdev = INVALID_HANDLE_VALUE;
+	h->hrevent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	h->hwevent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	bool events_ok = h->hrevent != NULL && h->hwevent != NULL;
+
+	for (int i = 0; i < USBDEV_MAX_PENDING_WRITES; i++)
+	{
+		h->wslots[i].ol.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (h->wslots[i].ol.hEvent == NULL)
+			events_ok = false;
+	}
+
+	h->hdev = CreateFileA(
+		devicepath,
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED,
+		NULL);
+
+	if (!events_ok ||
+		h->hdev == INVALID_HANDLE_VALUE)
+	{
+		win32_close(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+static size_t win32_read(HUIO hio, void *pbuffer, size_t nsize, unsigned int timeout_ms)
+{
+	win32_io_t * const h = (win32_io_t*)hio;
+
+	DWORD nread = 0;
+
+	OVERLAPPED ol = {};
+	ol.hEvent = h->hrevent;
+
+	BOOL bres = ReadFile(h->hdev, pbuffer, nsize, NULL, &ol);
+
+	if (bres != TRUE)
+	{
+		DWORD dwerror = GetLastError();
+
+		if (dwerror == ERROR_IO_PENDING)
+		{
+			if (WaitForSingleObject(h->hrevent, timeout_ms) != WAIT_OBJECT_0)
+			{
+				CancelIo(h->hdev);
+			}
+
+			bres = TRUE;
+		}
+	}
+
+	if (bres == TRUE)
+	{
+		bres = GetOverlappedResult(
+			h->hdev,
+			&ol,
+			&nread,
+			TRUE);
+	}
+
+	// a cancelled read (timeout, or nothing buffered for a zero
+	// timeout) is the normal way to come back empty handed
+	if (bres != TRUE)
+	{
+		DWORD dwerror = GetLastError();
+		_ASSERT(dwerror == ERROR_OPERATION_ABORTED);
+		return 0;
+	}
+
+	return nread;
+}
+
+static size_t win32_write(HUIO hio, void const *pbuffer, size_t nsize, unsigned int timeout_ms)
+{
+	win32_io_t * const h = (win32_io_t*)hio;
+
+	DWORD nwritten = 0;
+
+	memset(&h->wol, 0x00, sizeof(h->wol));
+	h->wol.hEvent = h->hwevent;
+
+	BOOL bres = WriteFile(h->hdev, pbuffer, nsize, NULL, &h->wol);
+	if (!bres)
+	{
+		DWORD dwerror = GetLastError();
+		if (dwerror == ERROR_IO_PENDING)
+		{
+			bres = TRUE;
+			if (WaitForSingleObject(h->hwevent, timeout_ms) != WAIT_OBJECT_0)
+			{
+				bres = FALSE;
+				CancelIo(h->hdev);
+			}
+		}
+	}
+
+	// if the write completed, get the result
+	if (bres)
+		bres = GetOverlappedResult(h->hdev,	&h->wol, &nwritten, TRUE);
+
+	// note any failure in debug builds
+	if (!bres)
+	{
+		DWORD dwerror = GetLastError();
+		_ASSERT(0);
+		return 0;
+	}
+
+	return nwritten;
+}
+
+static size_t win32_write_async(HUIO hio, void const *pbuffer, size_t nsize, unsigned int timeout_ms,
+	usbdev_write_done_proc done, void *puser)
+{
+	win32_io_t * const h = (win32_io_t*)hio;
+
+	if (nsize > sizeof(h->wslots[0].buf))
+		return 0;
+
+	// collect the writes that are done by now, so that their completion
+	// time isn't taken only when the slot comes round again
+	for (int i = 0; i < USBDEV_MAX_PENDING_WRITES; i++)
+	{
+		win32_write_slot_t * const pdone = &h->wslots[(h->wslot_next + i) % USBDEV_MAX_PENDING_WRITES];
+
+		if (pdone->busy && HasOverlappedIoCompleted(&pdone->ol))
+			win32_complete_slot(h, pdone, 0, done, puser);
+	}
+
+	// the slots are used round robin, so the next one has the oldest write
+	win32_write_slot_t * const pslot = &h->wslots[h->wslot_next];
+	win32_complete_slot(h, pslot, timeout_ms, done, puser);
+
+	// report a failure of an earlier write to the caller
+	if (h->wfailed)
+	{
+		h->wfailed = false;
+		return 0;
+	}
+
+	memcpy(pslot->buf, pbuffer, nsize);
+
+	HANDLE const hevent = pslot->ol.hEvent;
+	memset(&pslot->ol, 0x00, sizeof(pslot->ol));
+	pslot->ol.hEvent = hevent;
+	ResetEvent(hevent);
+
+	pslot->tqueued_us = usbdev_time_us();
+
+	// the write may complete right away or be pending, either way
+	// the result is collected by win32_complete_slot()
+	if (!WriteFile(h->hdev, pslot->buf, nsize, NULL, &pslot->ol) &&
+		GetLastError() != ERROR_IO_PENDING)
+	{
+		return 0;
+	}
+
+	pslot->busy = true;
+	h->wslot_next = (h->wslot_next + 1) % USBDEV_MAX_PENDING_WRITES;
+
+	return nsize;
+}
+
+static bool win32_write_flush(HUIO hio, unsigned int timeout_ms, usbdev_write_done_proc done, void *puser)
+{
+	win32_io_t * const h = (win32_io_t*)hio;
+
+	// oldest first
+	for (int i = 0; i < USBDEV_MAX_PENDING_WRITES; i++)
+		win32_complete_slot(h, &h->wslots[(h->wslot_next + i) % USBDEV_MAX_PENDING_WRITES], timeout_ms, done, puser);
+
+	bool const ok = !h->wfailed;
+	h->wfailed = false;
+
+	return ok;
+}
+
+// Cancel only the writes, the input reader may have a read pending on the
+// same handle.  Cancelling an OVERLAPPED that isn't in flight does nothing.
+// CancelIoEx() is Vista and later, it is looked up so that the DLL still
+// loads on XP.  There the write in progress isn't cancelled; the I/O
+// thread cancels it itself with CancelIo() when its timeout runs out.
+static void win32_cancel(HUIO hio)
+{
+	win32_io_t * const h = (win32_io_t*)hio;
+
+	typedef BOOL (WINAPI *cancel_io_ex_t)(HANDLE, LPOVERLAPPED);
+
+	cancel_io_ex_t const cancel_io_ex = (cancel_io_ex_t)GetProcAddress(
+		GetModuleHandleA("kernel32.dll"), "CancelIoEx");
+
+	if (cancel_io_ex == NULL)
+		return;
+
+	cancel_io_ex(h->hdev, &h->wol);
+
+	for (int i = 0; i < USBDEV_MAX_PENDING_WRITES; i++)
+		cancel_io_ex(h->hdev, &h->wslots[i].ol);
+}
+
+// SPDRP_BASE_CONTAINERID is missing from older SDK headers
+#if !defined(SPDRP_BASE_CONTAINERID)
+#define SPDRP_BASE_CONTAINERID 0x00000024
+#endif
+
+// Only SetupAPI is used here, the interfaces are opened by win32_query().
+// The container id is the same for all interfaces of one physical device.
+static void win32_enumerate(usbdev_list_proc proc, void *puser)
+{
+	// set up a search on all HID devices
+	HDEVINFO hDevInfo = SetupDiGetClassDevsA(
+		&HIDguid,
+		NULL,
+		NULL,
+		DIGCF_PRESENT | DIGCF_INTERFACEDEVICE);
+
+	// we can't proceed unless we got the HID list
+	if (hDevInfo == INVALID_HANDLE_VALUE)
+		return;
+
+	for (DWORD dwindex = 0 ; ; dwindex++)
+	{
+		// get the next interface in the HID list
+		SP_DEVICE_INTERFACE_DATA didat = {};
+		didat.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
+		BOOL bres = SetupDiEnumDeviceInterfaces(
+			hDevInfo,
+			NULL,
+			&HIDguid,
+			dwindex,
+			&didat);
+
+		// if that failed, we've reached the end of the list
+		if (bres == FALSE)
+			break;
+
+		// retrieve the device detail
+		DWORD dat[256];
+		SP_DEVICE_INTERFACE_DETAIL_DATA_A * pdiddat = (SP_DEVICE_INTERFACE_DETAIL_DATA_A *)&dat[0];
+		pdiddat->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
+		SP_DEVINFO_DATA devdat = {};
+		devdat.cbSize = sizeof(SP_DEVINFO_DATA);
+		bres = SetupDiGetDeviceInterfaceDetailA(
+			hDevInfo,
+			&didat,
+			pdiddat,
+			sizeof(dat),
+			NULL,
+			&devdat);
+
+		// if we couldn't get the device detail, proceed to the next device
+		if (bres == FALSE || strlen(pdiddat->DevicePath) >= USBDEV_MAX_PATH)
+			continue;
+
+		char container_id[USBDEV_MAX_ID] = "";
+		if (!SetupDiGetDeviceRegistryPropertyA(
+				hDevInfo,
+				&devdat,
+				SPDRP_BASE_CONTAINERID,
+				NULL,
+				(PBYTE)container_id,
+				sizeof(container_id) - 1,
+				NULL))
+		{
+			container_id[0] = '\0';
+		}
+
+		proc(puser, pdiddat->DevicePath, container_id);
+	}
+
+	// done with the HID device list
+	SetupDiDestroyDeviceInfoList(hDevInfo);
+}
+
+static bool win32_query(usbdev_info_t *pinfo)
+{
+	HANDLE hdev = CreateFileA(
+		pinfo->path,
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		0,
+		NULL);
+
+	if (hdev == INVALID_HANDLE_VALUE)
+		return false;
+
+	bool ok = false;
+
+	// retrieve the HID attributes and capabilities
+	HIDD_ATTRIBUTES attrib = {};
+	attrib.Size = sizeof(HIDD_ATTRIBUTES);
+	PHIDP_PREPARSED_DATA p_prepdata = NULL;
+	HIDP_CAPS caps = {};
+
+	if (HidD_GetAttributes(hdev, &attrib) &&
+		HidD_GetPreparsedData(hdev, &p_prepdata) == TRUE)
+	{
+		if (HIDP_STATUS_SUCCESS == HidP_GetCaps(p_prepdata, &caps))
+		{
+			pinfo->vendor_id = attrib.VendorID;
+			pinfo->product_id = attrib.ProductID;
+			pinfo->usage_page = caps.UsagePage;
+			pinfo->usage = caps.Usage;
+
+			// Windows includes the report id byte in the lengths,
+			// even for devices that don't use report ids
+			pinfo->input_report_len = caps.InputReportByteLength > 0 ? caps.InputReportByteLength - 1 : 0;
+			pinfo->output_report_len = caps.OutputReportByteLength > 0 ? caps.OutputReportByteLength - 1 : 0;
+
+			size_t retlen;
+			wchar_t wstr[USBDEV_MAX_STRING];
+
+			if (HidD_GetManufacturerString(hdev, wstr, sizeof(wstr)))
+				wcstombs_s(&retlen, pinfo->manufacturer, sizeof(pinfo->manufacturer), wstr, _TRUNCATE);
+
+			if (HidD_GetProductString(hdev, wstr, sizeof(wstr)))
+				wcstombs_s(&retlen, pinfo->product, sizeof(pinfo->product), wstr, _TRUNCATE);
+
+			ok = true;
+		}
+
+		HidD_FreePreparsedData(p_prepdata);
+	}
+
+	CloseHandle(hdev);
+
+	return ok;
+}
+
+
+usbdev_transport_t const usbdev_transport_win32 = {
+	"win32",
+	win32_enumerate,
+	win32_query,
+	win32_open,
+	win32_close,
+	win32_read,
+	win32_write,
+	win32_write_async,
+	win32_write_flush,
+	win32_cancel,
+	NULL,  // device changes arrive as WM_DEVICECHANGE, see LWZ_REGISTER
+	NULL
+};
+
+#endif
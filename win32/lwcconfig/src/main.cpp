@@ -60,6 +60,18 @@ static void CALLBACK notify_cb(int32_t reason, LWZHANDLE hlwz)
 	}
 }
 
+// Send the 32 bytes of a PBA message.  Newer DLLs drop a PBA that doesn't
+// change anything, so go through LWZ_RAWWRITE when it is there to have
+// every message reach the device.
+static void send_pba(uint8_t const *pmode32bytes)
+{
+	if (g_main.fn.LWZ_RAWWRITE != NULL) {
+		g_main.fn.LWZ_RAWWRITE(g_main.devlist.handles[0], pmode32bytes, 32);
+	} else {
+		g_main.fn.LWZ_PBA(g_main.devlist.handles[0], pmode32bytes);
+	}
+}
+
 
 void usage()
 {
@@ -200,7 +212,7 @@ int main(int argc, char* argv[])
 
 		for (;;)
 		{
-			g_main.fn.LWZ_PBA(g_main.devlist.handles[0], &x32bytes[0]);
+			send_pba(&x32bytes[0]);
 			nsend += 32;
 
 			clock_t t1 = clock();
@@ -221,7 +233,7 @@ int main(int argc, char* argv[])
 
 		for (;;)
 		{
-			g_main.fn.LWZ_PBA(g_main.devlist.handles[0], &x32bytes[0]);
+			send_pba(&x32bytes[0]);
 			nsend += 32;
 
 			clock_t t1 = clock();
@@ -245,7 +257,7 @@ int main(int argc, char* argv[])
 
 		for (;;)
 		{
-			g_main.fn.LWZ_PBA(g_main.devlist.handles[0], &x32bytes[0]);
+			send_pba(&x32bytes[0]);
 			nsend += 32;
 
 			clock_t t1 = clock();
@@ -0,0 +1,1829 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// lwzbench - measures how long the LWZ_* calls block the calling thread.
+//
+// A front end like DOF updates all outputs of all devices once per frame,
+// i.e. a burst of SBA/PBA calls followed by a pause.  The time spent in the
+// library for each call is measured and summarized.  Without real hardware
+// the simulated transport of the library is used (see LWZ_SIMULATE).
+//
+// With the simulation the reports that actually reached each device are
+// counted as well (from LWZ_SIM_LOG).  The default setup mixes LedWiz units,
+// which the library has to pace to one report per 5 ms, with clones that
+// take reports at full speed; the clones must not be slowed down by them.
+//
+// With -b each frame is sent with one LWZ_UPDATE_BATCH call for all
+// devices instead of an SBA and a PBA per device.
+//
+// With -s it also shows what LWZ_GET_STATS reports for each device after
+// the run: how many updates were merged, how deep the queues got, and the
+// latency from the call to the completed write.
+//
+// With -c several threads update the outputs at the same time, first on
+// their own and then while the device list is rescanned over and over (as
+// on a WM_DEVICECHANGE), and it shows how long their calls take.  The
+// simulated enumeration is slowed down to what it takes on Windows, with a
+// dozen other HID devices in the system.  Only the first scan has to open
+// them all, the rescans use what it found out.  The output calls must not
+// have to wait for a rescan.  Last the rescans come from the hot plug
+// monitor, while this thread, which stands in for the application's window
+// thread, calls LWZ_GET_DEVICE_INFO; that must not wait for the enumeration
+// either.
+//
+// With -r it reads the input reports of the Pinscape units while the
+// outputs are updated, first with LWZ_RAWREAD and then with LWZ_INPUT_POLL,
+// and shows how long the calls take and how many reports came in.
+//
+// With -o it checks the SBA/PBA ordering instead: a port that is switched
+// on must come on at the brightness that was set before the SBA, even when
+// the library merges the calls.  Each frame sets a new brightness for one
+// port while it is off and then switches it on (or everything off again).
+// In the log of the simulated devices the brightness of a port must then
+// never change while it is on.
+//
+// With -x it times releasing the device list (as an application does on
+// exit) while the queues are backed up: a LedWiz has a second of paced raw
+// writes in front of it, and another one hangs, every report times out.
+// That must not take longer than the shutdown timeout.  The backlog is
+// dropped, only the last state that was set goes out, or with the all off
+// option of LWZ_SET_SHUTDOWN all outputs are switched off.
+//
+// With -p it compares the two ways of setting all 128 outputs of a Pinscape
+// unit: an SBA and a PBA on the unit and on each of its three virtual units,
+// and a single LWZ_SET_OUTPUTS call.  It shows the time of the calls per
+// frame and how many reports went out, and checks that the outputs of the
+// simulated unit end up the same.  Last it sets a few ports in the middle,
+// which must take one SBX and one PBX.
+//
+// With -v it sends a frame to all devices every 16.7 ms, as a front end
+// does in step with the video, first with LWZ_UPDATE_BATCH on each frame's
+// time and then with LWZ_UPDATE_FRAME two frames ahead, tagged with that
+// time.  From the log of the simulated devices it shows how far from its
+// time each frame reached the device, and how many never showed.  The
+// LedWiz can't take a frame of SBA and PBA every 16.7 ms, it must drop
+// frames rather than fall behind.
+//
+// With -u the outputs of a LedWiz and a 128 port Pinscape unit fade all
+// the time, which keeps their writes busy, while every 40 ms a solenoid is
+// switched or a flasher changes its brightness.  The flasher's port is set
+// with LWZ_SET_PRIORITY.  It shows how long the changes took to reach the
+// simulated devices; they must not wait for the fades.
+//
+// With -k it checks the vectorized packing of the PBX brightness levels
+// against the plain one, for every value at every position, and for every
+// pair of values within a block of 8 ports, then times both for the 128
+// ports of a Pinscape unit.  This runs without devices.
+//
+// With -t it measures the raw output bandwidth of each device instead, the
+// way 'lwcconfig -m' does: raw 32 byte writes as fast as the library takes
+// them.  Once the queue is full the calls return at the rate the reports
+// leave for the device.  With the simulation it also shows the spacing of
+// the reports that reached each device, which for a real LedWiz should be
+// as close to the minimum write interval as possible.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ledwiz.h>
+#include <pbxpack.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+
+#define DEFAULT_SIMULATION "ledwiz:1,lwcloneu2:2,pinscape:3,lwcloneu2:4"
+#define DEFAULT_SIM_LOG    "lwzbench_sim.log"
+#define DEFAULT_SIM_ENUM   "5000"   // per HID interface, see -c
+#define DEFAULT_SIM_PLUG   "50"     // ms between simulated arrivals, see -c
+#define DEFAULT_SIM_OTHER  "12"     // HID interfaces of other devices, see -c
+#define DEFAULT_SIM_PORTS  "pinscape:1:128"  // see -p
+#define DEFAULT_SIM_HANG   "ledwiz:1,lwcloneu2:2,pinscape:3:64,ledwiz:5:32:600000"  // see -x
+#define DEFAULT_SIM_LANES  "ledwiz:1,pinscape:2:128"  // see -u
+
+#define FRAME_PERIOD_US    16667    // 60 Hz, see -v
+#define FRAME_AHEAD_US     33333    // LWZ_UPDATE_FRAME two frames ahead
+
+#define LANES_EVENT_MS     40       // between the solenoid and flasher changes, see -u
+
+#define SHUTDOWN_BACKLOG   48       // raw writes queued per device, see -x
+#define SHUTDOWN_TIMEOUT   1000     // ms
+
+
+static double now_us(void)
+{
+	#if defined(_WIN32)
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart * 1e6 / (double)freq.QuadPart;
+	#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec * 1e-3;
+	#endif
+}
+
+static void sleep_ms(int ms)
+{
+	#if defined(_WIN32)
+	Sleep(ms);
+	#else
+	usleep(ms * 1000);
+	#endif
+}
+
+static int cmp_double(void const *a, void const *b)
+{
+	double const da = *(double const *)a;
+	double const db = *(double const *)b;
+	return (da > db) - (da < db);
+}
+
+typedef struct {
+	char const *name;
+	double *samples;
+	int count;
+} series_t;
+
+static void series_print(series_t *s)
+{
+	if (s->count == 0)
+		return;
+
+	qsort(s->samples, s->count, sizeof(double), cmp_double);
+
+	double sum = 0;
+	for (int i = 0; i < s->count; i++)
+		sum += s->samples[i];
+
+	printf("%-4s %7d calls   min %8.2f   avg %8.2f   median %8.2f   p99 %8.2f   max %9.2f  [us]\n",
+		s->name,
+		s->count,
+		s->samples[0],
+		sum / s->count,
+		s->samples[s->count / 2],
+		s->samples[(s->count * 99) / 100],
+		s->samples[s->count - 1]);
+}
+
+// count the reports each simulated unit received, from the log of the simulation
+static void print_delivery(char const *logname, LWZDEVICELIST const *plist, double duration_us)
+{
+	FILE *f = fopen(logname, "r");
+	if (f == NULL)
+		return;
+
+	long count[LWZ_MAX_DEVICES + 1] = { 0 };
+	double first[LWZ_MAX_DEVICES + 1] = { 0 };
+	double last[LWZ_MAX_DEVICES + 1] = { 0 };
+
+	char line[512];
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		double t;
+		int unit;
+		if (sscanf(line, "%lf %d", &t, &unit) != 2 || unit < 1 || unit > LWZ_MAX_DEVICES)
+			continue;
+
+		if (count[unit]++ == 0)
+			first[unit] = t;
+		last[unit] = t;
+	}
+
+	fclose(f);
+
+	for (int i = 0; i < plist->numdevices; i++)
+	{
+		LWZHANDLE const hlwz = plist->handles[i];
+
+		if (hlwz < 1 || hlwz > LWZ_MAX_DEVICES || count[hlwz] == 0)
+			continue;
+
+		LWZDEVICEINFO info;
+		memset(&info, 0x00, sizeof(info));
+		info.cbSize = sizeof(info);
+		LWZ_GET_DEVICE_INFO(hlwz, &info);
+
+		printf("unit %2d %-32.32s %7ld reports   %7.1f reports/s   last one %8.1f ms after the calls\n",
+			hlwz,
+			info.szName,
+			count[hlwz],
+			count[hlwz] * 1e6 / duration_us,
+			(last[hlwz] - first[hlwz] - duration_us) * 1e-3);
+	}
+}
+
+// the time between consecutive reports of each simulated unit
+static void print_spacing(char const *logname, LWZDEVICELIST const *plist)
+{
+	FILE *f = fopen(logname, "r");
+	if (f == NULL)
+		return;
+
+	series_t gaps[LWZ_MAX_DEVICES + 1];
+	double last[LWZ_MAX_DEVICES + 1];
+	int capacity = 1024;
+
+	for (int i = 0; i <= LWZ_MAX_DEVICES; i++)
+	{
+		gaps[i].name = "gap";
+		gaps[i].samples = (double*)malloc(capacity * sizeof(double));
+		gaps[i].count = 0;
+		last[i] = -1;
+	}
+
+	char line[512];
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		double t;
+		int unit;
+		if (sscanf(line, "%lf %d", &t, &unit) != 2 || unit < 1 || unit > LWZ_MAX_DEVICES)
+			continue;
+
+		series_t * const s = &gaps[unit];
+
+		// longer pauses are idle time, not the spacing of a burst
+		if (last[unit] >= 0 && t - last[unit] < 100000 && s->samples != NULL && s->count < capacity)
+			s->samples[s->count++] = t - last[unit];
+
+		last[unit] = t;
+	}
+
+	fclose(f);
+
+	for (int i = 0; i < plist->numdevices; i++)
+	{
+		LWZHANDLE const hlwz = plist->handles[i];
+
+		if (hlwz >= 1 && hlwz <= LWZ_MAX_DEVICES && gaps[hlwz].count > 0)
+		{
+			printf("unit %2d ", hlwz);
+			series_print(&gaps[hlwz]);
+		}
+	}
+
+	for (int i = 0; i <= LWZ_MAX_DEVICES; i++)
+		free(gaps[i].samples);
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	return 0;
+}
+
+// check the log of the simulation for ports that changed the brightness
+// while on, returns the number of violations found
+static int check_ordering(char const *logname)
+{
+	FILE *f = fopen(logname, "r");
+	if (f == NULL)
+	{
+		printf("can't open %s\n", logname);
+		return -1;
+	}
+
+	// last seen state per unit and port, -1 = port off
+	static int level[LWZ_MAX_DEVICES + 1][128];
+	memset(level, 0xff, sizeof(level));
+
+	int nlines = 0;
+	int nviolations = 0;
+
+	static char line[1024];
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		int unit;
+		char const *pon = strstr(line, " on=");
+		char const *ppr = strstr(line, " pr=");
+
+		if (sscanf(line, "%*s %d", &unit) != 1 || unit < 1 || unit > LWZ_MAX_DEVICES || pon == NULL || ppr == NULL)
+			continue;
+
+		pon += 4;
+		ppr += 4;
+		nlines++;
+
+		for (int port = 0; port < 128 && ppr[port * 2] != ' ' && ppr[port * 2] != '\0'; port++)
+		{
+			bool const on = ((hexval(pon[port / 4]) >> (port % 4)) & 1) != 0;
+			int const pr = hexval(ppr[port * 2]) * 16 + hexval(ppr[port * 2 + 1]);
+
+			if (on && level[unit][port] >= 0 && level[unit][port] != pr)
+			{
+				if (nviolations < 10)
+					printf("unit %d port %d: brightness %d -> %d while on\n", unit, port + 1, level[unit][port], pr);
+				nviolations++;
+			}
+
+			level[unit][port] = on ? pr : -1;
+		}
+	}
+
+	fclose(f);
+
+	printf("ordering: %d reports checked, %d violation(s)\n", nlines, nviolations);
+
+	return nviolations;
+}
+
+// raw writes to one device, returns the steady state rate in bytes per second
+static double measure_throughput(LWZHANDLE hlwz, int duration_ms)
+{
+	uint8_t buf[32];
+	memset(buf, 0x00, sizeof(buf));
+	buf[0] = 64;   // SBA, all off
+
+	// the first half fills the queue, the second half is measured
+	long nsend = 0;
+	double const tstart = now_us();
+	double tmeasure = 0;
+
+	for (;;)
+	{
+		double const t = now_us();
+
+		if (t - tstart > duration_ms * 1e3)
+			break;
+
+		if (tmeasure == 0 && t - tstart > duration_ms * 0.5e3)
+		{
+			tmeasure = t;
+			nsend = 0;
+		}
+
+		LWZ_RAWWRITE(hlwz, buf, sizeof(buf));
+		nsend += sizeof(buf);
+	}
+
+	return nsend * 1e6 / (now_us() - tmeasure);
+}
+
+// read input for the given time while the outputs are kept busy,
+// returns the number of reports
+static long read_input(LWZDEVICELIST const *plist, bool const *pinput, bool poll, series_t *pseries, int duration_ms)
+{
+	long nreports = 0;
+	double const tstart = now_us();
+
+	for (int frame = 0; now_us() - tstart < duration_ms * 1e3; frame++)
+	{
+		for (int i = 0; i < plist->numdevices; i++)
+		{
+			uint8_t const bank = (uint8_t)(1u << (frame & 7));
+			LWZ_SBA(plist->handles[i], bank, bank, bank, bank, 2);
+		}
+
+		for (int i = 0; i < plist->numdevices; i++)
+		{
+			if (!pinput[i])
+				continue;
+
+			uint8_t buf[64];
+
+			double const t0 = now_us();
+			uint32_t const n = poll ?
+				LWZ_INPUT_POLL(plist->handles[i], buf, sizeof(buf)) :
+				LWZ_RAWREAD(plist->handles[i], buf, sizeof(buf));
+			double const t1 = now_us();
+
+			if (pseries->count < 100000)
+				pseries->samples[pseries->count++] = t1 - t0;
+
+			if (n > 0)
+				nreports++;
+		}
+
+		sleep_ms(1);
+	}
+
+	return nreports;
+}
+
+// upper bound of the histogram bucket that holds the given fraction of the
+// samples, see LWZ_STATS_BUCKETS
+static double hist_percentile(DWORD const *phist, double fraction)
+{
+	double total = 0;
+	for (int i = 0; i < LWZ_STATS_BUCKETS; i++)
+		total += phist[i];
+
+	if (total == 0)
+		return 0;
+
+	double count = 0;
+	for (int i = 0; i < LWZ_STATS_BUCKETS; i++)
+	{
+		count += phist[i];
+
+		if (count >= total * fraction)
+			return i < 8 ? (double)(i + 1) : (double)((9 + i % 8) << (i / 8 - 1));
+	}
+
+	return 0;
+}
+
+static void print_stats(LWZDEVICELIST const *plist)
+{
+	for (int i = 0; i < plist->numdevices; i++)
+	{
+		LWZSTATS stats;
+		memset(&stats, 0x00, sizeof(stats));
+		stats.cbSize = sizeof(stats);
+
+		if (!LWZ_GET_STATS(plist->handles[i], &stats, 1))
+			continue;
+
+		printf("unit %2d  %7u enqueued  %7u coalesced  %7u written  %4u failed  %4u timed out  queue %2u"
+			"   latency p50 %7.0f p99 %7.0f   write p50 %5.0f p99 %5.0f  [us]\n",
+			plist->handles[i],
+			stats.dwEnqueued,
+			stats.dwCoalesced,
+			stats.dwWritten,
+			stats.dwFailed,
+			stats.dwTimedOut,
+			stats.dwQueueHighWater,
+			hist_percentile(stats.dwLatencyHist, 0.50),
+			hist_percentile(stats.dwLatencyHist, 0.99),
+			hist_percentile(stats.dwWriteHist, 0.50),
+			hist_percentile(stats.dwWriteHist, 0.99));
+	}
+}
+
+#define CONTENTION_THREADS  4
+
+typedef struct {
+	LWZDEVICELIST const *plist;
+	int thread;
+	int interval_ms;
+	volatile bool stop;
+	series_t sba;
+	series_t pba;
+} worker_t;
+
+#if defined(_WIN32)
+static DWORD WINAPI worker_proc(LPVOID param)
+#else
+static void * worker_proc(void *param)
+#endif
+{
+	worker_t * const pw = (worker_t *)param;
+	int const max_samples = 100000;
+
+	for (int frame = 0; !pw->stop && pw->sba.count < max_samples; frame++)
+	{
+		for (int i = 0; i < pw->plist->numdevices && pw->sba.count < max_samples; i++)
+		{
+			LWZHANDLE const hlwz = pw->plist->handles[i];
+
+			// each thread has its own pattern, so that the calls change something
+			uint8_t const bank = (uint8_t)(1u << ((frame + pw->thread) & 7));
+
+			double t0 = now_us();
+			LWZ_SBA(hlwz, bank, bank, bank, bank, 2);
+			double t1 = now_us();
+			pw->sba.samples[pw->sba.count++] = t1 - t0;
+
+			uint8_t mode[32];
+			for (int k = 0; k < 32; k++)
+				mode[k] = (uint8_t)((frame + k + pw->thread) % 49);
+
+			t0 = now_us();
+			LWZ_PBA(hlwz, mode);
+			t1 = now_us();
+			pw->pba.samples[pw->pba.count++] = t1 - t0;
+		}
+
+		if (pw->interval_ms > 0)
+			sleep_ms(pw->interval_ms);
+	}
+
+	return 0;
+}
+
+// Run the worker threads for the given time, and rescan the devices from
+// this thread meanwhile if asked to.  Returns the number of rescans.  With
+// 'pinfo', time LWZ_GET_DEVICE_INFO calls from this thread instead.
+static int run_contention(LWZDEVICELIST const *plist, int interval_ms, bool rescan, int duration_ms, double *pscan_us, series_t *pinfo)
+{
+	worker_t workers[CONTENTION_THREADS];
+
+	for (int t = 0; t < CONTENTION_THREADS; t++)
+	{
+		worker_t * const pw = &workers[t];
+		pw->plist = plist;
+		pw->thread = t;
+		pw->interval_ms = interval_ms;
+		pw->stop = false;
+		pw->sba.name = "SBA";
+		pw->sba.samples = (double*)malloc(100000 * sizeof(double));
+		pw->sba.count = 0;
+		pw->pba.name = "PBA";
+		pw->pba.samples = (double*)malloc(100000 * sizeof(double));
+		pw->pba.count = 0;
+	}
+
+	#if defined(_WIN32)
+	HANDLE threads[CONTENTION_THREADS];
+	for (int t = 0; t < CONTENTION_THREADS; t++)
+		threads[t] = CreateThread(NULL, 0, worker_proc, &workers[t], 0, NULL);
+	#else
+	pthread_t threads[CONTENTION_THREADS];
+	for (int t = 0; t < CONTENTION_THREADS; t++)
+		pthread_create(&threads[t], NULL, worker_proc, &workers[t]);
+	#endif
+
+	double const tend = now_us() + duration_ms * 1000.0;
+	int nscans = 0;
+	double scan_us = 0;
+
+	while (now_us() < tend)
+	{
+		if (rescan)
+		{
+			// what a WM_DEVICECHANGE does, without touching our list
+			double const t0 = now_us();
+			LWZ_SET_NOTIFY_EX(NULL, NULL, NULL);
+			scan_us += now_us() - t0;
+			nscans++;
+		}
+
+		if (pinfo != NULL && pinfo->count < 100000)
+		{
+			// the original size, so that only g_cs is taken, not the
+			// lock of the device that its I/O thread holds while pacing
+			LWZDEVICEINFO info;
+			info.cbSize = offsetof(LWZDEVICEINFO, dwWriteInterval);
+
+			double const t0 = now_us();
+			LWZ_GET_DEVICE_INFO(plist->handles[pinfo->count % plist->numdevices], &info);
+			pinfo->samples[pinfo->count++] = now_us() - t0;
+
+			sleep_ms(1);
+			continue;
+		}
+
+		sleep_ms(10);
+	}
+
+	for (int t = 0; t < CONTENTION_THREADS; t++)
+		workers[t].stop = true;
+
+	#if defined(_WIN32)
+	WaitForMultipleObjects(CONTENTION_THREADS, threads, TRUE, INFINITE);
+	for (int t = 0; t < CONTENTION_THREADS; t++)
+		CloseHandle(threads[t]);
+	#else
+	for (int t = 0; t < CONTENTION_THREADS; t++)
+		pthread_join(threads[t], NULL);
+	#endif
+
+	// all threads together
+	series_t sba = { "SBA", (double*)malloc(CONTENTION_THREADS * 100000 * sizeof(double)), 0 };
+	series_t pba = { "PBA", (double*)malloc(CONTENTION_THREADS * 100000 * sizeof(double)), 0 };
+
+	for (int t = 0; t < CONTENTION_THREADS; t++)
+	{
+		memcpy(&sba.samples[sba.count], workers[t].sba.samples, workers[t].sba.count * sizeof(double));
+		sba.count += workers[t].sba.count;
+		memcpy(&pba.samples[pba.count], workers[t].pba.samples, workers[t].pba.count * sizeof(double));
+		pba.count += workers[t].pba.count;
+
+		free(workers[t].sba.samples);
+		free(workers[t].pba.samples);
+	}
+
+	series_print(&sba);
+	series_print(&pba);
+
+	free(sba.samples);
+	free(pba.samples);
+
+	*pscan_us = nscans > 0 ? scan_us / nscans : 0;
+
+	return nscans;
+}
+
+// how the simulated units ended up, from the log after the first 'nskip' lines
+typedef struct {
+	long nreports;
+	int non;
+} unit_end_t;
+
+static long read_end_state(char const *logname, long nskip, unit_end_t *pend)
+{
+	memset(pend, 0x00, (LWZ_MAX_DEVICES + 1) * sizeof(unit_end_t));
+
+	FILE *f = fopen(logname, "r");
+	if (f == NULL)
+		return 0;
+
+	long nlines = 0;
+
+	static char line[1024];
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		int unit;
+		char const *pon = strstr(line, " on=");
+
+		if (nlines++ < nskip)
+			continue;
+
+		if (sscanf(line, "%*s %d", &unit) != 1 || unit < 1 || unit > LWZ_MAX_DEVICES || pon == NULL)
+			continue;
+
+		pend[unit].nreports++;
+		pend[unit].non = 0;
+
+		for (pon += 4; *pon != ' ' && *pon != '\0'; pon++)
+		{
+			for (int bit = 0; bit < 4; bit++)
+				pend[unit].non += (hexval(*pon) >> bit) & 1;
+		}
+	}
+
+	fclose(f);
+
+	return nlines;
+}
+
+// fill the queues, switch everything on, and release the devices
+static void run_shutdown(char const *logname, bool all_off)
+{
+	LWZDEVICELIST list;
+	memset(&list, 0x00, sizeof(list));
+	LWZ_SET_NOTIFY(NULL, &list);
+	LWZ_SET_SHUTDOWN(SHUTDOWN_TIMEOUT, all_off);
+
+	DWORD types[LWZ_MAX_DEVICES];
+
+	for (int i = 0; i < list.numdevices; i++)
+	{
+		LWZDEVICEINFO info;
+		memset(&info, 0x00, sizeof(info));
+		info.cbSize = sizeof(info);
+		LWZ_GET_DEVICE_INFO(list.handles[i], &info);
+		types[i] = info.dwDevType;
+
+		uint8_t mode[32];
+		memset(mode, 48, sizeof(mode));
+
+		for (int k = 0; k < SHUTDOWN_BACKLOG; k++)
+			LWZ_RAWWRITE(list.handles[i], mode, sizeof(mode));
+
+		LWZ_SBA(list.handles[i], 0xff, 0xff, 0xff, 0xff, 2);
+	}
+
+	unit_end_t end[LWZ_MAX_DEVICES + 1];
+	long const nskip = read_end_state(logname, 0, end);
+
+	double const t0 = now_us();
+	LWZ_SET_NOTIFY(NULL, NULL);
+	double const t1 = now_us();
+
+	printf("%-18s released in %7.1f ms\n", all_off ? "all off:" : "keep the last state:", (t1 - t0) * 1e-3);
+
+	// the unit that hangs finishes its last write on its own
+	sleep_ms(SHUTDOWN_TIMEOUT + 500);
+	read_end_state(logname, nskip, end);
+
+	for (int i = 0; i < list.numdevices; i++)
+	{
+		int const unit = list.handles[i];
+
+		// the ports of a virtual unit are logged with the physical unit
+		if (types[i] == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+			continue;
+
+		if (end[unit].nreports == 0)
+			printf("     unit %2d  no reports after the release\n", unit);
+		else
+			printf("     unit %2d  %4ld reports after the release, %3d outputs on\n", unit, end[unit].nreports, end[unit].non);
+	}
+}
+
+// the on bits and brightness levels of a unit in the last line of the log
+static bool read_last_state(char const *logname, int unit, char *pon, char *ppr, size_t size)
+{
+	FILE *f = fopen(logname, "r");
+	if (f == NULL)
+		return false;
+
+	bool found = false;
+
+	static char line[1024];
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		int u;
+		char const *p1 = strstr(line, " on=");
+		char const *p2 = strstr(line, " pr=");
+
+		if (sscanf(line, "%*s %d", &u) != 1 || u != unit || p1 == NULL || p2 == NULL)
+			continue;
+
+		size_t const n1 = strcspn(p1 + 4, " ");
+		size_t const n2 = strcspn(p2 + 4, " ");
+		if (n1 >= size || n2 >= size)
+			continue;
+
+		memcpy(pon, p1 + 4, n1);
+		pon[n1] = '\0';
+		memcpy(ppr, p2 + 4, n2);
+		ppr[n2] = '\0';
+		found = true;
+	}
+
+	fclose(f);
+
+	return found;
+}
+
+// 128 port values of a frame: 0 = off, otherwise on at that brightness
+static void ports_pattern(int frame, uint8_t *pvalues)
+{
+	for (int k = 0; k < 128; k++)
+		pvalues[k] = (frame + k) % 3 == 0 ? 0 : (uint8_t)(1 + (frame + k) % 48);
+}
+
+static DWORD ports_written(LWZHANDLE hlwz)
+{
+	LWZSTATS stats;
+	memset(&stats, 0x00, sizeof(stats));
+	stats.cbSize = sizeof(stats);
+	LWZ_GET_STATS(hlwz, &stats, 0);
+	return stats.dwWritten;
+}
+
+// all outputs of a Pinscape unit, through the virtual units or in one call
+static int run_ports(char const *logname, int frames, int interval_ms, bool extended, char *pon, char *ppr, size_t size)
+{
+	LWZDEVICELIST list;
+	memset(&list, 0x00, sizeof(list));
+	LWZ_SET_NOTIFY(NULL, &list);
+
+	if (list.numdevices != 4)
+	{
+		printf("expected a Pinscape unit with 3 virtual units, found %d unit(s)\n", list.numdevices);
+		LWZ_SET_NOTIFY(NULL, NULL);
+		return 1;
+	}
+
+	LWZHANDLE const hlwz = list.handles[0];
+	series_t calls = { extended ? "SET" : "VIRT", (double*)malloc(frames * sizeof(double)), 0 };
+
+	if (calls.samples == NULL)
+		return 1;
+
+	if (extended)
+		printf("LWZ_SET_OUTPUTS, 1 call per frame\n");
+	else
+		printf("LWZ_PBA and LWZ_SBA on the unit and its virtual units, 8 calls per frame\n");
+
+	// the brightness of a port that is off doesn't change with
+	// LWZ_SET_OUTPUTS, the same for the PBA calls
+	uint8_t mode[128];
+	memset(mode, 48, sizeof(mode));
+
+	DWORD const nwritten = ports_written(hlwz);
+
+	for (int frame = 0; frame < frames; frame++)
+	{
+		uint8_t values[128];
+		ports_pattern(frame, values);
+
+		double const t0 = now_us();
+
+		if (extended)
+		{
+			LWZ_SET_OUTPUTS(hlwz, 1, 128, values);
+		}
+		else
+		{
+			for (int i = 0; i < 4; i++)
+			{
+				uint8_t banks[4] = { 0, 0, 0, 0 };
+
+				for (int k = 0; k < 32; k++)
+				{
+					uint8_t const v = values[i * 32 + k];
+					if (v != 0)
+					{
+						mode[i * 32 + k] = v;
+						banks[k / 8] |= (uint8_t)(1u << (k % 8));
+					}
+				}
+
+				LWZ_PBA(list.handles[i], &mode[i * 32]);
+				LWZ_SBA(list.handles[i], banks[0], banks[1], banks[2], banks[3], 2);
+			}
+		}
+
+		calls.samples[calls.count++] = now_us() - t0;
+
+		if (interval_ms > 0)
+			sleep_ms(interval_ms);
+	}
+
+	// wait for the last frame
+	sleep_ms(200);
+
+	series_print(&calls);
+	printf("     %u reports, %.1f per frame\n",
+		(unsigned)(ports_written(hlwz) - nwritten), (double)(ports_written(hlwz) - nwritten) / frames);
+
+	int result = read_last_state(logname, hlwz, pon, ppr, size) ? 0 : 1;
+
+	if (extended)
+	{
+		// ports 40-42 are in one block of 8 and one block of 32
+		uint8_t values[3] = { 0, 7, 129 };
+		DWORD const n0 = ports_written(hlwz);
+		int32_t const nset = LWZ_SET_OUTPUTS(hlwz, 40, 3, values);
+		sleep_ms(50);
+		DWORD const n1 = ports_written(hlwz);
+
+		printf("     ports 40-42: %d set, %u report(s)\n", nset, (unsigned)(n1 - n0));
+		if (nset != 3 || n1 - n0 != 2)
+			result = 1;
+
+		// the range is cut at the last output
+		if (LWZ_SET_OUTPUTS(hlwz, 127, 8, values) != 2 || LWZ_SET_OUTPUTS(hlwz, 129, 1, values) != 0)
+		{
+			printf("     the range isn't cut at port 128\n");
+			result = 1;
+		}
+	}
+
+	LWZ_SET_NOTIFY(NULL, NULL);
+	free(calls.samples);
+
+	return result;
+}
+
+static bool pbx_compare(uint8_t const *pvalues, int nblocks)
+{
+	uint8_t want[16 * 6], got[16 * 6];
+
+	lwz_pbx_pack_scalar(want, pvalues, nblocks);
+	lwz_pbx_pack(got, pvalues, nblocks);
+
+	return memcmp(want, got, nblocks * 6) == 0;
+}
+
+static int run_pbx_check(void)
+{
+	#if defined(PBXPACK_SSE2)
+	printf("PBX packing: SSE2\n");
+	#elif defined(PBXPACK_NEON)
+	printf("PBX packing: NEON\n");
+	#else
+	printf("PBX packing: scalar only\n");
+	#endif
+
+	uint8_t values[128];
+	long nchecked = 0;
+	long nfailed = 0;
+
+	// every value at every position, on top of every background value
+	for (int fill = 0; fill < 256; fill++)
+	{
+		for (int pos = 0; pos < 32; pos++)
+		{
+			for (int v = 0; v < 256; v++)
+			{
+				memset(values, fill, 32);
+				values[pos] = (uint8_t)v;
+				nfailed += pbx_compare(values, 4) ? 0 : 1;
+				nchecked++;
+			}
+		}
+	}
+
+	// every pair of values at every pair of positions of a block, in both
+	// halves of a vector
+	for (int half = 0; half < 2; half++)
+	{
+		for (int p1 = 0; p1 < 8; p1++)
+		{
+			for (int p2 = p1 + 1; p2 < 8; p2++)
+			{
+				for (int v = 0; v < 65536; v++)
+				{
+					memset(values, 0, 16);
+					values[half * 8 + p1] = (uint8_t)(v & 0xFF);
+					values[half * 8 + p2] = (uint8_t)(v >> 8);
+					nfailed += pbx_compare(values, 2) ? 0 : 1;
+					nchecked++;
+				}
+			}
+		}
+	}
+
+	// random levels, for every number of blocks up to 128 ports
+	unsigned int seed = 12345;
+	for (int n = 0; n < 100000; n++)
+	{
+		for (int k = 0; k < 128; k++)
+		{
+			seed = seed * 1103515245 + 12345;
+			values[k] = (uint8_t)(seed >> 16);
+		}
+
+		nfailed += pbx_compare(values, 1 + n % 16) ? 0 : 1;
+		nchecked++;
+	}
+
+	printf("     %ld cases checked, %ld mismatch(es)\n", nchecked, nfailed);
+
+	// the 128 ports of a Pinscape unit, with some flash codes
+	for (int k = 0; k < 128; k++)
+		values[k] = (uint8_t)(k % 5 == 0 ? 129 + k % 4 : k % 49);
+
+	int const nloops = 1000000;
+	uint8_t packed[16 * 6];
+	unsigned int sum = 0;
+
+	for (int impl = 0; impl < 2; impl++)
+	{
+		double const t0 = now_us();
+
+		for (int n = 0; n < nloops; n++)
+		{
+			// a different value each time, so that nothing is hoisted out of the loop
+			values[n & 127] ^= 1;
+
+			if (impl == 0)
+				lwz_pbx_pack_scalar(packed, values, 16);
+			else
+				lwz_pbx_pack(packed, values, 16);
+
+			sum += packed[n % sizeof(packed)];
+		}
+
+		double const t1 = now_us();
+
+		printf("%-7s %7.1f ns per 128 ports\n", impl == 0 ? "scalar" : "packed", (t1 - t0) * 1e3 / nloops);
+	}
+
+	// keeps the loops from being optimized away
+	if (sum == 0xFFFFFFFF)
+		printf("\n");
+
+	return nfailed == 0 ? 0 : 1;
+}
+
+// wait until the given LWZ_GET_TIME()
+static void wait_until_us(int64_t t_us)
+{
+	for (;;)
+	{
+		int64_t const dt = t_us - LWZ_GET_TIME();
+
+		if (dt <= 0)
+			return;
+
+		if (dt > 2000)
+			sleep_ms(1);
+	}
+}
+
+// The on bits of frame k are k in the first two banks and a marker in the
+// others, so that the log shows when each frame reached a device.
+static int frame_of_log_line(char const *line)
+{
+	char const *pon = strstr(line, " on=");
+	if (pon == NULL)
+		return -1;
+
+	uint8_t banks[4] = { 0, 0, 0, 0 };
+
+	for (int i = 0; i < 8; i++)
+	{
+		banks[i / 2] |= (uint8_t)(hexval(pon[4 + i]) << (4 * (i % 2)));
+	}
+
+	if (banks[2] != 0xA5 || banks[3] != 0x5A)
+		return -1;
+
+	return banks[0] | (banks[1] << 8);
+}
+
+static int cmp_int64(void const *a, void const *b)
+{
+	int64_t const da = *(int64_t const *)a;
+	int64_t const db = *(int64_t const *)b;
+	return (da > db) - (da < db);
+}
+
+// one frame every FRAME_PERIOD_US to all devices, on time or tagged ahead
+static void run_frames(char const *logname, LWZDEVICELIST const *plist, int frames, bool timed)
+{
+	int64_t * const ptimes = (int64_t*)malloc(frames * sizeof(int64_t));
+	int64_t * const perrors = (int64_t*)malloc(frames * sizeof(int64_t));
+	int64_t (* const parrival)[LWZ_MAX_DEVICES + 1] = (int64_t (*)[LWZ_MAX_DEVICES + 1])calloc(frames, sizeof(*parrival));
+
+	if (ptimes == NULL || perrors == NULL || parrival == NULL)
+		return;
+
+	unit_end_t end[LWZ_MAX_DEVICES + 1];
+	long const nskip = read_end_state(logname, 0, end);
+
+	for (int i = 0; i < plist->numdevices; i++)
+	{
+		LWZSTATS tmp;
+		tmp.cbSize = sizeof(tmp);
+		LWZ_GET_STATS(plist->handles[i], &tmp, 1);
+	}
+
+	int64_t const tstart = LWZ_GET_TIME() + FRAME_AHEAD_US + 50000;
+
+	for (int k = 0; k < frames; k++)
+	{
+		ptimes[k] = tstart + (int64_t)k * FRAME_PERIOD_US;
+
+		LWZUPDATE updates[LWZ_MAX_DEVICES];
+		memset(updates, 0x00, sizeof(updates));
+
+		for (int i = 0; i < plist->numdevices; i++)
+		{
+			LWZUPDATE * const pu = &updates[i];
+
+			pu->hlwz = plist->handles[i];
+			pu->flags = LWZ_UPDATE_SBA | LWZ_UPDATE_PBA;
+			pu->banks[0] = (uint8_t)(k & 0xFF);
+			pu->banks[1] = (uint8_t)(k >> 8);
+			pu->banks[2] = 0xA5;
+			pu->banks[3] = 0x5A;
+			pu->globalPulseSpeed = 2;
+
+			for (int j = 0; j < 32; j++)
+				pu->brightness[j] = (uint8_t)(1 + (k + j) % 48);
+		}
+
+		if (timed)
+		{
+			wait_until_us(ptimes[k] - FRAME_AHEAD_US);
+			LWZ_UPDATE_FRAME(updates, plist->numdevices, ptimes[k]);
+		}
+		else
+		{
+			wait_until_us(ptimes[k]);
+			LWZ_UPDATE_BATCH(updates, plist->numdevices);
+		}
+	}
+
+	sleep_ms(300);
+
+	// The time each frame showed on each unit: the report that switched
+	// to its on bits, not the ones that went before while the outputs
+	// still showed the previous frame.
+	FILE *f = fopen(logname, "r");
+	if (f != NULL)
+	{
+		long nlines = 0;
+		int shows[LWZ_MAX_DEVICES + 1];
+
+		for (int unit = 0; unit <= LWZ_MAX_DEVICES; unit++)
+			shows[unit] = -1;
+
+		static char line[1024];
+		while (fgets(line, sizeof(line), f) != NULL)
+		{
+			long long t;
+			int unit;
+
+			bool const before = nlines++ < nskip;
+
+			if (sscanf(line, "%lld %d", &t, &unit) != 2 || unit < 1 || unit > LWZ_MAX_DEVICES)
+				continue;
+
+			int const k = frame_of_log_line(line);
+
+			if (!before && k != shows[unit] && k >= 0 && k < frames && parrival[k][unit] == 0)
+				parrival[k][unit] = (int64_t)t;
+
+			shows[unit] = k;
+		}
+
+		fclose(f);
+	}
+
+	printf("%s\n", timed ? "LWZ_UPDATE_FRAME, two frames ahead" : "LWZ_UPDATE_BATCH, on each frame's time");
+
+	for (int i = 0; i < plist->numdevices; i++)
+	{
+		int const unit = plist->handles[i];
+		int nshown = 0;
+
+		for (int k = 0; k < frames; k++)
+		{
+			if (parrival[k][unit] != 0)
+				perrors[nshown++] = parrival[k][unit] - ptimes[k];
+		}
+
+		LWZDEVICEINFO info;
+		memset(&info, 0x00, sizeof(info));
+		info.cbSize = sizeof(info);
+		LWZ_GET_DEVICE_INFO(unit, &info);
+
+		if (nshown == 0)
+		{
+			printf("unit %2d %-28.28s no frames showed\n", unit, info.szName);
+			continue;
+		}
+
+		qsort(perrors, nshown, sizeof(int64_t), cmp_int64);
+
+		printf("unit %2d %-28.28s %4d of %d frames showed   off their time by min %+7.2f  median %+7.2f  p95 %+7.2f  max %+7.2f  [ms]\n",
+			unit, info.szName, nshown, frames,
+			perrors[0] * 1e-3, perrors[nshown / 2] * 1e-3, perrors[(nshown * 95) / 100] * 1e-3, perrors[nshown - 1] * 1e-3);
+
+		LWZSTATS stats;
+		memset(&stats, 0x00, sizeof(stats));
+		stats.cbSize = sizeof(stats);
+
+		if (timed && LWZ_GET_STATS(unit, &stats, 0))
+		{
+			printf("        %u frames shown, %u dropped, writes completed within p50 %.0f p99 %.0f [us] of the frame's time\n",
+				stats.dwFramesShown, stats.dwFramesDropped,
+				hist_percentile(stats.dwPresentHist, 0.50), hist_percentile(stats.dwPresentHist, 0.99));
+		}
+	}
+
+	free(ptimes);
+	free(perrors);
+	free(parrival);
+}
+
+// Ports 1 and 2 of each device are a solenoid and a flasher, the others
+// fade all the time.  'solenoid' switches port 1, 'flasher' is the level of
+// port 2, which is always on.
+static void lanes_values(int frame, bool solenoid, int flasher, uint8_t *pvalues, int nports)
+{
+	pvalues[0] = solenoid ? 48 : 0;
+	pvalues[1] = (uint8_t)flasher;
+
+	for (int k = 2; k < nports; k++)
+		pvalues[k] = (uint8_t)(1 + (frame + k) % 48);
+}
+
+static void lanes_update(LWZHANDLE hlwz, bool pinscape, int frame, bool solenoid, int flasher)
+{
+	uint8_t values[128];
+	lanes_values(frame, solenoid, flasher, values, pinscape ? 128 : 32);
+
+	if (pinscape)
+	{
+		LWZ_SET_OUTPUTS(hlwz, 1, 128, values);
+		return;
+	}
+
+	// the LedWiz has port 1 at full brightness, the SBA switches it
+	values[0] = 48;
+	LWZ_PBA(hlwz, values);
+	LWZ_SBA(hlwz, solenoid ? 0xFF : 0xFE, 0xFF, 0xFF, 0xFF, 2);
+}
+
+static void lanes_print(char const *name, int64_t *platency, int n, int nevents)
+{
+	if (n == 0)
+	{
+		printf("        %-9s never changed\n", name);
+		return;
+	}
+
+	qsort(platency, n, sizeof(int64_t), cmp_int64);
+
+	printf("        %-9s %3d of %d changes   latency min %6.2f  median %6.2f  p95 %6.2f  max %6.2f  [ms]\n",
+		name, n, nevents,
+		platency[0] * 1e-3, platency[n / 2] * 1e-3, platency[(n * 95) / 100] * 1e-3, platency[n - 1] * 1e-3);
+}
+
+// fades on every device, and every LANES_EVENT_MS the solenoid or the flasher changes
+static void run_lanes(char const *logname, LWZDEVICELIST const *plist, int frames, int interval_ms)
+{
+	LWZHANDLE units[LWZ_MAX_DEVICES];
+	bool pinscape[LWZ_MAX_DEVICES];
+	int nunits = 0;
+
+	// the physical devices, the Pinscape unit is set through LWZ_SET_OUTPUTS
+	for (int i = 0; i < plist->numdevices; i++)
+	{
+		LWZDEVICEINFO info;
+		memset(&info, 0x00, sizeof(info));
+		info.cbSize = sizeof(info);
+		LWZ_GET_DEVICE_INFO(plist->handles[i], &info);
+
+		if (info.dwDevType == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+			continue;
+
+		units[nunits] = plist->handles[i];
+		pinscape[nunits] = info.dwDevType == LWZ_DEVICE_TYPE_PINSCAPE;
+		nunits++;
+	}
+
+	int const nevents = frames * interval_ms / LANES_EVENT_MS;
+	if (nevents < 2 || interval_ms <= 0)
+		return;
+
+	int64_t * const ptcall = (int64_t*)malloc(nevents * sizeof(int64_t));
+	int * const pvalue = (int*)malloc(nevents * sizeof(int));
+	int64_t * const platency = (int64_t*)malloc(2 * nevents * sizeof(int64_t));
+
+	if (ptcall == NULL || pvalue == NULL || platency == NULL)
+		return;
+
+	for (int i = 0; i < nunits; i++)
+	{
+		LWZ_SET_PRIORITY(units[i], 0x02, 0, 0, 0);
+		lanes_update(units[i], pinscape[i], 0, false, 10);
+	}
+
+	sleep_ms(200);
+
+	unit_end_t end[LWZ_MAX_DEVICES + 1];
+	long const nskip = read_end_state(logname, 0, end);
+
+	for (int i = 0; i < nunits; i++)
+	{
+		LWZSTATS tmp;
+		tmp.cbSize = sizeof(tmp);
+		LWZ_GET_STATS(units[i], &tmp, 1);
+	}
+
+	bool solenoid = false;
+	int flasher = 10;
+	int event = 0;
+
+	int64_t const tstart = LWZ_GET_TIME();
+
+	for (int frame = 0; event < nevents; frame++)
+	{
+		int64_t const t = tstart + (int64_t)frame * interval_ms * 1000;
+		wait_until_us(t);
+
+		// even events switch the solenoid, odd ones change the flasher
+		bool const due = t >= tstart + (int64_t)(event + 1) * LANES_EVENT_MS * 1000;
+
+		if (due)
+		{
+			if ((event & 1) == 0)
+				solenoid = !solenoid;
+			else
+				flasher = flasher == 10 ? 40 : 10;
+		}
+
+		int64_t const tcall = LWZ_GET_TIME();
+
+		for (int i = 0; i < nunits; i++)
+			lanes_update(units[i], pinscape[i], frame, solenoid, flasher);
+
+		if (due)
+		{
+			ptcall[event] = tcall;
+			pvalue[event] = (event & 1) == 0 ? solenoid : flasher;
+			event++;
+		}
+	}
+
+	sleep_ms(300);
+
+	for (int i = 0; i < nunits; i++)
+	{
+		int const unit = units[i];
+
+		// The first report after each call that shows its change: port 1
+		// switched, or port 2 at its new level.  The events of a kind take
+		// turns between two values, so a report with the old one is from
+		// before the change.
+		int next[2] = { 0, 1 };
+		int nlatency[2] = { 0, 0 };
+
+		FILE *f = fopen(logname, "r");
+		if (f != NULL)
+		{
+			long nlines = 0;
+
+			static char line[1024];
+			while (fgets(line, sizeof(line), f) != NULL)
+			{
+				long long tlog;
+				int u;
+				char const *pon = strstr(line, " on=");
+				char const *ppr = strstr(line, " pr=");
+
+				if (nlines++ < nskip)
+					continue;
+
+				if (sscanf(line, "%lld %d", &tlog, &u) != 2 || u != unit || pon == NULL || ppr == NULL)
+					continue;
+
+				int const now[2] = { hexval(pon[4]) & 1, hexval(ppr[6]) * 16 + hexval(ppr[7]) };
+
+				for (int k = 0; k < 2; k++)
+				{
+					int const e = next[k];
+
+					if (e < nevents && tlog >= ptcall[e] && now[k] == pvalue[e])
+					{
+						platency[k * nevents + nlatency[k]++] = tlog - ptcall[e];
+						next[k] += 2;
+					}
+				}
+			}
+
+			fclose(f);
+		}
+
+		LWZDEVICEINFO info;
+		memset(&info, 0x00, sizeof(info));
+		info.cbSize = sizeof(info);
+		LWZ_GET_DEVICE_INFO(unit, &info);
+
+		LWZSTATS stats;
+		memset(&stats, 0x00, sizeof(stats));
+		stats.cbSize = sizeof(stats);
+		LWZ_GET_STATS(unit, &stats, 0);
+
+		printf("unit %2d %-28.28s %u writes cut short for an urgent change\n", unit, info.szName, stats.dwPreempted);
+
+		lanes_print("solenoid", &platency[0], nlatency[0], (nevents + 1) / 2);
+		lanes_print("flasher", &platency[nevents], nlatency[1], nevents / 2);
+	}
+
+	free(ptcall);
+	free(pvalue);
+	free(platency);
+}
+
+static void usage(void)
+{
+	printf(
+		"usage: lwzbench [-f frames] [-i interval_ms] [-b] [-c] [-k] [-o] [-p] [-r] [-s] [-t] [-u] [-v] [-x]\n"
+		"\n"
+		"  -f frames       number of update bursts (default 2000)\n"
+		"  -i interval_ms  pause between bursts (default 2)\n"
+		"  -b              send each frame with LWZ_UPDATE_BATCH\n"
+		"  -c              time the calls of %d threads during rescans instead\n"
+		"  -k              check and time the PBX packing instead, without devices\n"
+		"  -o              check the SBA/PBA ordering instead\n"
+		"  -p              set the 128 outputs of a Pinscape unit with LWZ_SET_OUTPUTS instead\n"
+		"  -r              time reading the input reports instead\n"
+		"  -s              show the statistics of each device after the run\n"
+		"  -t              measure the raw output bandwidth instead\n"
+		"  -u              time on/off changes while the outputs fade instead\n"
+		"  -v              time frames sent in step with the video instead\n"
+		"  -x              time releasing the devices with full queues instead\n"
+		"\n"
+		"If LWZ_SIMULATE is not set, '%s' is used\n"
+		"and the delivered reports are counted through '%s'.\n",
+		CONTENTION_THREADS, DEFAULT_SIMULATION, DEFAULT_SIM_LOG);
+}
+
+int main(int argc, char *argv[])
+{
+	int frames = 2000;
+	int interval_ms = 2;
+	bool ordering = false;
+	bool throughput = false;
+	bool batch = false;
+	bool input = false;
+	bool stats = false;
+	bool contention = false;
+	bool shutdown = false;
+	bool ports = false;
+	bool video = false;
+	bool lanes = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			frames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+			interval_ms = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-o") == 0)
+			ordering = true;
+		else if (strcmp(argv[i], "-t") == 0)
+			throughput = true;
+		else if (strcmp(argv[i], "-b") == 0)
+			batch = true;
+		else if (strcmp(argv[i], "-r") == 0)
+			input = true;
+		else if (strcmp(argv[i], "-s") == 0)
+			stats = true;
+		else if (strcmp(argv[i], "-c") == 0)
+			contention = true;
+		else if (strcmp(argv[i], "-x") == 0)
+			shutdown = true;
+		else if (strcmp(argv[i], "-p") == 0)
+			ports = true;
+		else if (strcmp(argv[i], "-v") == 0)
+			video = true;
+		else if (strcmp(argv[i], "-u") == 0)
+			lanes = true;
+		else if (strcmp(argv[i], "-k") == 0)
+			return run_pbx_check();
+		else
+		{
+			usage();
+			return 1;
+		}
+	}
+
+	char const *logname = NULL;
+
+	if (getenv("LWZ_SIMULATE") == NULL)
+	{
+		logname = DEFAULT_SIM_LOG;
+
+		#if defined(_WIN32)
+		_putenv(shutdown ? "LWZ_SIMULATE=" DEFAULT_SIM_HANG :
+			ports ? "LWZ_SIMULATE=" DEFAULT_SIM_PORTS :
+			lanes ? "LWZ_SIMULATE=" DEFAULT_SIM_LANES : "LWZ_SIMULATE=" DEFAULT_SIMULATION);
+		_putenv("LWZ_SIM_LOG=" DEFAULT_SIM_LOG);
+		#else
+		setenv("LWZ_SIMULATE", shutdown ? DEFAULT_SIM_HANG : ports ? DEFAULT_SIM_PORTS :
+			lanes ? DEFAULT_SIM_LANES : DEFAULT_SIMULATION, 1);
+		setenv("LWZ_SIM_LOG", DEFAULT_SIM_LOG, 1);
+		#endif
+
+		if (contention && getenv("LWZ_SIM_ENUM_US") == NULL)
+		{
+			#if defined(_WIN32)
+			_putenv("LWZ_SIM_ENUM_US=" DEFAULT_SIM_ENUM);
+			_putenv("LWZ_SIM_HOTPLUG_MS=" DEFAULT_SIM_PLUG);
+			_putenv("LWZ_SIM_OTHER_HID=" DEFAULT_SIM_OTHER);
+			#else
+			setenv("LWZ_SIM_ENUM_US", DEFAULT_SIM_ENUM, 1);
+			setenv("LWZ_SIM_HOTPLUG_MS", DEFAULT_SIM_PLUG, 1);
+			setenv("LWZ_SIM_OTHER_HID", DEFAULT_SIM_OTHER, 1);
+			#endif
+		}
+	}
+
+	if (shutdown)
+	{
+		if (logname == NULL)
+		{
+			printf("-x needs the default simulation\n");
+			return 1;
+		}
+
+		printf("%d raw writes queued per device, shutdown timeout %d ms\n", SHUTDOWN_BACKLOG, SHUTDOWN_TIMEOUT);
+		run_shutdown(logname, false);
+		run_shutdown(logname, true);
+
+		return 0;
+	}
+
+	if (ports)
+	{
+		if (logname == NULL)
+		{
+			printf("-p needs the default simulation\n");
+			return 1;
+		}
+
+		char on[2][64], pr[2][512];
+
+		printf("%d frames, %d ms between frames\n", frames, interval_ms);
+		int result = run_ports(logname, frames, interval_ms, false, on[0], pr[0], sizeof(pr[0]));
+		result |= run_ports(logname, frames, interval_ms, true, on[1], pr[1], sizeof(pr[1]));
+
+		if (result == 0 && (strcmp(on[0], on[1]) != 0 || strcmp(pr[0], pr[1]) != 0))
+		{
+			printf("the outputs differ:\n  on=%s\n  on=%s\n", on[0], on[1]);
+			result = 1;
+		}
+
+		printf(result == 0 ? "outputs match\n" : "FAILED\n");
+
+		return result;
+	}
+
+	LWZDEVICELIST list;
+	memset(&list, 0x00, sizeof(list));
+
+	double const tscan_us = now_us();
+	LWZ_SET_NOTIFY(NULL, &list);
+	double const first_scan_us = now_us() - tscan_us;
+
+	if (list.numdevices <= 0)
+	{
+		printf("no devices found\n");
+		return 1;
+	}
+
+	printf("%d device(s), %d frames, %d ms between frames\n", list.numdevices, frames, interval_ms);
+
+	if (video)
+	{
+		if (logname == NULL)
+		{
+			printf("-v needs the default simulation\n");
+			return 1;
+		}
+
+		// five seconds of 60 Hz at most
+		int const nframes = frames < 300 ? frames : 300;
+
+		run_frames(logname, &list, nframes, false);
+		run_frames(logname, &list, nframes, true);
+
+		LWZ_SET_NOTIFY(NULL, NULL);
+
+		return 0;
+	}
+
+	if (lanes)
+	{
+		if (logname == NULL)
+		{
+			printf("-u needs the default simulation\n");
+			return 1;
+		}
+
+		run_lanes(logname, &list, frames, interval_ms);
+
+		LWZ_SET_NOTIFY(NULL, NULL);
+
+		return 0;
+	}
+
+	if (throughput)
+	{
+		for (int i = 0; i < list.numdevices; i++)
+		{
+			LWZHANDLE const hlwz = list.handles[i];
+
+			double const bps = measure_throughput(hlwz, 2000);
+
+			// the write interval the library ended up with
+			LWZDEVICEINFO info;
+			memset(&info, 0x00, sizeof(info));
+			info.cbSize = sizeof(info);
+			LWZ_GET_DEVICE_INFO(hlwz, &info);
+
+			printf("unit %2d %-32.32s %8.2f kByte/s   %7.1f reports/s   write interval %6.2f ms\n",
+				hlwz, info.szName, bps / 1024.0, bps / 8.0, info.dwWriteInterval * 1e-3);
+		}
+
+		LWZ_SET_NOTIFY(NULL, NULL);
+
+		if (logname != NULL)
+			print_spacing(logname, &list);
+
+		return 0;
+	}
+
+	if (contention)
+	{
+		double scan_us = 0;
+
+		printf("     first scan %.1f ms\n", first_scan_us * 1e-3);
+
+		printf("%d threads, no rescans\n", CONTENTION_THREADS);
+		run_contention(&list, interval_ms, false, 2000, &scan_us, NULL);
+
+		printf("%d threads, rescanning\n", CONTENTION_THREADS);
+		int const nscans = run_contention(&list, interval_ms, true, 2000, &scan_us, NULL);
+		printf("     %d rescans, %.3f ms each\n", nscans, scan_us * 1e-3);
+
+		// the hot plug monitor needs a registered unit
+		series_t info = { "INFO", (double*)malloc(100000 * sizeof(double)), 0 };
+
+		if (info.samples != NULL && getenv("LWZ_SIM_HOTPLUG_MS") != NULL)
+		{
+			printf("%d threads, hot plug rescans in the background\n", CONTENTION_THREADS);
+			LWZ_REGISTER(list.handles[0], (HWND)&list);
+			run_contention(&list, interval_ms, false, 2000, &scan_us, &info);
+			LWZ_REGISTER(list.handles[0], NULL);
+			series_print(&info);
+		}
+
+		free(info.samples);
+
+		LWZ_SET_NOTIFY(NULL, NULL);
+
+		return 0;
+	}
+
+	if (input)
+	{
+		// the Pinscape units send input reports all the time
+		bool has_input[LWZ_MAX_DEVICES] = { false };
+
+		for (int i = 0; i < list.numdevices; i++)
+		{
+			LWZDEVICEINFO info;
+			memset(&info, 0x00, sizeof(info));
+			info.cbSize = sizeof(info);
+			LWZ_GET_DEVICE_INFO(list.handles[i], &info);
+
+			has_input[i] = info.dwDevType == LWZ_DEVICE_TYPE_PINSCAPE;
+		}
+
+		series_t raw = { "READ", (double*)malloc(100000 * sizeof(double)), 0 };
+		series_t poll = { "POLL", (double*)malloc(100000 * sizeof(double)), 0 };
+
+		if (raw.samples == NULL || poll.samples == NULL)
+			return 1;
+
+		long const nraw = read_input(&list, has_input, false, &raw, 2000);
+		long const npoll = read_input(&list, has_input, true, &poll, 2000);
+
+		series_print(&raw);
+		printf("     %ld reports in 2 s\n", nraw);
+		series_print(&poll);
+		printf("     %ld reports in 2 s\n", npoll);
+
+		LWZ_SET_NOTIFY(NULL, NULL);
+
+		free(raw.samples);
+		free(poll.samples);
+
+		return 0;
+	}
+
+	if (ordering)
+	{
+		if (logname == NULL)
+		{
+			printf("-o needs the default simulation\n");
+			return 1;
+		}
+
+		uint8_t mode[LWZ_MAX_DEVICES][32];
+		memset(mode, 48, sizeof(mode));
+
+		for (int frame = 0; frame < frames; frame++)
+		{
+			for (int i = 0; i < list.numdevices; i++)
+			{
+				LWZHANDLE const hlwz = list.handles[i];
+				int const port = (frame / 2) % 32;
+
+				if ((frame & 1) == 0)
+				{
+					// new brightness while the port is off, then switch it on
+					mode[i][port] = (uint8_t)(1 + (frame / 2) % 48);
+					LWZ_PBA(hlwz, mode[i]);
+
+					uint8_t bank[4] = { 0, 0, 0, 0 };
+					bank[port / 8] = (uint8_t)(1u << (port % 8));
+					LWZ_SBA(hlwz, bank[0], bank[1], bank[2], bank[3], 2);
+				}
+				else
+				{
+					LWZ_SBA(hlwz, 0, 0, 0, 0, 2);
+				}
+			}
+
+			// vary the pause, so that the calls are merged differently
+			if (interval_ms > 0)
+				sleep_ms(frame % (interval_ms + 1));
+		}
+
+		LWZ_SET_NOTIFY(NULL, NULL);
+		sleep_ms(200);
+
+		return check_ordering(logname) == 0 ? 0 : 1;
+	}
+
+	int const ncalls = frames * list.numdevices;
+
+	series_t sba = { "SBA", (double*)malloc(ncalls * sizeof(double)), 0 };
+	series_t pba = { "PBA", (double*)malloc(ncalls * sizeof(double)), 0 };
+	series_t bat = { "BAT", (double*)malloc(frames * sizeof(double)), 0 };
+
+	if (sba.samples == NULL || pba.samples == NULL || bat.samples == NULL)
+		return 1;
+
+	// count only what this run does
+	for (int i = 0; stats && i < list.numdevices; i++)
+	{
+		LWZSTATS tmp;
+		tmp.cbSize = sizeof(tmp);
+		LWZ_GET_STATS(list.handles[i], &tmp, 1);
+	}
+
+	double const tstart = now_us();
+
+	for (int frame = 0; frame < frames; frame++)
+	{
+		if (batch)
+		{
+			// the same pattern, all devices in one call
+			LWZUPDATE updates[LWZ_MAX_DEVICES];
+			memset(updates, 0x00, sizeof(updates));
+
+			for (int i = 0; i < list.numdevices; i++)
+			{
+				LWZUPDATE * const pu = &updates[i];
+				uint8_t const bank = (uint8_t)(1u << (frame & 7));
+
+				pu->hlwz = list.handles[i];
+				pu->flags = LWZ_UPDATE_SBA | LWZ_UPDATE_PBA;
+				memset(pu->banks, bank, sizeof(pu->banks));
+				pu->globalPulseSpeed = 2;
+
+				for (int k = 0; k < 32; k++)
+					pu->brightness[k] = (uint8_t)((frame + k) % 49);
+			}
+
+			double t0 = now_us();
+			LWZ_UPDATE_BATCH(updates, list.numdevices);
+			double t1 = now_us();
+			bat.samples[bat.count++] = t1 - t0;
+
+			if (interval_ms > 0)
+				sleep_ms(interval_ms);
+
+			continue;
+		}
+
+		for (int i = 0; i < list.numdevices; i++)
+		{
+			LWZHANDLE const hlwz = list.handles[i];
+
+			// a moving pattern, so that no two frames are the same
+
+			uint8_t const bank = (uint8_t)(1u << (frame & 7));
+
+			double t0 = now_us();
+			LWZ_SBA(hlwz, bank, bank, bank, bank, 2);
+			double t1 = now_us();
+			sba.samples[sba.count++] = t1 - t0;
+
+			uint8_t mode[32];
+			for (int k = 0; k < 32; k++)
+				mode[k] = (uint8_t)((frame + k) % 49);
+
+			t0 = now_us();
+			LWZ_PBA(hlwz, mode);
+			t1 = now_us();
+			pba.samples[pba.count++] = t1 - t0;
+		}
+
+		if (interval_ms > 0)
+			sleep_ms(interval_ms);
+	}
+
+	double const tend = now_us();
+
+	series_print(&sba);
+	series_print(&pba);
+	series_print(&bat);
+
+	printf("total %.1f ms\n", (tend - tstart) * 1e-3);
+
+	if (logname != NULL)
+	{
+		// give the I/O threads time to write out what is still queued
+		sleep_ms(200);
+		print_delivery(logname, &list, tend - tstart);
+	}
+
+	if (stats)
+	{
+		// the writes still queued at the end have to be in as well
+		if (logname == NULL)
+			sleep_ms(200);
+
+		print_stats(&list);
+	}
+
+	// all off; releasing the devices still writes the last state
+	for (int i = 0; i < list.numdevices; i++)
+		LWZ_SBA(list.handles[i], 0, 0, 0, 0, 2);
+
+	LWZ_SET_NOTIFY(NULL, NULL);
+
+	free(sba.samples);
+	free(pba.samples);
+	free(bat.samples);
+
+	return 0;
+}